@@ -0,0 +1,352 @@
+//
+//  batch.h
+//  File Compression II
+//
+//  Compresses a list of files on one WorkStealingPool (see threadpool.h).
+//  Every file starts as a single task.  A file that fits in one block is
+//  compressed by that task from start to finish; a larger one is mapped and
+//  split into block tasks on the same pool, so idle workers steal its
+//  blocks instead of waiting on the one worker that started it.  Each file
+//  has at most two blocks per worker started but not yet placed, and its
+//  blocks are placed in order by whichever task finishes the next one, so
+//  memory use stays bounded however large the file.  Placing a block only
+//  gives it its offset in the output; the task writes it there after
+//  letting go of the file's lock, so other blocks keep being placed.
+//  Output is the same container compressFile writes (see container.h),
+//  written with positional writes so that a block stored as it is can be
+//  copied from the input file to the output file in the kernel (see
+//  copyRange).
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <future>
+#include <chrono>
+#include <sstream>
+#include <memory>
+#include <functional>
+#include "util.h"
+#include "threadpool.h"
+
+using namespace std;
+
+//
+// *This struct reports how one file of a batch went.
+//
+struct BatchResult {
+    string name;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    double seconds;          // from the file's first task to its last write
+    string error;            // why it failed; empty if it was compressed
+    CompressionStats stats;  // if the batch was given options.stats
+
+    BatchResult() : bytesIn(0), bytesOut(0), seconds(0) {
+    }
+
+    // input megabytes per second
+    double throughput() const {
+        return seconds > 0 ? bytesIn / seconds / 1e6 : 0;
+    }
+};
+
+
+//
+// *This struct is the shared state of one file being compressed.  Everything
+// but the fields set before its first task runs is guarded by lock.
+//
+struct BatchFile {
+    string name;
+    CompressOptions options;
+    size_t window;  // most blocks started but not yet written
+    chrono::steady_clock::time_point start;
+
+    shared_ptr<MappedFile> input;
+    shared_ptr<FileDescriptor> output;
+    size_t blockCount;
+    size_t nextToStart;
+    size_t nextToWrite;                     // next block to place
+    size_t written;                         // blocks written where placed
+    map<size_t, CompressedBlock> finished;  // waiting on earlier blocks
+    vector<BlockIndexEntry> index;
+    uint64_t offset;
+    uint64_t headerBytes;
+    bool ended;
+    BatchResult result;
+    promise<BatchResult> done;
+    mutex lock;
+
+    BatchFile()
+        : window(1), blockCount(0), nextToStart(0), nextToWrite(0),
+          written(0), offset(0), headerBytes(0), ended(false) {
+    }
+};
+
+
+//
+// *This struct is a block of a BatchFile that has been placed: it has left
+// finished and has its offset in the output, but is not yet written.
+//
+struct BatchWrite {
+    size_t block;
+    uint64_t offset;
+    CompressedBlock data;
+};
+
+
+//
+// *This function closes file and hands its result to whoever waits on it.
+// error is empty if the file was compressed.  file.lock must be held.
+//
+void _endBatchFile(BatchFile &file, const string &error) {
+    if (file.ended) {
+        return;
+    }
+    file.ended = true;
+    file.result.error = error;
+    file.result.seconds = chrono::duration<double>(
+        chrono::steady_clock::now() - file.start).count();
+    STATS_ONLY(
+        if (file.options.stats != nullptr) {
+            file.result.stats.totalSeconds = file.result.seconds;
+            file.result.stats.bytesIn = file.result.bytesIn;
+            file.result.stats.bytesOut = file.result.bytesOut;
+        }
+    )
+    file.finished.clear();
+    file.output.reset();
+    file.input.reset();
+    file.done.set_value(file.result);
+}
+
+
+//
+// *This function writes the file's block index, once every block is written,
+// and ends the file.  file.lock must be held.
+//
+void _finishBatchFile(BatchFile &file) {
+    ostringstream indexBytes;
+    writeBlockIndex(indexBytes, file.index);
+    file.output->writeAt(indexBytes.str().data(), indexBytes.str().size(),
+                         (off_t)file.offset);
+    file.result.bytesOut = file.offset + indexBytes.str().size();
+    STATS_ONLY(
+        if (file.options.stats != nullptr) {
+            file.result.stats.headerBytes +=
+                file.headerBytes + indexBytes.str().size();
+        }
+    )
+    _endBatchFile(file, "");
+}
+
+
+//
+// *This function compresses block i of file, places every block that is now
+// next in line, and starts more blocks as the window allows.  The placed
+// blocks are then written outside file.lock, and the task that writes the
+// last one finishes the file.  Runs on a worker of pool.
+//
+void _compressBatchBlock(WorkStealingPool &pool, shared_ptr<BatchFile> file,
+                         size_t i) {
+    size_t blockSize = file->options.blockSize;
+    size_t begin = i * blockSize;
+    size_t length = min(blockSize, file->result.bytesIn - begin);
+    try {
+        {
+            lock_guard<mutex> lock(file->lock);
+            if (file->ended) {
+                return;
+            }
+        }
+        CompressedBlock block;
+        block.data = compressChunk(
+            file->input->data() + begin, length, file->options, block.blocks,
+            nullptr, file->options.stats != nullptr ? &block.stats : nullptr,
+            &block.storedLength);
+
+        vector<BatchWrite> ready;
+        shared_ptr<MappedFile> input;
+        shared_ptr<FileDescriptor> output;
+        {
+            lock_guard<mutex> lock(file->lock);
+            if (file->ended) {
+                return;
+            }
+            STATS_ONLY(file->result.stats.merge(block.stats);)
+            file->finished[i] = move(block);
+            while (!file->finished.empty() &&
+                   file->finished.begin()->first == file->nextToWrite) {
+                BatchWrite next;
+                next.block = file->nextToWrite;
+                next.offset = file->offset;
+                next.data = move(file->finished.begin()->second);
+                for (size_t j = 0; j < next.data.blocks.size(); j++) {
+                    BlockIndexEntry entry = next.data.blocks[j];
+                    entry.offset += file->offset;
+                    file->index.push_back(entry);
+                }
+                file->offset += next.data.data.size() +
+                                next.data.storedLength;
+                file->finished.erase(file->finished.begin());
+                file->nextToWrite++;
+                ready.push_back(move(next));
+            }
+            while (file->nextToStart < file->blockCount &&
+                   file->nextToStart - file->nextToWrite < file->window) {
+                size_t next = file->nextToStart++;
+                pool.post([&pool, file, next]() {
+                    _compressBatchBlock(pool, file, next);
+                });
+            }
+            if (ready.empty()) {
+                return;
+            }
+            input = file->input;
+            output = file->output;
+        }
+
+        CompressionStats writeStats;
+        {
+            STATS_TIMER(file->options.stats != nullptr ? &writeStats : nullptr,
+                        writeSeconds);
+            for (size_t j = 0; j < ready.size(); j++) {
+                const BatchWrite& next = ready[j];
+                output->writeAt(next.data.data.data(), next.data.data.size(),
+                                (off_t)next.offset);
+                if (next.data.storedLength > 0) {
+                    copyRange(input->descriptor(),
+                              (off_t)(next.block * blockSize), *output,
+                              (off_t)(next.offset + next.data.data.size()),
+                              next.data.storedLength);
+                }
+            }
+        }
+
+        lock_guard<mutex> lock(file->lock);
+        if (file->ended) {
+            return;
+        }
+        STATS_ONLY(file->result.stats.merge(writeStats);)
+        file->written += ready.size();
+        if (file->written == file->blockCount) {
+            _finishBatchFile(*file);
+        }
+    } catch (const exception& e) {
+        lock_guard<mutex> lock(file->lock);
+        _endBatchFile(*file, e.what());
+    }
+}
+
+
+//
+// *This function is the first task of a file: it opens the file and its
+// output, writes the header, and compresses the file's only block or starts
+// its first blocks.  Inputs that cannot be mapped (pipes, devices) are
+// compressed by this task alone through compressFile, and so are files to
+// deduplicate, since the Deduplicator reads its input front to back.  Both
+// run on one thread, as the batch already has a worker per core.
+//
+void _startBatchFile(WorkStealingPool &pool, shared_ptr<BatchFile> file) {
+    file->start = chrono::steady_clock::now();
+    string outName = file->name + ".huf";
+    try {
+        bool dedup = (file->options.dedupWindowLog > 0);
+        if (!isRegularFile(file->name) || dedup) {
+            // the byte counts come from the stats
+            CompressOptions single = file->options;
+            single.threads = 1;
+            single.stats = &file->result.stats;
+            compressFile(file->name, outName, single);
+            lock_guard<mutex> lock(file->lock);
+            file->result.bytesIn = file->result.stats.bytesIn;
+            file->result.bytesOut = file->result.stats.bytesOut;
+            _endBatchFile(*file, "");
+            return;
+        }
+
+        unique_lock<mutex> lock(file->lock);
+        file->input = make_shared<MappedFile>(file->name);
+        file->output.reset(new FileDescriptor(
+            outName, O_WRONLY | O_CREAT | O_TRUNC));
+        ContainerHeader header;
+        header.version = CONTAINER_VERSION;
+        header.blockSize = (uint32_t)file->options.blockSize;
+        header.maxCodeLength = file->options.maxCodeLength;
+        ostringstream headerBytes;
+        writeHeader(headerBytes, header);
+        file->output->writeAt(headerBytes.str().data(),
+                              headerBytes.str().size(), 0);
+        file->offset = headerBytes.str().size();
+        file->headerBytes = file->offset;
+
+        size_t blockSize = file->options.blockSize;
+        file->result.bytesIn = file->input->size();
+        file->blockCount = (file->result.bytesIn + blockSize - 1) / blockSize;
+        if (file->blockCount == 0) {
+            _finishBatchFile(*file);
+            return;
+        }
+        if (file->blockCount == 1) {
+            file->nextToStart = 1;
+            lock.unlock();
+            _compressBatchBlock(pool, file, 0);
+            return;
+        }
+        // this worker runs its newest task first, so start them last to
+        // first to have the blocks come out roughly in order
+        file->nextToStart = min(file->window, file->blockCount);
+        for (size_t i = file->nextToStart; i-- > 0; ) {
+            pool.post([&pool, file, i]() {
+                _compressBatchBlock(pool, file, i);
+            });
+        }
+    } catch (const exception& e) {
+        lock_guard<mutex> lock(file->lock);
+        _endBatchFile(*file, e.what());
+    }
+}
+
+
+//
+// *This function compresses every file in files to the file's name +
+// ".huf" on options.threads workers (0 for one per core), and calls report
+// on this thread with each file's result, in the order of files, as soon
+// as that file and the ones before it are done.  A file that fails does not
+// stop the others; its result says why.  If options.stats is not null, each
+// result carries the file's stats, and the stats of all of them are added
+// to options.stats.
+//
+void compressBatch(const vector<string> &files, const CompressOptions &options,
+                   function<void(const BatchResult&)> report) {
+    STATS_TIMER(options.stats, totalSeconds);
+    WorkStealingPool pool(options.threads);
+    size_t window = 2 * pool.size();
+    vector<future<BatchResult> > results;
+    results.reserve(files.size());
+    for (size_t i = 0; i < files.size(); i++) {
+        shared_ptr<BatchFile> file = make_shared<BatchFile>();
+        file->name = files[i];
+        file->options = options;
+        file->window = window;
+        file->result.name = files[i];
+        results.push_back(file->done.get_future());
+        pool.post([&pool, file]() {
+            _startBatchFile(pool, file);
+        });
+    }
+    for (size_t i = 0; i < results.size(); i++) {
+        BatchResult result = results[i].get();
+        STATS_ONLY(
+            if (options.stats != nullptr) {
+                options.stats->merge(result.stats);
+                options.stats->bytesIn += result.stats.bytesIn;
+                options.stats->bytesOut += result.stats.bytesOut;
+            }
+        )
+        report(result);
+    }
+}
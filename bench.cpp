@@ -0,0 +1,375 @@
+//
+//  bench.cpp
+//  File Compression II
+//
+//  Times each stage of compression on its own over generated inputs and
+//  prints one tab-separated line per (input, stage):
+//
+//      input  stage  bytes  ns_per_byte  mb_per_s  allocs
+//
+//  bytes is the input size, except for the header stages, which count the
+//  header bytes written or read.
+//
+//  Every stage is run until it has taken at least MIN_SECONDS (and at least
+//  MIN_RUNS times) and the fastest run is reported, which keeps the numbers
+//  steady from one run to the next.  allocs is the number of heap
+//  allocations made by one run.  Lines always come out in the same order,
+//  so the output of two builds can be diffed.
+//
+//  usage: bench.exe [MiB per input (default 4)]
+//
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include "util.h"
+#include "hashmap.h"
+
+using namespace std;
+
+// every heap allocation in the process goes through these
+static atomic<long long> allocationCount(0);
+
+// g++ 11 and later flag the free below once operator delete is inlined into
+// library code, not seeing that operator new is replaced with malloc too
+// (-Wpragmas keeps compilers that do not know the warning quiet)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t size) {
+    allocationCount++;
+    void* p = malloc(size > 0 ? size : 1);
+    if (p == nullptr) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+#pragma GCC diagnostic pop
+
+const double MIN_SECONDS = 0.2;
+const int MIN_RUNS = 3;
+const char* SCRATCH_FILE = "bench_scratch.txt";
+
+
+//
+// *This class generates the same pseudo-random numbers on every platform
+// (a 64-bit linear congruential generator), so inputs never change between
+// builds.
+//
+class Generator {
+ public:
+    explicit Generator(uint64_t seed) : state(seed) {
+    }
+
+    uint32_t next() {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return uint32_t(state >> 33);
+    }
+
+ private:
+    uint64_t state;
+};
+
+
+//
+// *This function returns size bytes of each kind of input benchmarked: bytes
+// drawn uniformly, English text (medium.txt repeated), bytes from a skewed
+// (geometric) distribution, and long runs of repeated bytes.
+//
+vector<pair<string, string> > makeInputs(size_t size) {
+    vector<pair<string, string> > inputs;
+    Generator random(12345);
+
+    string uniform(size, '\0');
+    for (size_t i = 0; i < size; i++) {
+        uniform[i] = char(random.next());
+    }
+    inputs.push_back(make_pair("uniform", uniform));
+
+    ifstream medium("medium.txt", ios::binary);
+    stringstream text;
+    text << medium.rdbuf();
+    string sample = text.str();
+    if (sample.empty()) {
+        sample = "the quick brown fox jumps over the lazy dog. ";
+    }
+    string english;
+    english.reserve(size);
+    while (english.size() < size) {
+        english.append(sample, 0, min(sample.size(), size - english.size()));
+    }
+    inputs.push_back(make_pair("text", english));
+
+    string skewed(size, '\0');
+    for (size_t i = 0; i < size; i++) {
+        int symbol = 0;
+        while (symbol < 255 && (random.next() & 3) != 0) {
+            symbol++;
+        }
+        skewed[i] = char(symbol);
+    }
+    inputs.push_back(make_pair("skewed", skewed));
+
+    string runs;
+    runs.reserve(size);
+    while (runs.size() < size) {
+        size_t run = 1 + random.next() % 200;
+        runs.append(min(run, size - runs.size()), char(random.next() % 16));
+    }
+    inputs.push_back(make_pair("runs", runs));
+    return inputs;
+}
+
+
+//
+// *This function runs stage until it has taken MIN_SECONDS and MIN_RUNS
+// runs, then prints the fastest run over bytes input bytes.  prepare (if
+// given) runs before every run and is not timed.
+//
+void timeStage(const string &input, const string &stage, size_t bytes,
+               function<void()> run, function<void()> prepare = nullptr) {
+    double best = 1e30;
+    double total = 0;
+    long long allocs = 0;
+    for (int runs = 0; runs < MIN_RUNS || total < MIN_SECONDS; runs++) {
+        if (prepare) {
+            prepare();
+        }
+        long long before = allocationCount;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        run();
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        allocs = allocationCount - before;
+        double seconds = chrono::duration<double>(end - start).count();
+        best = min(best, seconds);
+        total += seconds;
+    }
+    double nsPerByte = bytes > 0 ? best * 1e9 / bytes : 0;
+    double mbPerSecond = best > 0 ? bytes / best / 1e6 : 0;
+    printf("%s\t%s\t%zu\t%.3f\t%.1f\t%lld\n", input.c_str(), stage.c_str(),
+           bytes, nsPerByte, mbPerSecond, allocs);
+    fflush(stdout);
+}
+
+
+//
+// *This function times decoding block, which must decode to data, under
+// stage.
+//
+void benchDecompressBlock(const string &input, const string &stage,
+                          const string &data, const string &block,
+                          const ContainerHeader &fileHeader) {
+    MemoryBuffer buffer(block.data(), block.size());
+    istream blockStream(&buffer);
+    BlockHeader blockHeader;
+    readBlockHeader(blockStream, blockHeader, fileHeader);
+    const char* payload = block.data() + buffer.position();
+    string decoded(data.size(), '\0');
+    timeStage(input, stage, data.size(), [&]() {
+        decompressBlock(blockHeader, payload, &decoded[0]);
+    });
+    if (decoded != data) {
+        cerr << input << ": " << stage << " did not round-trip" << endl;
+        exit(1);
+    }
+}
+
+
+//
+// *This function benchmarks every stage on one input.  The menu stages run
+// the way the menu does (the input in SCRATCH_FILE, the frequency map header
+// in front of the code); the block stages are the ones compressFile runs
+// for each block.
+//
+void benchInput(const string &name, const string &data) {
+    {
+        ofstream scratch(SCRATCH_FILE, ios::binary);
+        scratch << data;
+    }
+    string encodedName = string(SCRATCH_FILE) + ".huf";
+    string decodedName = string(SCRATCH_FILE) + ".out";
+    size_t size = data.size();
+
+    hashmap frequencyMap;
+    timeStage(name, "buildFrequencyMap", size, [&]() {
+        buildFrequencyMap(SCRATCH_FILE, true, frequencyMap);
+    }, [&]() {
+        frequencyMap = hashmap();
+    });
+
+    HuffmanNode* encodingTree = nullptr;
+    timeStage(name, "buildEncodingTree", size, [&]() {
+        encodingTree = buildEncodingTree(frequencyMap);
+    }, [&]() {
+        freeTree(encodingTree);
+        encodingTree = nullptr;
+    });
+
+    mymap <int, string> encodingMap;
+    timeStage(name, "buildEncodingMap", size, [&]() {
+        encodingMap = buildEncodingMap(encodingTree);
+    });
+
+    timeStage(name, "encode", size, [&]() {
+        ifstream input(SCRATCH_FILE, ios::binary);
+        ofbitstream output(encodedName);
+        output << frequencyMap;
+        long long bits = 0;
+        encode(input, encodingMap, output, bits, true, false);
+    });
+
+    timeStage(name, "decode", size, [&]() {
+        ifbitstream input(encodedName);
+        ofstream output(decodedName, ios::binary);
+        hashmap header;
+        input >> header;
+        decode(input, encodingTree, output);
+    });
+    freeTree(encodingTree);
+
+    Histogram histogram;
+    countBytes((const unsigned char*)data.data(), size, histogram);
+    HuffmanBuilder builder;
+    builder.build(histogram.counts);
+    BlockHeader header;
+    header.rawLength = (uint32_t)size;
+    header.payloadLength = 0;
+    builder.codeLengths(header.codeLengths);
+    // header stages are measured over the header bytes, HEADERS at a time
+    const int HEADERS = 1000;
+    ostringstream headerOut;
+    for (int i = 0; i < HEADERS; i++) {
+        writeBlockHeader(headerOut, header);
+    }
+    string headerBytes = headerOut.str();
+    timeStage(name, "headerWrite", headerBytes.size(), [&]() {
+        ostringstream out;
+        for (int i = 0; i < HEADERS; i++) {
+            writeBlockHeader(out, header);
+        }
+    });
+    ContainerHeader fileHeader;
+    timeStage(name, "headerRead", headerBytes.size(), [&]() {
+        istringstream in(headerBytes);
+        BlockHeader parsed;
+        for (int i = 0; i < HEADERS; i++) {
+            readBlockHeader(in, parsed, fileHeader);
+        }
+    });
+
+    string block;
+    timeStage(name, "compressBlock", size, [&]() {
+        block = compressBlock(data.data(), size, DEFAULT_CODE_LENGTH_LIMIT,
+                              nullptr);
+    });
+    benchDecompressBlock(name, "decompressBlock", data, block, fileHeader);
+
+    // the same block as a single stream, to compare against
+    string single = compressBlock(data.data(), size,
+                                  DEFAULT_CODE_LENGTH_LIMIT, nullptr,
+                                  nullptr, 1);
+    benchDecompressBlock(name, "decompressBlock1", data, single, fileHeader);
+
+    // the default chunk path, which stores blocks it cannot shrink
+    CompressOptions defaults;
+    vector<BlockIndexEntry> entries;
+    string chunk;
+    timeStage(name, "compressChunk", size, [&]() {
+        chunk = compressChunk(data.data(), size, defaults, entries, nullptr);
+    });
+    benchDecompressBlock(name, "decompressChunk", data, chunk, fileHeader);
+
+    // order-1, where it pays (see context.h)
+    CompressOptions order1;
+    order1.contextTables = DEFAULT_CONTEXT_TABLES;
+    string context;
+    timeStage(name, "compressBlockOrder1", size, [&]() {
+        context = compressChunk(data.data(), size, order1, entries, nullptr);
+    });
+    benchDecompressBlock(name, "decompressBlockOrder1", data, context,
+                         fileHeader);
+
+    // LZ77 tokens, where they pay (see lz77.h)
+    CompressOptions lz;
+    lz.lzLevel = LZ_DEFAULT_LEVEL;
+    string tokens;
+    timeStage(name, "compressBlockLz", size, [&]() {
+        tokens = compressChunk(data.data(), size, lz, entries, nullptr);
+    });
+    benchDecompressBlock(name, "decompressBlockLz", data, tokens, fileHeader);
+
+    // Burrows-Wheeler blocks, where they pay (see bwt.h)
+    CompressOptions bwt;
+    bwt.bwt = true;
+    string transformed;
+    timeStage(name, "compressBlockBwt", size, [&]() {
+        transformed = compressChunk(data.data(), size, bwt, entries, nullptr);
+    });
+    benchDecompressBlock(name, "decompressBlockBwt", data, transformed,
+                         fileHeader);
+
+    // tANS in place of the Huffman code, where it pays (see fse.h)
+    CompressOptions fse;
+    fse.fse = true;
+    string states;
+    timeStage(name, "compressBlockFse", size, [&]() {
+        states = compressChunk(data.data(), size, fse, entries, nullptr);
+    });
+    benchDecompressBlock(name, "decompressBlockFse", data, states,
+                         fileHeader);
+
+    remove(SCRATCH_FILE);
+    remove(encodedName.c_str());
+    remove(decodedName.c_str());
+}
+
+
+int main(int argc, const char * argv[]) {
+    size_t megabytes = 4;
+    if (argc > 1) {
+        int value = atoi(argv[1]);
+        if (value <= 0) {
+            cerr << "usage: " << argv[0] << " [MiB per input]" << endl;
+            return 2;
+        }
+        megabytes = (size_t)value;
+    }
+
+    printf("input\tstage\tbytes\tns_per_byte\tmb_per_s\tallocs\n");
+    vector<pair<string, string> > inputs = makeInputs(megabytes << 20);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        benchInput(inputs[i].first, inputs[i].second);
+    }
+    return 0;
+}
@@ -11,7 +11,9 @@
  *
  * Similarly, the obitstream can be used in place of ofstream, and has
  * same operations (put, fail, <<, etc.) along with additional
- * member functions writeBit and size.
+ * member functions writeBit and size.  For bulk output, writeBits gathers
+ * whole codes in a 64-bit register and hands the stream complete words
+ * instead of touching it once per bit.
  *
  * There are two subclasses of ibitstream: ifbitstream and istringbitstream,
  * which are similar to the ifstream and istringstream classes.  The
@@ -26,6 +28,8 @@
 #include <ostream>
 #include <fstream>
 #include <sstream>
+#include <vector>
+#include <cstdint>
 using namespace std;
 
 
@@ -215,7 +219,8 @@ public:
      * We set initial state for lastTell and curByte to 0, then pos is
      * set at 8 so that next writeBit will start a new byte.
      */
-    obitstream() : std::ostream(NULL), lastTell(0), curByte(0), pos(NUM_BITS_IN_BYTE) {
+    obitstream() : std::ostream(NULL), lastTell(0), curByte(0), pos(NUM_BITS_IN_BYTE),
+                   bitBuffer(0), bitCount(0), byteCount(0) {
         this->fake = false;
     }
     /**
@@ -242,6 +247,9 @@ public:
             //error("obitstream::writeBit: stream is not open");
         //}
         
+        if (bitCount != 0 || byteCount != 0) {
+            flushBits();   // keep bulk-written bits ahead of this one
+        }
         if (this->fake) {
             put(bit == 1 ? '1' : '0');
         } else {
@@ -272,6 +280,77 @@ public:
      * Raises an error if this obitstream has not been properly opened.
      */
     
+    /* Member function obitstream::writeBits
+     * -------------------------------------
+     * Ors the bits into bitBuffer above the bitCount bits already pending.
+     * Whenever 32 or more bits are pending, the low word is moved into
+     * byteBuffer (least significant byte first, so the first bit written is
+     * bit 0 of its byte just like writeBit), and a full byteBuffer is handed
+     * to the stream with a single write.  Nothing is seeked or rewritten.
+     */
+    void writeBits(uint64_t bits, int nBits) {
+        if (nBits > 32) {
+            writeBits(bits & 0xffffffffu, 32);
+            writeBits(bits >> 32, nBits - 32);
+            return;
+        }
+        if (this->fake) {
+            for (int i = 0; i < nBits; i++) {
+                put(((bits >> i) & 1) ? '1' : '0');
+            }
+            return;
+        }
+        bitBuffer |= (bits & ((uint64_t(1) << nBits) - 1)) << bitCount;
+        bitCount += nBits;
+        if (bitCount >= 32) {
+            if (byteCount + 4 > byteBuffer.size()) {
+                if (byteBuffer.size() < BYTE_BUFFER_SIZE) {
+                    byteBuffer.resize(BYTE_BUFFER_SIZE);
+                } else {
+                    write(byteBuffer.data(), byteCount);
+                    byteCount = 0;
+                }
+            }
+            uint32_t word = uint32_t(bitBuffer);
+            byteBuffer[byteCount++] = char(word);
+            byteBuffer[byteCount++] = char(word >> 8);
+            byteBuffer[byteCount++] = char(word >> 16);
+            byteBuffer[byteCount++] = char(word >> 24);
+            bitBuffer >>= 32;
+            bitCount -= 32;
+        }
+    }
+    /**
+     * Writes the low nBits bits of bits to the obitstream, bit 0 first.
+     * Bits written this way are buffered in memory; call flushBits before
+     * using << or put on the stream again.  writeBit flushes on its own.
+     */
+    
+    /* Member function obitstream::flushBits
+     * -------------------------------------
+     * Writes out byteBuffer followed by the pending bits of bitBuffer,
+     * padding the last partial byte with zeros.
+     */
+    void flushBits() {
+        while (bitCount > 0) {
+            if (byteCount == byteBuffer.size()) {
+                byteBuffer.resize(byteBuffer.size() + NUM_BITS_IN_BYTE);
+            }
+            byteBuffer[byteCount++] = char(bitBuffer);
+            bitBuffer >>= NUM_BITS_IN_BYTE;
+            bitCount = bitCount > NUM_BITS_IN_BYTE ? bitCount - NUM_BITS_IN_BYTE : 0;
+        }
+        bitBuffer = 0;
+        if (byteCount > 0) {
+            write(byteBuffer.data(), byteCount);
+            byteCount = 0;
+        }
+    }
+    /**
+     * Flushes any bits buffered by writeBits to the underlying stream,
+     * ending on a byte boundary.  Subsequent writes start with a new byte.
+     */
+    
     
     /* Member function obitstream::size
      * --------------------------------
@@ -310,10 +389,16 @@ public:
      */
     
 private:
+    static const size_t BYTE_BUFFER_SIZE = 1 << 16;
+
     std::streampos lastTell;
     int curByte;
     int pos;
     bool fake;
+    uint64_t bitBuffer;              // pending bits of writeBits, bit 0 first
+    int bitCount;                    // number of pending bits in bitBuffer
+    std::vector<char> byteBuffer;    // completed words not yet written
+    size_t byteCount;
 };
 
 /**
@@ -459,6 +544,17 @@ public:
         open(filename);
     }
 
+    /* Destructor ofbitstream::~ofbitstream
+     * ------------------------------------
+     * Flushes bits buffered by writeBits while the file buffer is still
+     * alive.
+     */
+    ~ofbitstream() {
+        if (fb.is_open()) {
+            flushBits();
+        }
+    }
+
     /* Member function ofbitstream::open
      * ---------------------------------
      * Attempts to open the specified file, failing if unable
@@ -516,6 +612,9 @@ public:
      * Closes the given file.
      */
     void close() {
+        if (fb.is_open()) {
+            flushBits();
+        }
         if (!fb.close()) {
             setstate(std::ios::failbit);
         }
@@ -596,6 +695,7 @@ public:
      * Retrives the underlying string data.
      */
     std::string str() {
+        flushBits();
         return sb.str();
     }
     /**
@@ -0,0 +1,111 @@
+//
+//  blocksplit.h
+//  File Compression II
+//
+//  Choosing where to end blocks.  One code for a whole block wastes bits
+//  when the content changes partway through (text followed by binaries in
+//  one archive): every part pays for the symbols of the others.
+//  chooseBlockBoundaries cuts the input into SPLIT_UNIT-byte units, counts
+//  each, and finds the boundaries between units that minimize the
+//  estimated size: the order-0 entropy of every block plus what its header
+//  costs.  A boundary only pays for itself if the blocks on either side are
+//  different enough to save more than a header, so uniform input stays in
+//  one block, up to SPLIT_WINDOW units.
+//
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include "histogram.h"
+
+using namespace std;
+
+const size_t SPLIT_UNIT = 16 * 1024;
+// the most units a chosen block spans, which keeps the search linear in the
+// input (64 units is the default 1 MiB block)
+const size_t SPLIT_WINDOW = 64;
+// a block header with its code lengths in nibbles, which bounds the usual
+// header size
+const double BLOCK_HEADER_BITS = 8.0 * (4 + 4 + 1 + (NUM_SYMBOLS + 1) / 2);
+
+
+//
+// *This function returns the estimated number of bits needed to code the
+// symbols counted in counts (NUM_SYMBOLS of them) with one order-0 code.
+//
+inline double entropyCostBits(const uint64_t* counts) {
+    uint64_t total = 0;
+    double sumCLogC = 0;
+    for (int i = 0; i < NUM_SYMBOLS; i++) {
+        if (counts[i] > 0) {
+            double count = double(counts[i]);
+            total += counts[i];
+            sumCLogC += count * log2(count);
+        }
+    }
+    return total > 0 ? double(total) * log2(double(total)) - sumCLogC : 0;
+}
+
+
+//
+// *This function returns the block boundaries chosen for data: offsets into
+// it, starting with 0 and ending with length, that are multiples of
+// SPLIT_UNIT in between and at most SPLIT_WINDOW units apart.  Takes
+// O(units * SPLIT_WINDOW * NUM_SYMBOLS) time, and keeps the counts of only
+// the last SPLIT_WINDOW units.
+//
+inline vector<size_t> chooseBlockBoundaries(const unsigned char* data,
+                                            size_t length) {
+    size_t units = (length + SPLIT_UNIT - 1) / SPLIT_UNIT;
+    vector<size_t> bounds(1, 0);
+    if (units < 2) {
+        bounds.push_back(length);
+        return bounds;
+    }
+
+    // prefix[u % (SPLIT_WINDOW + 1)] counts units 0 to u - 1, for the last
+    // SPLIT_WINDOW + 1 values of u
+    vector<Histogram> prefix(min(units, SPLIT_WINDOW) + 1);
+    // best[j] is the cheapest cost of units 0 to j - 1, whose last block
+    // starts at unit from[j]
+    vector<double> best(units + 1, 0);
+    vector<size_t> from(units + 1, 0);
+    uint64_t counts[NUM_SYMBOLS];
+    for (size_t j = 1; j <= units; j++) {
+        const Histogram& last = prefix[(j - 1) % prefix.size()];
+        Histogram& current = prefix[j % prefix.size()];
+        current.clear();
+        size_t begin = (j - 1) * SPLIT_UNIT;
+        size_t end = min(length, begin + SPLIT_UNIT);
+        countBytes(data + begin, end - begin, current);
+        for (int s = 0; s < NUM_SYMBOLS; s++) {
+            current.counts[s] += last.counts[s];
+        }
+
+        best[j] = -1;
+        for (size_t i = j - min(j, SPLIT_WINDOW); i < j; i++) {
+            const Histogram& first = prefix[i % prefix.size()];
+            for (int s = 0; s < NUM_SYMBOLS; s++) {
+                counts[s] = current.counts[s] - first.counts[s];
+            }
+            double cost = best[i] + entropyCostBits(counts) +
+                          BLOCK_HEADER_BITS;
+            if (best[j] < 0 || cost < best[j]) {
+                best[j] = cost;
+                from[j] = i;
+            }
+        }
+    }
+
+    vector<size_t> starts;
+    for (size_t j = units; j > 0; j = from[j]) {
+        starts.push_back(from[j]);
+    }
+    for (size_t k = starts.size() - 1; k > 0; k--) {
+        bounds.push_back(starts[k - 1] * SPLIT_UNIT);
+    }
+    bounds.push_back(length);
+    return bounds;
+}
@@ -0,0 +1,410 @@
+//
+//  bwt.h
+//  File Compression II
+//
+//  Burrows-Wheeler blocks, in the manner of bzip2.  Sorting every suffix
+//  of a block and taking the byte before each, in suffix order, groups
+//  bytes by what follows them, so text turns into long runs of a few
+//  bytes each.  Move-to-front then turns those runs into small ranks,
+//  mostly 0, and runs of 0 are written as their length in bijective base
+//  2 (digits BWT_RUN_A = 1 and BWT_RUN_B = 2, least significant first).
+//  What is left is skewed enough for one Huffman code over BWT_SYMBOLS
+//  symbols to do well, and the block still compresses and decodes on its
+//  own.
+//
+//  The suffixes are sorted with SA-IS (induced sorting), in time linear in
+//  the block.  The end of the block counts as a byte below every other, so
+//  the sorted suffixes have one more row than the block has bytes: row 0
+//  is the empty suffix, and the row of the whole block (the one preceded
+//  by nothing) is left out of the transformed bytes.
+//
+//  Undoing the transform walks from each suffix to the next, one random
+//  access per byte.  The encoder cuts the block into BWT_CHAINS runs and
+//  records the row of the suffix each starts, so the decoder walks that
+//  many chains at once and keeps as many cache misses in flight; each
+//  chain must end on the row the next one starts at, which catches most
+//  corrupt blocks.
+//
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "bitstream.h"
+#include "hufftable.h"
+#include "container.h"
+
+using namespace std;
+
+// decoding tables hold symbol + BWT_SYMBOL_OFFSET, so that no symbol is
+// NOT_A_CHAR
+const int BWT_SYMBOL_OFFSET = 512;
+
+
+//
+// *This function sorts the suffixes of the n symbols at s, each below k,
+// into sa as if s ended with a symbol below all of them (SA-IS).  The
+// reduced problem is solved in place in sa, so it needs no memory beyond
+// the type of each suffix and the buckets.
+//
+template <typename T>
+void _suffixArray(const T* s, int32_t* sa, int32_t n, int32_t k) {
+    if (n <= 1) {
+        if (n == 1) {
+            sa[0] = 0;
+        }
+        return;
+    }
+    // S-type suffixes sort below the suffix after them, L-type above it
+    vector<unsigned char> sType(n, 0);
+    for (int32_t i = n - 2; i >= 0; i--) {
+        sType[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && sType[i + 1]);
+    }
+    auto isLms = [&sType](int32_t i) {
+        return i > 0 && sType[i] && !sType[i - 1];
+    };
+    vector<int32_t> counts(k, 0);
+    for (int32_t i = 0; i < n; i++) {
+        counts[s[i]]++;
+    }
+    vector<int32_t> bucket(k);
+    auto starts = [&]() {
+        int32_t sum = 0;
+        for (int32_t c = 0; c < k; c++) {
+            bucket[c] = sum;
+            sum += counts[c];
+        }
+    };
+    auto ends = [&]() {
+        int32_t sum = 0;
+        for (int32_t c = 0; c < k; c++) {
+            sum += counts[c];
+            bucket[c] = sum;
+        }
+    };
+    // sorts every suffix from the LMS suffixes already at their bucket ends
+    auto induce = [&]() {
+        starts();
+        // the last suffix is L-type: the end of the block sorts first
+        sa[bucket[s[n - 1]]++] = n - 1;
+        for (int32_t i = 0; i < n; i++) {
+            int32_t j = sa[i] - 1;
+            if (j >= 0 && !sType[j]) {
+                sa[bucket[s[j]]++] = j;
+            }
+        }
+        ends();
+        for (int32_t i = n - 1; i >= 0; i--) {
+            int32_t j = sa[i] - 1;
+            if (j >= 0 && sType[j]) {
+                sa[--bucket[s[j]]] = j;
+            }
+        }
+    };
+
+    // sort the LMS substrings
+    fill(sa, sa + n, -1);
+    ends();
+    for (int32_t i = 1; i < n; i++) {
+        if (isLms(i)) {
+            sa[--bucket[s[i]]] = i;
+        }
+    }
+    induce();
+
+    // name them in sorted order, equal substrings alike; no two LMS
+    // positions are adjacent, so the names fit in sa after the first n1
+    int32_t n1 = 0;
+    for (int32_t i = 0; i < n; i++) {
+        if (isLms(sa[i])) {
+            sa[n1++] = sa[i];
+        }
+    }
+    fill(sa + n1, sa + n, -1);
+    int32_t names = 0;
+    int32_t previous = -1;
+    for (int32_t i = 0; i < n1; i++) {
+        int32_t p = sa[i];
+        bool same = previous >= 0;
+        for (int32_t d = 0; same; d++) {
+            if (p + d == n || previous + d == n ||
+                s[p + d] != s[previous + d] ||
+                sType[p + d] != sType[previous + d]) {
+                same = false;
+            } else if (d > 0 && isLms(p + d)) {
+                break;
+            }
+        }
+        if (!same) {
+            names++;
+            previous = p;
+        }
+        sa[n1 + p / 2] = names - 1;
+    }
+    int32_t* reduced = sa + n - n1;
+    for (int32_t i = n - 1, j = n - 1; i >= n1; i--) {
+        if (sa[i] >= 0) {
+            sa[j--] = sa[i];
+        }
+    }
+
+    // sort the LMS suffixes by sorting the string of their names
+    if (names < n1) {
+        _suffixArray(reduced, sa, n1, names);
+    } else {
+        for (int32_t i = 0; i < n1; i++) {
+            sa[reduced[i]] = i;
+        }
+    }
+    for (int32_t i = 1, j = 0; i < n; i++) {
+        if (isLms(i)) {
+            reduced[j++] = i;
+        }
+    }
+    for (int32_t i = 0; i < n1; i++) {
+        sa[i] = reduced[sa[i]];
+    }
+
+    // and sort the rest from them
+    fill(sa + n1, sa + n, -1);
+    ends();
+    for (int32_t i = n1 - 1; i >= 0; i--) {
+        int32_t j = sa[i];
+        sa[i] = -1;
+        sa[--bucket[s[j]]] = j;
+    }
+    induce();
+}
+
+
+//
+// *This function transforms the length bytes at data (at most
+// BWT_MAX_LENGTH) into the length bytes at out, and sets rows to the
+// BWT_CHAINS rows the decoder starts from.  sa is scratch space.
+//
+inline void bwtForward(const unsigned char* data, size_t length,
+                       unsigned char* out, vector<uint32_t>& rows,
+                       vector<int32_t>& sa) {
+    rows.assign(BWT_CHAINS, 0);
+    if (length == 0) {
+        return;
+    }
+    int32_t n = (int32_t)length;
+    sa.resize(length);
+    _suffixArray(data, sa.data(), n, 256);
+    size_t bounds[BWT_CHAINS + 1];
+    subStreamBounds(length, bounds, BWT_CHAINS);
+    size_t share = bounds[1];
+    // row 0, the empty suffix, comes after the last byte
+    out[0] = data[n - 1];
+    size_t at = 1;
+    for (int32_t i = 0; i < n; i++) {
+        int32_t p = sa[i];
+        if ((size_t)p % share == 0) {
+            rows[p / share] = (uint32_t)i + 1;
+        }
+        if (p > 0) {
+            out[at++] = data[p - 1];
+        }
+    }
+}
+
+
+//
+// *This function turns the length transformed bytes at data into
+// move-to-front symbols, and sets counts (BWT_SYMBOLS of them) to how often
+// each is used.
+//
+inline void bwtSymbols(const unsigned char* data, size_t length,
+                       vector<uint16_t>& symbols, uint64_t* counts) {
+    memset(counts, 0, BWT_SYMBOLS * sizeof(uint64_t));
+    symbols.clear();
+    unsigned char order[256];
+    for (int c = 0; c < 256; c++) {
+        order[c] = (unsigned char)c;
+    }
+    size_t run = 0;
+    auto flushRun = [&]() {
+        while (run > 0) {
+            uint16_t digit = (run & 1) ? BWT_RUN_A : BWT_RUN_B;
+            symbols.push_back(digit);
+            counts[digit]++;
+            run = (run - 1 - digit) >> 1;
+        }
+    };
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = data[i];
+        if (order[0] == c) {
+            run++;
+            continue;
+        }
+        flushRun();
+        int rank = 1;
+        while (order[rank] != c) {
+            rank++;
+        }
+        memmove(order + 1, order, rank);
+        order[0] = c;
+        symbols.push_back((uint16_t)(rank + 1));
+        counts[rank + 1]++;
+    }
+    flushRun();
+}
+
+
+//
+// *This function writes symbols to output with the code in table, and
+// appends the bits to bits as '0' and '1' characters if it is not null.
+//
+inline void writeBwtSymbols(const vector<uint16_t>& symbols,
+                            const HuffmanEncodeTable& table,
+                            obitstream& output, string* bits) {
+    for (size_t i = 0; i < symbols.size(); i++) {
+        const HuffmanEncodeTable::Entry& e = table[symbols[i]];
+        output.writeBits(e.code, e.length);
+        if (bits != nullptr) {
+            for (int bit = 0; bit < e.length; bit++) {
+                *bits += ((e.code >> bit) & 1) ? '1' : '0';
+            }
+        }
+    }
+}
+
+
+//
+// BwtDecoder
+// Decodes the payload of a BWT block with a lookup table for its code,
+// then undoes the transform.
+//
+class BwtDecoder {
+ public:
+    //
+    // Returns false if the code lengths are not a valid prefix code or
+    // have a code too long for the table.
+    //
+    bool build(const vector<int>& lengths) {
+        return buildOffsetTable(lengths, BWT_SYMBOL_OFFSET, table);
+    }
+
+    //
+    // Decodes payload (payloadLength bytes) into the length transformed
+    // bytes at out, counting them for invert.  Returns false unless the
+    // symbols make exactly length bytes and the payload holds every bit
+    // read.
+    //
+    bool decodeSymbols(const unsigned char* payload, size_t payloadLength,
+                       char* out, size_t length) {
+        BitReader reader(payload, payloadLength);
+        unsigned char order[256];
+        for (int c = 0; c < 256; c++) {
+            order[c] = (unsigned char)c;
+        }
+        memset(counts, 0, sizeof(counts));
+        size_t n = 0;
+        uint64_t run = 0;
+        int digits = 0;
+        while (n + run < length) {
+            reader.refill();
+            int symbol = table.decodeSymbol(reader) - BWT_SYMBOL_OFFSET;
+            if (symbol < 0) {
+                return false;
+            }
+            if (symbol <= BWT_RUN_B) {
+                run += uint64_t(symbol + 1) << digits++;
+                if (run > length - n) {
+                    return false;
+                }
+                continue;
+            }
+            if (run > 0) {
+                memset(out + n, order[0], run);
+                counts[order[0]] += run;
+                n += run;
+                run = 0;
+                digits = 0;
+                if (n == length) {
+                    return false;
+                }
+            }
+            int rank = symbol - 1;
+            unsigned char c = order[rank];
+            memmove(order + 1, order, rank);
+            order[0] = c;
+            counts[c]++;
+            out[n++] = (char)c;
+        }
+        memset(out + n, order[0], run);
+        counts[order[0]] += run;
+        return !reader.overrun();
+    }
+
+    //
+    // Undoes the transform of the length bytes at out, just decoded by
+    // decodeSymbols, in place, starting the chains at rows (BWT_CHAINS of
+    // them).  Returns false unless every chain ends where the next one
+    // starts.
+    //
+    bool invert(const vector<uint32_t>& rows, char* out, size_t length) {
+        if (length == 0) {
+            return true;
+        }
+        const unsigned char* last = (const unsigned char*)out;
+        size_t primary = rows[0];
+        if (primary == 0 || primary > length) {
+            return false;
+        }
+        // next[r] is the row of the suffix one byte after that of row r,
+        // above the first byte of row r; rows sort by their first byte, and
+        // rows with the same first byte by the suffix after it
+        size_t first[256];
+        size_t sum = 1;
+        for (int c = 0; c < 256; c++) {
+            first[c] = sum;
+            sum += counts[c];
+        }
+        next.resize(length + 1);
+        next[0] = 0;
+        for (size_t r = 0; r < primary; r++) {
+            next[first[last[r]]++] = uint32_t(r << 8) | last[r];
+        }
+        for (size_t r = primary + 1; r <= length; r++) {
+            next[first[last[r - 1]]++] = uint32_t(r << 8) | last[r - 1];
+        }
+
+        size_t bounds[BWT_CHAINS + 1];
+        subStreamBounds(length, bounds, BWT_CHAINS);
+        uint32_t at[BWT_CHAINS];
+        size_t common = length;
+        for (int k = 0; k < BWT_CHAINS; k++) {
+            at[k] = rows[k];
+            common = min(common, bounds[k + 1] - bounds[k]);
+        }
+        const uint32_t* links = next.data();
+        for (size_t i = 0; i < common; i++) {
+            for (int k = 0; k < BWT_CHAINS; k++) {
+                uint32_t link = links[at[k]];
+                out[bounds[k] + i] = (char)link;
+                at[k] = link >> 8;
+            }
+        }
+        for (int k = 0; k < BWT_CHAINS; k++) {
+            for (size_t i = bounds[k] + common; i < bounds[k + 1]; i++) {
+                uint32_t link = links[at[k]];
+                out[i] = (char)link;
+                at[k] = link >> 8;
+            }
+            if (at[k] != (k + 1 < BWT_CHAINS ? rows[k + 1] : 0)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+ private:
+    HuffmanDecodeTable table;
+    uint64_t counts[256];  // of each byte value decodeSymbols decoded
+    vector<uint32_t> next;
+};
@@ -0,0 +1,265 @@
+//
+//  codelengths.h
+//  File Compression II
+//
+//  Code length construction.  HuffmanBuilder builds the Huffman tree of a
+//  histogram in flat arrays with the two-queue method: the leaves are sorted
+//  once, and because every merged node weighs at least as much as the one
+//  merged before it, the merged nodes form a second sorted queue, so the
+//  two cheapest nodes are always at the front of one of the two queues.
+//
+//  limitCodeLengths bounds the result.  A plain Huffman tree over skewed
+//  counts can grow codes far deeper than a decoding table wants to handle
+//  (counts that follow the Fibonacci numbers give one level per symbol).
+//  limitCodeLengths replaces such lengths with the optimal ones among codes
+//  no longer than a given limit, found with the package-merge algorithm.
+//  Lengths that already fit are left alone, so the limit only costs
+//  compression on the inputs that would have exceeded it, and there only a
+//  fraction of a percent.
+//
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include "histogram.h"
+
+using namespace std;
+
+const int MIN_CODE_LENGTH_LIMIT = 9;   // 2^9 >= MAX_ALPHABET
+const int MAX_CODE_LENGTH_LIMIT = 32;  // HuffmanDecodeTable::MAX_CODE_LENGTH
+const int DEFAULT_CODE_LENGTH_LIMIT = 15;
+
+
+//
+// *This function returns the longest code allowed under the code length
+// limit maxCodeLength, where 0 means no limit but that of the decoding
+// tables.
+//
+inline int effectiveCodeLengthLimit(int maxCodeLength) {
+    return maxCodeLength > 0 ? maxCodeLength : MAX_CODE_LENGTH_LIMIT;
+}
+
+
+//
+// HuffmanBuilder
+// Builds a Huffman tree in fixed arrays, so building one allocates nothing
+// and a builder can be reused for any number of histograms, of any
+// alphabet up to MAX_ALPHABET symbols (NUM_SYMBOLS by default).  Leaves are
+// sorted by (count, symbol) and ties between a leaf and a merged node go to
+// the leaf, so the tree depends only on the counts.  Nodes 0 to
+// leafCount() - 1 are the leaves in sorted order; every node after them is
+// a merged node whose children both come before it, and the last is the
+// root.
+//
+class HuffmanBuilder {
+ public:
+    HuffmanBuilder() : leaves(0), alphabet(NUM_SYMBOLS) {
+    }
+
+    //
+    // Builds the tree of the nonzero counts of an alphabet of alphabetSize
+    // symbols (indexed by symbolIndex for bytes) and returns the number of
+    // leaves.
+    //
+    int build(const uint64_t* counts, int alphabetSize = NUM_SYMBOLS) {
+        leaves = 0;
+        alphabet = alphabetSize;
+        for (int i = 0; i < alphabet; i++) {
+            if (counts[i] > 0) {
+                sorted[leaves++] = i;
+            }
+        }
+        sort(sorted, sorted + leaves, [counts](int a, int b) {
+            return counts[a] != counts[b] ? counts[a] < counts[b] : a < b;
+        });
+        for (int i = 0; i < leaves; i++) {
+            weights[i] = counts[sorted[i]];
+        }
+
+        int nextLeaf = 0;
+        int nextMerged = leaves;
+        for (int node = leaves; node < nodeCount(); node++) {
+            int first = takeCheapest(nextLeaf, nextMerged, node);
+            int second = takeCheapest(nextLeaf, nextMerged, node);
+            children[node - leaves][0] = first;
+            children[node - leaves][1] = second;
+            parents[first] = node;
+            parents[second] = node;
+            weights[node] = weights[first] + weights[second];
+        }
+        return leaves;
+    }
+
+    int leafCount() const {
+        return leaves;
+    }
+
+    int nodeCount() const {
+        return leaves > 0 ? 2 * leaves - 1 : 0;
+    }
+
+    int root() const {
+        return nodeCount() - 1;
+    }
+
+    bool isLeaf(int node) const {
+        return node < leaves;
+    }
+
+    // symbolIndex of a leaf
+    int symbol(int node) const {
+        return sorted[node];
+    }
+
+    // child of a merged node; bit 0 is the cheaper one
+    int child(int node, int bit) const {
+        return children[node - leaves][bit];
+    }
+
+    //
+    // Sets lengths (one per symbol of the alphabet built) to the depth of
+    // every leaf, and 0 for unused symbols.  A tree with a single leaf gets
+    // a 1-bit code so that every used symbol has a nonzero length.
+    //
+    void codeLengths(vector<int>& lengths) const {
+        lengths.assign(alphabet, 0);
+        if (leaves == 1) {
+            lengths[sorted[0]] = 1;
+        }
+        if (leaves <= 1) {
+            return;
+        }
+        // parents come after their children, so one pass from the root
+        // down finds every depth
+        int depths[2 * MAX_ALPHABET];
+        depths[root()] = 0;
+        for (int node = root() - 1; node >= 0; node--) {
+            depths[node] = depths[parents[node]] + 1;
+            if (isLeaf(node)) {
+                lengths[sorted[node]] = depths[node];
+            }
+        }
+    }
+
+ private:
+    int takeCheapest(int& nextLeaf, int& nextMerged, int end) const {
+        if (nextLeaf < leaves &&
+            (nextMerged == end || weights[nextLeaf] <= weights[nextMerged])) {
+            return nextLeaf++;
+        }
+        return nextMerged++;
+    }
+
+    int leaves;
+    int alphabet;
+    int sorted[MAX_ALPHABET];  // the leaves' symbols
+    uint64_t weights[2 * MAX_ALPHABET];
+    int parents[2 * MAX_ALPHABET];
+    int children[MAX_ALPHABET][2];
+};
+
+
+//
+// *This function returns the optimal code lengths, none longer than
+// maxLength, for the nonzero counts of an alphabet of alphabetSize symbols
+// (unused symbols get 0).  It uses package-merge: each level
+// pairs up the cheapest items of the level below into packages and merges
+// them with the leaves, and the cheapest 2n - 2 items of the top level say
+// how many times each leaf is chosen, which is its code length.  maxLength
+// must be at least MIN_CODE_LENGTH_LIMIT.
+//
+inline vector<int> packageMerge(const uint64_t* counts, int alphabetSize,
+                                int maxLength) {
+    struct Item {
+        uint64_t weight;
+        int symbol;  // -1 for a package of two items from the level below
+    };
+
+    vector<Item> leaves;
+    for (int i = 0; i < alphabetSize; i++) {
+        if (counts[i] > 0) {
+            Item leaf = {counts[i], i};
+            leaves.push_back(leaf);
+        }
+    }
+    stable_sort(leaves.begin(), leaves.end(),
+                [](const Item& a, const Item& b) {
+        return a.weight < b.weight;
+    });
+
+    vector<int> lengths(alphabetSize, 0);
+    if (leaves.size() == 1) {
+        lengths[leaves[0].symbol] = 1;
+    }
+    if (leaves.size() <= 1) {
+        return lengths;
+    }
+
+    vector<vector<Item> > levels(maxLength);
+    levels[0] = leaves;
+    for (int level = 1; level < maxLength; level++) {
+        const vector<Item>& below = levels[level - 1];
+        vector<Item>& items = levels[level];
+        size_t leaf = 0;
+        size_t pair = 0;
+        while (leaf < leaves.size() || pair + 1 < below.size()) {
+            bool takePackage = pair + 1 < below.size() &&
+                (leaf == leaves.size() ||
+                 below[pair].weight + below[pair + 1].weight <
+                     leaves[leaf].weight);
+            if (takePackage) {
+                Item package = {below[pair].weight + below[pair + 1].weight,
+                                -1};
+                items.push_back(package);
+                pair += 2;
+            } else {
+                items.push_back(leaves[leaf++]);
+            }
+        }
+    }
+
+    // every leaf chosen at a level adds one bit to its code; every package
+    // chosen means the two items it was made of are chosen one level down
+    size_t chosen = 2 * leaves.size() - 2;
+    for (int level = maxLength - 1; level >= 0; level--) {
+        size_t packages = 0;
+        for (size_t i = 0; i < chosen; i++) {
+            if (levels[level][i].symbol >= 0) {
+                lengths[levels[level][i].symbol]++;
+            } else {
+                packages++;
+            }
+        }
+        chosen = 2 * packages;
+    }
+    return lengths;
+}
+
+
+inline vector<int> packageMerge(const Histogram& histogram, int maxLength) {
+    return packageMerge(histogram.counts, NUM_SYMBOLS, maxLength);
+}
+
+
+//
+// *This function makes sure no code in lengths (built from counts, one per
+// entry of lengths) is longer than maxLength, rebuilding all of them with
+// packageMerge if one is.  A maxLength of 0 leaves the lengths unlimited.
+//
+inline void limitCodeLengths(const uint64_t* counts, vector<int>& lengths,
+                             int maxLength) {
+    if (maxLength <= 0 || lengths.empty()) {
+        return;
+    }
+    int longest = *max_element(lengths.begin(), lengths.end());
+    if (longest > maxLength) {
+        lengths = packageMerge(counts, (int)lengths.size(), maxLength);
+    }
+}
+
+inline void limitCodeLengths(const Histogram& histogram, vector<int>& lengths,
+                             int maxLength) {
+    limitCodeLengths(histogram.counts, lengths, maxLength);
+}
@@ -0,0 +1,703 @@
+//
+//  container.h
+//  File Compression II
+//
+//  Binary layout of a compressed (.huf) file.  Only the canonical code
+//  length of each symbol is stored, since the lengths alone rebuild the
+//  code (see canonicalCodes in hufftable.h).  All integers are little
+//  endian.  The input is split into independent blocks so that they can be
+//  coded in parallel:
+//
+//      magic           4 bytes   "HUFC"
+//      version         1 byte    CONTAINER_VERSION
+//      blockSize       4 bytes   largest number of input bytes in a block
+//      maxCodeLength   1 byte    no code in any block is longer (0 for no
+//                                limit)
+//      dedupWindow     1 byte    log2 of how far back a MODEL_DEDUP block
+//                                may refer (0 for none)
+//      blocks                    one BlockHeader + payload per block
+//      end marker      4 bytes   0 (a block with no input)
+//      block index               one BlockIndexEntry per block
+//      blockCount      4 bytes
+//      index magic     4 bytes   "HUFI"
+//
+//  A block is rawLength (4 bytes), payloadLength (4 bytes), its model (1
+//  byte), the number of sub-streams (1 byte, 1 or SUBSTREAMS), a jump table
+//  of the byte lengths of all but the last sub-stream (4 bytes each), the
+//  code lengths, then payloadLength bytes of canonical codes for exactly
+//  rawLength symbols.
+//  Blocks may hold fewer than blockSize bytes anywhere in the file, not
+//  just at its end.  The code lengths can be the single byte
+//  LENGTHS_PREVIOUS, meaning the block is coded with the lengths of the
+//  block before it.
+//
+//  The symbols of a block are cut into as many runs of equal size as it
+//  has sub-streams (see subStreamBounds), each coded as its own
+//  byte-aligned stream, one after the other, so a decoder can keep one bit
+//  reader per stream going at once.
+//
+//  A MODEL_ORDER0 block is as above.  A MODEL_ORDER1 block (see context.h)
+//  has, in place of its code lengths, the number of tables (1 byte, 1 to
+//  MAX_CONTEXT_TABLES), the context map (256 bytes: the table that codes a
+//  byte following each byte value), and the code lengths of every table.
+//  Each sub-stream starts in context 0.
+//
+//  A MODEL_LZ77 block (see lz77.h) is always one stream.  In place of its
+//  code lengths it has those of the literal/length code (LZ_LITLEN_SYMBOLS
+//  lengths) and then of the distance code (LZ_DISTANCE_SYMBOLS lengths),
+//  and its payload is the tokens that make up its rawLength bytes, with no
+//  PSEUDO_EOF.
+//
+//  A MODEL_DEDUP block (see dedup.h) is one stream with no code lengths.  Its
+//  payload is references, DEDUP_REFERENCE_SIZE bytes each: a distance (8
+//  bytes) and a length (4 bytes), meaning "copy length bytes of output from
+//  distance bytes back".  The lengths add up to rawLength, and no distance is
+//  less than its length or more than the window.
+//
+//  A MODEL_BWT block (see bwt.h) is one stream of at most BWT_MAX_LENGTH
+//  bytes.  In place of its code lengths it has BWT_CHAINS rows (4 bytes each)
+//  and then the code lengths of its BWT_SYMBOLS symbols.  Cutting the block
+//  into BWT_CHAINS runs as subStreamBounds does, row k is where the suffix
+//  starting at run k sorts among all the suffixes, row 0 being the empty one
+//  (which a run starting at the end of the block gets).  The payload is the
+//  move-to-front ranks of the transformed block, runs of rank 0 coded as
+//  BWT_RUN_A/BWT_RUN_B digits, with no PSEUDO_EOF.
+//
+//  A MODEL_STORED block is one stream with no code lengths, whose payload is
+//  its rawLength bytes unchanged (payloadLength equals rawLength).  It is
+//  what a block that no model can shrink becomes, so a file of
+//  already-compressed data grows by no more than its headers.
+//
+//  A MODEL_FSE block (see fse.h) is one stream.  In place of its code lengths
+//  it has the normalized counts of its bytes (writeNormalizedCounts), which
+//  add up to 2^tableLog.  The payload is the FSE_STATES starting states
+//  (tableLog bits each) and then, for each byte in order, the bits that take
+//  its state to the next, with no PSEUDO_EOF.
+//
+//  The end marker lets a reader that cannot seek (a pipe) stop after the
+//  last block; the index at the end lets one that can seek find every block
+//  without reading the ones before it.
+//
+//  Files written before this format start with the textual frequency map
+//  ("{97:1, ...}") and are still recognized by decompress().
+//
+
+#pragma once
+
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <sstream>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+#include "bitstream.h"
+#include "hufftable.h"
+#include "codelengths.h"
+
+using namespace std;
+
+const char CONTAINER_MAGIC[4] = {'H', 'U', 'F', 'C'};
+const char INDEX_MAGIC[4] = {'H', 'U', 'F', 'I'};
+const int CONTAINER_VERSION = 2;
+
+// Lengths packed two per byte, low nibble first; only if all are <= 15.
+const int LENGTHS_NIBBLES = 0;
+// Lengths as (run length - 1, code length) byte pairs.
+const int LENGTHS_RUNS = 1;
+// The lengths of the block before; nothing follows.
+const int LENGTHS_PREVIOUS = 2;
+
+// Block models: one code for the block, one per context, LZ77 tokens,
+// copies of earlier output, Burrows-Wheeler transformed bytes, bytes left
+// as they are, or bytes coded with tANS.
+const int MODEL_ORDER0 = 0;
+const int MODEL_ORDER1 = 1;
+const int MODEL_LZ77 = 2;
+const int MODEL_DEDUP = 3;
+const int MODEL_BWT = 4;
+const int MODEL_STORED = 5;
+const int MODEL_FSE = 6;
+const int MAX_CONTEXT_TABLES = 32;
+// LZ77 alphabets: 256 literals then the match length codes, and distances
+const int LZ_LENGTH_CODES = 29;
+const int LZ_LITLEN_SYMBOLS = 256 + LZ_LENGTH_CODES;
+const int LZ_DISTANCE_SYMBOLS = 32;
+// MODEL_DEDUP references and how far back they may reach
+const int DEDUP_REFERENCE_SIZE = 12;
+const int MIN_DEDUP_WINDOW_LOG = 20;
+const int MAX_DEDUP_WINDOW_LOG = 32;
+// MODEL_BWT alphabet: two digits for runs of rank 0, then ranks 1 to 255;
+// rows are packed with a byte into 32 bits, so blocks stay below 2^24
+const int BWT_RUN_A = 0;
+const int BWT_RUN_B = 1;
+const int BWT_SYMBOLS = 257;
+const int BWT_CHAINS = 8;
+const uint32_t BWT_MAX_LENGTH = (1 << 24) - 1;
+// MODEL_FSE tables have 2^tableLog states, and FSE_STATES states take
+// turns over the bytes; a state transition never takes more than tableLog
+// bits
+const int FSE_MIN_TABLE_LOG = 5;
+const int FSE_MAX_TABLE_LOG = 13;
+const int FSE_STATES = 4;
+
+struct ContainerHeader {
+    int version;
+    uint32_t blockSize;
+    int maxCodeLength;        // 0 for no limit
+    int dedupWindowLog;       // 0 for no MODEL_DEDUP blocks
+
+    ContainerHeader()
+        : version(CONTAINER_VERSION), blockSize(0), maxCodeLength(0),
+          dedupWindowLog(0) {
+    }
+};
+
+struct BlockHeader {
+    uint32_t rawLength;
+    uint32_t payloadLength;
+    int model;                // MODEL_*
+    int streams;              // sub-streams, 1 or SUBSTREAMS
+    vector<uint32_t> streamLengths;  // bytes of all but the last sub-stream
+    vector<int> codeLengths;  // NUM_SYMBOLS entries, indexed by symbolIndex
+    bool sameLengths;         // codeLengths are the previous block's
+    // MODEL_ORDER1 only, with codeLengths empty: the table of each context
+    // and the code lengths of each table
+    vector<unsigned char> contextMap;
+    vector<vector<int> > contextLengths;
+    // MODEL_LZ77 only, with codeLengths empty: the code lengths of the
+    // literal/length and distance codes
+    vector<int> literalLengths;
+    vector<int> distanceLengths;
+    // MODEL_BWT only, with codeLengths empty: the BWT_CHAINS rows and the
+    // code lengths of the BWT symbols
+    vector<uint32_t> bwtRows;
+    vector<int> bwtLengths;
+    // MODEL_FSE only, with codeLengths empty: the log2 of the table size
+    // and the normalized count of each byte
+    int fseTableLog;
+    vector<int> fseCounts;
+
+    BlockHeader()
+        : rawLength(0), payloadLength(0), model(MODEL_ORDER0), streams(1),
+          sameLengths(false), fseTableLog(0) {
+    }
+};
+
+struct BlockIndexEntry {
+    uint64_t offset;       // of the block header from the start of the file
+    uint32_t rawLength;
+    uint32_t blockLength;  // header and payload
+};
+
+
+//
+// MemoryBuffer
+// A read-only streambuf over bytes already in memory, so that a block
+// fetched with one positional read can be parsed with the stream-based
+// readers below without copying it.
+//
+class MemoryBuffer : public streambuf {
+ public:
+    MemoryBuffer(const char* data, size_t length) {
+        char* begin = const_cast<char*>(data);
+        setg(begin, begin, begin + length);
+    }
+
+    // number of bytes read so far
+    size_t position() const {
+        return gptr() - eback();
+    }
+};
+
+
+inline void writeLittleEndian(ostream& out, uint64_t value, int nBytes) {
+    for (int i = 0; i < nBytes; i++) {
+        out.put(char(value >> (8 * i)));
+    }
+}
+
+
+inline uint64_t readLittleEndian(istream& in, int nBytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < nBytes; i++) {
+        int byte = in.get();
+        if (byte == EOF) {
+            throw runtime_error("TRUNCATED HEADER");
+        }
+        value |= uint64_t(byte) << (8 * i);
+    }
+    return value;
+}
+
+
+//
+// *This function writes a code length table in whichever of the two forms is
+// smaller.  Nibbles take a constant 129 bytes; runs win on inputs that use
+// few distinct bytes or give most bytes the same length.
+//
+inline void writeCodeLengths(ostream& out, const vector<int>& lengths) {
+    vector<unsigned char> runs;
+    int maxLength = 0;
+    for (size_t i = 0; i < lengths.size(); ) {
+        size_t j = i;
+        while (j < lengths.size() && j - i < 256 && lengths[j] == lengths[i]) {
+            j++;
+        }
+        runs.push_back((unsigned char)(j - i - 1));
+        runs.push_back((unsigned char)lengths[i]);
+        maxLength = max(maxLength, lengths[i]);
+        i = j;
+    }
+
+    size_t nibbleBytes = (lengths.size() + 1) / 2;
+    if (maxLength <= 15 && nibbleBytes <= runs.size()) {
+        out.put(char(LENGTHS_NIBBLES));
+        for (size_t i = 0; i < lengths.size(); i += 2) {
+            int high = (i + 1 < lengths.size()) ? lengths[i + 1] : 0;
+            out.put(char(lengths[i] | (high << 4)));
+        }
+    } else {
+        out.put(char(LENGTHS_RUNS));
+        out.write((const char*)runs.data(), runs.size());
+    }
+}
+
+
+//
+// *This function reads a code length table written by writeCodeLengths into
+// lengths, which must already have one entry per symbol.
+//
+inline void readCodeLengths(istream& in, vector<int>& lengths) {
+    int coding = (int)readLittleEndian(in, 1);
+    if (coding == LENGTHS_NIBBLES) {
+        for (size_t i = 0; i < lengths.size(); i += 2) {
+            int byte = (int)readLittleEndian(in, 1);
+            lengths[i] = byte & 0xf;
+            if (i + 1 < lengths.size()) {
+                lengths[i + 1] = byte >> 4;
+            }
+        }
+    } else if (coding == LENGTHS_RUNS) {
+        for (size_t i = 0; i < lengths.size(); ) {
+            size_t run = readLittleEndian(in, 1) + 1;
+            int length = (int)readLittleEndian(in, 1);
+            if (i + run > lengths.size()) {
+                throw runtime_error("BAD CODE LENGTHS");
+            }
+            for (size_t j = 0; j < run; j++) {
+                lengths[i++] = length;
+            }
+        }
+    } else {
+        throw runtime_error("BAD CODE LENGTHS");
+    }
+}
+
+
+//
+// *This function returns how many bits it takes to write any number from 0
+// to value.
+//
+inline int _countBits(uint32_t value) {
+    return value == 0 ? 0 : 32 - __builtin_clz(value);
+}
+
+
+//
+// *This function writes the normalized counts of a MODEL_FSE block, which
+// add up to 2^tableLog: the table log (1 byte), then the counts from byte 0
+// up, packed low bit first, each in just enough bits for what is left of
+// the table.  A count of 0 is followed by the number of zero counts after
+// it, 2 bits at a time, 3 meaning that another 2 bits follow.  The counts
+// stop once the table is full, and the last byte is padded with zeros.
+//
+inline void writeNormalizedCounts(ostream& out, const vector<int>& counts,
+                                  int tableLog) {
+    out.put(char(tableLog));
+    uint32_t buffer = 0;
+    int bufferBits = 0;
+    auto put = [&](uint32_t value, int nBits) {
+        buffer |= value << bufferBits;
+        bufferBits += nBits;
+        while (bufferBits >= 8) {
+            out.put(char(buffer));
+            buffer >>= 8;
+            bufferBits -= 8;
+        }
+    };
+    uint32_t remaining = 1u << tableLog;
+    for (size_t s = 0; s < counts.size() && remaining > 0; s++) {
+        put((uint32_t)counts[s], _countBits(remaining));
+        remaining -= counts[s];
+        if (counts[s] == 0) {
+            size_t zeros = 0;
+            while (s + 1 + zeros < counts.size() &&
+                   counts[s + 1 + zeros] == 0) {
+                zeros++;
+            }
+            s += zeros;
+            for (; zeros >= 3; zeros -= 3) {
+                put(3, 2);
+            }
+            put((uint32_t)zeros, 2);
+        }
+    }
+    if (bufferBits > 0) {
+        out.put(char(buffer));
+    }
+}
+
+
+//
+// *This function reads normalized counts written by writeNormalizedCounts
+// into counts (one per byte value) and tableLog.  Throws a runtime_error
+// if the table log is out of range or the counts do not fill the table
+// exactly.
+//
+inline void readNormalizedCounts(istream& in, vector<int>& counts,
+                                 int& tableLog) {
+    tableLog = (int)readLittleEndian(in, 1);
+    if (tableLog < FSE_MIN_TABLE_LOG || tableLog > FSE_MAX_TABLE_LOG) {
+        throw runtime_error("BAD BLOCK HEADER");
+    }
+    uint32_t buffer = 0;
+    int bufferBits = 0;
+    auto get = [&](int nBits) {
+        while (bufferBits < nBits) {
+            buffer |= (uint32_t)readLittleEndian(in, 1) << bufferBits;
+            bufferBits += 8;
+        }
+        uint32_t value = buffer & ((1u << nBits) - 1);
+        buffer >>= nBits;
+        bufferBits -= nBits;
+        return value;
+    };
+    counts.assign(256, 0);
+    uint32_t remaining = 1u << tableLog;
+    size_t s = 0;
+    while (remaining > 0) {
+        if (s >= counts.size()) {
+            throw runtime_error("BAD BLOCK HEADER");
+        }
+        uint32_t count = get(_countBits(remaining));
+        if (count > remaining) {
+            throw runtime_error("BAD BLOCK HEADER");
+        }
+        counts[s++] = (int)count;
+        remaining -= count;
+        if (count == 0) {
+            uint32_t zeros;
+            do {
+                zeros = get(2);
+                s += zeros;
+            } while (zeros == 3);
+        }
+    }
+}
+
+
+inline void writeHeader(ostream& out, const ContainerHeader& header) {
+    out.write(CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC));
+    out.put(char(header.version));
+    writeLittleEndian(out, header.blockSize, 4);
+    writeLittleEndian(out, header.maxCodeLength, 1);
+    writeLittleEndian(out, header.dedupWindowLog, 1);
+}
+
+
+//
+// *This function reads and checks a header written by writeHeader.  It
+// throws a runtime_error if the input is not a compressed file of a known
+// version.
+//
+inline void readHeader(istream& in, ContainerHeader& header) {
+    char magic[sizeof(CONTAINER_MAGIC)];
+    if (!in.read(magic, sizeof(magic)) ||
+        !equal(magic, magic + sizeof(magic), CONTAINER_MAGIC)) {
+        throw runtime_error("NOT A COMPRESSED FILE");
+    }
+    header.version = (int)readLittleEndian(in, 1);
+    if (header.version != CONTAINER_VERSION) {
+        throw runtime_error("UNSUPPORTED VERSION");
+    }
+    header.blockSize = (uint32_t)readLittleEndian(in, 4);
+    header.maxCodeLength = (int)readLittleEndian(in, 1);
+    header.dedupWindowLog = (int)readLittleEndian(in, 1);
+    if (header.dedupWindowLog != 0 &&
+        (header.dedupWindowLog < MIN_DEDUP_WINDOW_LOG ||
+         header.dedupWindowLog > MAX_DEDUP_WINDOW_LOG)) {
+        throw runtime_error("UNSUPPORTED WINDOW");
+    }
+}
+
+
+inline void writeBlockHeader(ostream& out, const BlockHeader& header) {
+    writeLittleEndian(out, header.rawLength, 4);
+    writeLittleEndian(out, header.payloadLength, 4);
+    writeLittleEndian(out, header.model, 1);
+    writeLittleEndian(out, header.streams, 1);
+    for (size_t i = 0; i < header.streamLengths.size(); i++) {
+        writeLittleEndian(out, header.streamLengths[i], 4);
+    }
+    if (header.model == MODEL_DEDUP || header.model == MODEL_STORED) {
+        return;
+    }
+    if (header.model == MODEL_ORDER1) {
+        writeLittleEndian(out, header.contextLengths.size(), 1);
+        out.write((const char*)header.contextMap.data(),
+                  header.contextMap.size());
+        for (size_t t = 0; t < header.contextLengths.size(); t++) {
+            writeCodeLengths(out, header.contextLengths[t]);
+        }
+    } else if (header.model == MODEL_LZ77) {
+        writeCodeLengths(out, header.literalLengths);
+        writeCodeLengths(out, header.distanceLengths);
+    } else if (header.model == MODEL_BWT) {
+        for (size_t k = 0; k < header.bwtRows.size(); k++) {
+            writeLittleEndian(out, header.bwtRows[k], 4);
+        }
+        writeCodeLengths(out, header.bwtLengths);
+    } else if (header.model == MODEL_FSE) {
+        writeNormalizedCounts(out, header.fseCounts, header.fseTableLog);
+    } else if (header.sameLengths) {
+        out.put(char(LENGTHS_PREVIOUS));
+    } else {
+        writeCodeLengths(out, header.codeLengths);
+    }
+}
+
+
+//
+// *This function throws a runtime_error if a code in lengths is longer than
+// maxCodeLength (0 for no limit).
+//
+inline void _checkCodeLengths(const vector<int>& lengths, int maxCodeLength) {
+    if (maxCodeLength > 0 &&
+        *max_element(lengths.begin(), lengths.end()) > maxCodeLength) {
+        throw runtime_error("BAD CODE LENGTHS");
+    }
+}
+
+
+//
+// *This function returns the number of bytes writeBlockHeader writes for
+// header, which is also what it took up if it was read from a stream.
+//
+inline size_t blockHeaderSize(const BlockHeader& header) {
+    ostringstream bytes;
+    writeBlockHeader(bytes, header);
+    return bytes.str().size();
+}
+
+
+//
+// *This function returns the number of bytes the order-0 header would be
+// smaller by if it reused the previous block's code lengths instead of
+// writing its own.
+//
+inline size_t reusedLengthsSaving(const BlockHeader& header) {
+    BlockHeader reused = header;
+    reused.sameLengths = true;
+    return blockHeaderSize(header) - blockHeaderSize(reused);
+}
+
+
+//
+// *This function reads the next block header of a file with the given file
+// header.  It returns false at the end marker that follows the last block.
+// A block that reuses the lengths of the one before gets a copy of
+// previous, or, if previous is null, empty codeLengths for the caller to
+// fill in.  Throws a runtime_error if a code is longer than the file's
+// maxCodeLength, if the sub-streams do not fit in the payload, if the
+// block reuses lengths and previous is empty, or if the model is unknown.
+// Order-1, LZ77, dedup, BWT, stored and FSE blocks leave codeLengths
+// empty.  LZ77, dedup, BWT, stored and FSE blocks must be one stream, a
+// dedup block's payload must be whole references, a BWT block must fit
+// BWT_MAX_LENGTH and have rows within it, a stored block's payload must be
+// its raw bytes, an FSE block's counts must fill its table, and LZ77 and
+// BWT codes are never longer than a HuffmanDecodeTable takes.
+//
+inline bool readBlockHeader(istream& in, BlockHeader& header,
+                            const ContainerHeader& file,
+                            const vector<int>* previous = nullptr) {
+    header.rawLength = (uint32_t)readLittleEndian(in, 4);
+    if (header.rawLength == 0) {
+        return false;
+    }
+    header.payloadLength = (uint32_t)readLittleEndian(in, 4);
+    header.model = (int)readLittleEndian(in, 1);
+    if (header.model < MODEL_ORDER0 || header.model > MODEL_FSE ||
+        (header.model == MODEL_DEDUP && file.dedupWindowLog == 0)) {
+        throw runtime_error("BAD BLOCK HEADER");
+    }
+    header.streams = (int)readLittleEndian(in, 1);
+    if (header.streams != 1 && header.streams != SUBSTREAMS) {
+        throw runtime_error("BAD BLOCK HEADER");
+    }
+    header.streamLengths.clear();
+    uint64_t total = 0;
+    for (int i = 0; i + 1 < header.streams; i++) {
+        header.streamLengths.push_back((uint32_t)readLittleEndian(in, 4));
+        total += header.streamLengths.back();
+    }
+    if (total > header.payloadLength) {
+        throw runtime_error("BAD BLOCK HEADER");
+    }
+    int maxCodeLength = file.maxCodeLength;
+    header.contextMap.clear();
+    header.contextLengths.clear();
+    header.literalLengths.clear();
+    header.distanceLengths.clear();
+    header.bwtRows.clear();
+    header.bwtLengths.clear();
+    header.fseTableLog = 0;
+    header.fseCounts.clear();
+    if (header.model == MODEL_DEDUP) {
+        if (header.streams != 1 ||
+            header.payloadLength % DEDUP_REFERENCE_SIZE != 0) {
+            throw runtime_error("BAD BLOCK HEADER");
+        }
+        header.sameLengths = false;
+        header.codeLengths.clear();
+        return true;
+    }
+    if (header.model == MODEL_STORED) {
+        if (header.streams != 1 ||
+            header.payloadLength != header.rawLength) {
+            throw runtime_error("BAD BLOCK HEADER");
+        }
+        header.sameLengths = false;
+        header.codeLengths.clear();
+        return true;
+    }
+    if (header.model == MODEL_FSE) {
+        if (header.streams != 1) {
+            throw runtime_error("BAD BLOCK HEADER");
+        }
+        header.sameLengths = false;
+        header.codeLengths.clear();
+        readNormalizedCounts(in, header.fseCounts, header.fseTableLog);
+        return true;
+    }
+    if (header.model == MODEL_LZ77) {
+        if (header.streams != 1) {
+            throw runtime_error("BAD BLOCK HEADER");
+        }
+        header.sameLengths = false;
+        header.codeLengths.clear();
+        int limit = effectiveCodeLengthLimit(maxCodeLength);
+        header.literalLengths.assign(LZ_LITLEN_SYMBOLS, 0);
+        readCodeLengths(in, header.literalLengths);
+        _checkCodeLengths(header.literalLengths, limit);
+        header.distanceLengths.assign(LZ_DISTANCE_SYMBOLS, 0);
+        readCodeLengths(in, header.distanceLengths);
+        _checkCodeLengths(header.distanceLengths, limit);
+        return true;
+    }
+    if (header.model == MODEL_BWT) {
+        if (header.streams != 1 || header.rawLength > BWT_MAX_LENGTH) {
+            throw runtime_error("BAD BLOCK HEADER");
+        }
+        header.sameLengths = false;
+        header.codeLengths.clear();
+        for (int k = 0; k < BWT_CHAINS; k++) {
+            header.bwtRows.push_back((uint32_t)readLittleEndian(in, 4));
+            if (header.bwtRows[k] > header.rawLength) {
+                throw runtime_error("BAD BLOCK HEADER");
+            }
+        }
+        int limit = effectiveCodeLengthLimit(maxCodeLength);
+        header.bwtLengths.assign(BWT_SYMBOLS, 0);
+        readCodeLengths(in, header.bwtLengths);
+        _checkCodeLengths(header.bwtLengths, limit);
+        return true;
+    }
+    if (header.model == MODEL_ORDER1) {
+        header.sameLengths = false;
+        header.codeLengths.clear();
+        int tables = (int)readLittleEndian(in, 1);
+        if (tables < 1 || tables > MAX_CONTEXT_TABLES) {
+            throw runtime_error("BAD BLOCK HEADER");
+        }
+        header.contextMap.resize(256);
+        for (size_t c = 0; c < header.contextMap.size(); c++) {
+            header.contextMap[c] = (unsigned char)readLittleEndian(in, 1);
+            if (header.contextMap[c] >= tables) {
+                throw runtime_error("BAD BLOCK HEADER");
+            }
+        }
+        header.contextLengths.assign(tables, vector<int>(NUM_SYMBOLS, 0));
+        for (int t = 0; t < tables; t++) {
+            readCodeLengths(in, header.contextLengths[t]);
+            _checkCodeLengths(header.contextLengths[t], maxCodeLength);
+        }
+        return true;
+    }
+    header.sameLengths = (in.peek() == LENGTHS_PREVIOUS);
+    if (header.sameLengths) {
+        in.get();
+        if (previous == nullptr) {
+            header.codeLengths.clear();
+            return true;
+        }
+        if (previous->empty()) {
+            throw runtime_error("BAD CODE LENGTHS");
+        }
+        header.codeLengths = *previous;
+        return true;
+    }
+    header.codeLengths.assign(NUM_SYMBOLS, 0);
+    readCodeLengths(in, header.codeLengths);
+    _checkCodeLengths(header.codeLengths, maxCodeLength);
+    return true;
+}
+
+
+//
+// *This function writes the end marker and the block index that close a
+// file.
+//
+inline void writeBlockIndex(ostream& out,
+                            const vector<BlockIndexEntry>& index) {
+    writeLittleEndian(out, 0, 4);
+    for (size_t i = 0; i < index.size(); i++) {
+        writeLittleEndian(out, index[i].offset, 8);
+        writeLittleEndian(out, index[i].rawLength, 4);
+        writeLittleEndian(out, index[i].blockLength, 4);
+    }
+    writeLittleEndian(out, index.size(), 4);
+    out.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+}
+
+
+//
+// *This function reads the block index from the end of a seekable file.
+// The stream position is left unspecified.
+//
+inline void readBlockIndex(istream& in, vector<BlockIndexEntry>& index) {
+    const int ENTRY_SIZE = 16;
+    const int TRAILER_SIZE = 4 + sizeof(INDEX_MAGIC);
+    in.clear();
+    in.seekg(0, ios::end);
+    streamoff fileSize = in.tellg();
+    if (fileSize < TRAILER_SIZE) {
+        throw runtime_error("MISSING BLOCK INDEX");
+    }
+    in.seekg(fileSize - TRAILER_SIZE);
+    uint64_t count = readLittleEndian(in, 4);
+    char magic[sizeof(INDEX_MAGIC)];
+    if (!in.read(magic, sizeof(magic)) ||
+        !equal(magic, magic + sizeof(magic), INDEX_MAGIC) ||
+        (uint64_t)fileSize < TRAILER_SIZE + count * ENTRY_SIZE) {
+        throw runtime_error("MISSING BLOCK INDEX");
+    }
+    in.seekg(fileSize - TRAILER_SIZE - streamoff(count * ENTRY_SIZE));
+    index.resize(count);
+    for (size_t i = 0; i < index.size(); i++) {
+        index[i].offset = readLittleEndian(in, 8);
+        index[i].rawLength = (uint32_t)readLittleEndian(in, 4);
+        index[i].blockLength = (uint32_t)readLittleEndian(in, 4);
+    }
+}
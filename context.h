@@ -0,0 +1,355 @@
+//
+//  context.h
+//  File Compression II
+//
+//  Order-1 context modeling.  One code for every byte ignores what came
+//  before it, and in text what came before says a lot: after 'q' comes
+//  'u', after a space comes the start of a word.  An order-1 block codes
+//  each byte with the code of its context, the byte before it, so a byte
+//  that is likely where it stands gets a short code even if it is rare
+//  overall.
+//
+//  A code per context would mean 256 code length tables per block, which
+//  costs more than it saves on all but the largest blocks, so the contexts
+//  are grouped into at most maxTables clusters that share a table.
+//  clusterContexts groups contexts whose next bytes are distributed alike
+//  (k-means over the byte distributions, then merging clusters for as long
+//  as a table costs more than it saves) and says whether the result beats
+//  one order-0 code at all.  The block header holds the context map (which
+//  table each context uses) and the tables (see container.h).
+//
+//  Every sub-stream starts with context 0, as if it started the block, so
+//  the streams of a block still decode independently.
+//
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "hufftable.h"
+#include "histogram.h"
+#include "codelengths.h"
+#include "blocksplit.h"
+
+using namespace std;
+
+const int NUM_CONTEXTS = 256;
+const int DEFAULT_CONTEXT_TABLES = 16;
+// what one code length table in a block header costs, about
+const double CONTEXT_TABLE_BITS = 8.0 * (1 + (NUM_SYMBOLS + 1) / 2);
+// the context map, one byte per context
+const double CONTEXT_MAP_BITS = 8.0 * NUM_CONTEXTS;
+// k-means passes over the contexts; later ones rarely move any
+const int CONTEXT_CLUSTER_PASSES = 4;
+
+
+//
+// *This function counts the length bytes of data by context into contexts
+// (NUM_CONTEXTS histograms, which it clears first).  The block is cut into
+// streams sub-streams (see subStreamBounds), each starting in context 0.
+//
+inline void countContexts(const unsigned char* data, size_t length,
+                          int streams, vector<Histogram>& contexts) {
+    contexts.assign(NUM_CONTEXTS, Histogram());
+    size_t bounds[SUBSTREAMS + 1] = {0, length};
+    if (streams > 1) {
+        subStreamBounds(length, bounds);
+    }
+    for (int k = 0; k < streams; k++) {
+        int previous = 0;
+        for (size_t i = bounds[k]; i < bounds[k + 1]; i++) {
+            contexts[previous].counts[data[i]]++;
+            previous = data[i];
+        }
+    }
+}
+
+
+//
+// *This function returns the estimated bits of coding the symbols of
+// context with a code built for the counts of cluster (whose total is
+// clusterTotal), where log2Cluster holds log2 of every count of cluster
+// plus one half.  Counts get one half added so that a symbol the cluster
+// has not seen costs a lot but not infinitely much.
+//
+inline double _crossEntropyBits(const Histogram& context,
+                                const double* log2Cluster,
+                                double clusterTotal) {
+    double log2Total = log2(clusterTotal + 0.5 * NUM_SYMBOLS);
+    double bits = 0;
+    for (int s = 0; s < NUM_SYMBOLS; s++) {
+        if (context.counts[s] > 0) {
+            bits += double(context.counts[s]) * (log2Total - log2Cluster[s]);
+        }
+    }
+    return bits;
+}
+
+
+//
+// *This function groups the NUM_CONTEXTS contexts into at most maxTables
+// clusters.  contextMap gets the cluster of each context (0 for contexts
+// that never occur) and clusters the summed counts of each cluster.
+// Returns true if coding by cluster is estimated to take fewer bits,
+// headers included, than one order-0 code for the whole block; otherwise
+// the block should stay order-0 and the outputs are unspecified.
+//
+inline bool clusterContexts(const vector<Histogram>& contexts, int maxTables,
+                            vector<unsigned char>& contextMap,
+                            vector<Histogram>& clusters) {
+    vector<int> active;
+    vector<uint64_t> totals(NUM_CONTEXTS, 0);
+    Histogram all;
+    for (int c = 0; c < NUM_CONTEXTS; c++) {
+        for (int s = 0; s < NUM_SYMBOLS; s++) {
+            totals[c] += contexts[c].counts[s];
+            all.counts[s] += contexts[c].counts[s];
+        }
+        if (totals[c] > 0) {
+            active.push_back(c);
+        }
+    }
+    int tables = min(maxTables, (int)active.size());
+    if (tables < 2) {
+        return false;
+    }
+
+    // seed with the busiest contexts, then move every context to the
+    // cluster that codes it best until the clusters settle
+    sort(active.begin(), active.end(), [&totals](int a, int b) {
+        return totals[a] > totals[b] || (totals[a] == totals[b] && a < b);
+    });
+    contextMap.assign(NUM_CONTEXTS, 0);
+    clusters.assign(tables, Histogram());
+    for (int t = 0; t < tables; t++) {
+        clusters[t] = contexts[active[t]];
+    }
+    vector<double> log2Counts(tables * NUM_SYMBOLS);
+    vector<double> clusterTotals(tables);
+    for (int pass = 0; pass < CONTEXT_CLUSTER_PASSES; pass++) {
+        for (int t = 0; t < tables; t++) {
+            clusterTotals[t] = 0;
+            for (int s = 0; s < NUM_SYMBOLS; s++) {
+                clusterTotals[t] += double(clusters[t].counts[s]);
+                log2Counts[t * NUM_SYMBOLS + s] =
+                    log2(double(clusters[t].counts[s]) + 0.5);
+            }
+        }
+        bool moved = false;
+        for (size_t i = 0; i < active.size(); i++) {
+            int c = active[i];
+            int bestTable = 0;
+            double bestBits = -1;
+            for (int t = 0; t < tables; t++) {
+                double bits = _crossEntropyBits(
+                    contexts[c], &log2Counts[t * NUM_SYMBOLS],
+                    clusterTotals[t]);
+                if (bestBits < 0 || bits < bestBits) {
+                    bestBits = bits;
+                    bestTable = t;
+                }
+            }
+            moved = moved || (pass > 0 && contextMap[c] != bestTable);
+            contextMap[c] = (unsigned char)bestTable;
+        }
+        for (int t = 0; t < tables; t++) {
+            clusters[t].clear();
+        }
+        for (size_t i = 0; i < active.size(); i++) {
+            int c = active[i];
+            for (int s = 0; s < NUM_SYMBOLS; s++) {
+                clusters[contextMap[c]].counts[s] += contexts[c].counts[s];
+            }
+        }
+        if (pass > 0 && !moved) {
+            break;
+        }
+    }
+
+    // drop the clusters nothing moved to, then merge the pair that costs
+    // the fewest bits to merge for as long as that is fewer than a table
+    vector<double> cost;
+    vector<int> renumber(tables, -1);
+    int kept = 0;
+    for (int t = 0; t < tables; t++) {
+        if (clusters[t].total() > 0) {
+            renumber[t] = kept;
+            clusters[kept++] = clusters[t];
+            cost.push_back(entropyCostBits(clusters[kept - 1].counts));
+        }
+    }
+    clusters.resize(kept);
+    for (size_t i = 0; i < active.size(); i++) {
+        contextMap[active[i]] = (unsigned char)renumber[contextMap[active[i]]];
+    }
+
+    // merged[a][b] for a < b: the cost of clusters a and b as one
+    vector<vector<double> > merged(kept, vector<double>(kept, 0));
+    uint64_t counts[NUM_SYMBOLS];
+    auto mergedCost = [&](int a, int b) {
+        for (int s = 0; s < NUM_SYMBOLS; s++) {
+            counts[s] = clusters[a].counts[s] + clusters[b].counts[s];
+        }
+        return entropyCostBits(counts);
+    };
+    for (int a = 0; a < kept; a++) {
+        for (int b = a + 1; b < kept; b++) {
+            merged[a][b] = mergedCost(a, b);
+        }
+    }
+    vector<bool> alive(kept, true);
+    int count = kept;
+    while (count > 1) {
+        int bestA = -1;
+        int bestB = -1;
+        double bestDelta = 0;
+        for (int a = 0; a < kept; a++) {
+            for (int b = a + 1; b < kept && alive[a]; b++) {
+                double delta = merged[a][b] - cost[a] - cost[b];
+                if (alive[b] && (bestA < 0 || delta < bestDelta)) {
+                    bestA = a;
+                    bestB = b;
+                    bestDelta = delta;
+                }
+            }
+        }
+        if (bestDelta >= CONTEXT_TABLE_BITS) {
+            break;
+        }
+        for (int s = 0; s < NUM_SYMBOLS; s++) {
+            clusters[bestA].counts[s] += clusters[bestB].counts[s];
+        }
+        cost[bestA] = merged[bestA][bestB];
+        alive[bestB] = false;
+        count--;
+        for (int t = 0; t < kept; t++) {
+            if (alive[t] && t != bestA) {
+                double both = mergedCost(min(t, bestA), max(t, bestA));
+                merged[min(t, bestA)][max(t, bestA)] = both;
+            }
+        }
+        for (size_t i = 0; i < active.size(); i++) {
+            if (contextMap[active[i]] == bestB) {
+                contextMap[active[i]] = (unsigned char)bestA;
+            }
+        }
+    }
+
+    double clusteredBits = CONTEXT_MAP_BITS;
+    kept = 0;
+    for (int t = 0; t < (int)alive.size(); t++) {
+        if (alive[t]) {
+            renumber[t] = kept;
+            clusters[kept++] = clusters[t];
+            clusteredBits += cost[t] + CONTEXT_TABLE_BITS;
+        }
+    }
+    clusters.resize(kept);
+    for (size_t i = 0; i < active.size(); i++) {
+        contextMap[active[i]] = (unsigned char)renumber[contextMap[active[i]]];
+    }
+    return kept > 1 &&
+           clusteredBits < entropyCostBits(all.counts) + CONTEXT_TABLE_BITS;
+}
+
+
+//
+// ContextDecoder
+// Decodes an order-1 block: one CanonicalDecoder per table and the context
+// map that picks the table for each symbol from the symbol before it.
+//
+class ContextDecoder {
+ public:
+    //
+    // lengths holds the code lengths of every table and contextMap the
+    // table of each of the NUM_CONTEXTS contexts.  Returns false if a table
+    // is not a valid prefix code or the map names a table that is not
+    // there.
+    //
+    bool build(const vector<vector<int> >& lengths,
+               const vector<unsigned char>& contextMap) {
+        if (contextMap.size() != NUM_CONTEXTS) {
+            return false;
+        }
+        tables.assign(lengths.size(), CanonicalDecoder());
+        for (size_t t = 0; t < lengths.size(); t++) {
+            if (!tables[t].build(lengths[t])) {
+                return false;
+            }
+        }
+        for (int c = 0; c < NUM_CONTEXTS; c++) {
+            if (contextMap[c] >= tables.size()) {
+                return false;
+            }
+            byContext[c] = contextMap[c];
+        }
+        return true;
+    }
+
+    //
+    // Decodes the length symbols of a block coded as streams byte-aligned
+    // streams (1 or SUBSTREAMS), one after another in payload
+    // (payloadLength bytes), where streamLengths holds the byte lengths of
+    // all but the last.  The streams are decoded in turn, a few symbols at a
+    // time, so the CPU can work on all of them at once.  Returns false if
+    // they do not decode to exactly length symbols.
+    //
+    bool decodeStreams(const unsigned char* payload, size_t payloadLength,
+                       int streams, const vector<uint32_t>& streamLengths,
+                       char* out, size_t length) const {
+        size_t bounds[SUBSTREAMS + 1] = {0, length};
+        if (streams > 1) {
+            subStreamBounds(length, bounds);
+        }
+        vector<BitReader> readers;
+        readers.reserve(streams);
+        size_t offset = 0;
+        for (int k = 0; k < streams; k++) {
+            size_t streamLength = k + 1 < streams ? streamLengths[k]
+                                                  : payloadLength - offset;
+            readers.push_back(BitReader(payload + offset, streamLength));
+            offset += streamLength;
+        }
+        int previous[SUBSTREAMS] = {0};
+        size_t done = 0;
+        const HuffmanDecodeTable* lookup[NUM_CONTEXTS];
+        bool useTables = (streams == SUBSTREAMS);
+        for (int c = 0; c < NUM_CONTEXTS && useTables; c++) {
+            lookup[c] = tables[byContext[c]].lookupTable();
+            useTables = (lookup[c] != nullptr);
+        }
+        if (useTables) {
+            int bad = 0;
+            done = HuffmanDecodeTable::decodeContextRounds(
+                lookup, readers.data(), out, bounds, previous, bad);
+            if (bad != 0) {
+                return false;
+            }
+        }
+        size_t longest = bounds[1] - bounds[0];
+        for (size_t i = done; i < longest; i++) {
+            for (int k = 0; k < streams; k++) {
+                if (bounds[k] + i >= bounds[k + 1]) {
+                    continue;
+                }
+                BitReader& reader = readers[k];
+                reader.refill();
+                int symbol =
+                    tables[byContext[previous[k]]].decodeSymbol(reader);
+                if (symbol == PSEUDO_EOF || symbol == NOT_A_CHAR ||
+                    reader.overrun()) {
+                    return false;
+                }
+                out[bounds[k] + i] = (char)symbol;
+                previous[k] = (unsigned char)symbol;
+            }
+        }
+        return true;
+    }
+
+ private:
+    vector<CanonicalDecoder> tables;
+    unsigned char byContext[NUM_CONTEXTS];
+};
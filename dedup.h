@@ -0,0 +1,421 @@
+//
+//  dedup.h
+//  File Compression II
+//
+//  Long-range deduplication ahead of the Huffman stage.  VM images and
+//  database dumps repeat megabytes at a time, often gigabytes apart, far
+//  beyond the reach of one block or of the LZ77 window (see lz77.h).
+//  Deduplicator cuts the input into chunks wherever a rolling gear hash of
+//  the last 64 bytes has its top DEDUP_AVERAGE_BITS bits clear
+//  (content-defined chunking), so the same content is cut the same way
+//  wherever it appears, whatever comes before it.  Every chunk is
+//  fingerprinted and looked up in a DedupIndex, and a chunk seen within the
+//  last window bytes is replaced by a reference to its earlier copy.  Runs
+//  of references become MODEL_DEDUP blocks (see container.h); everything
+//  else is compressed as usual.
+//
+//  Memory stays bounded by the window on both sides.  The deduplicator
+//  keeps the last window bytes in a DedupHistory and checks a candidate
+//  byte for byte before referring to it, so a fingerprint collision costs a
+//  missed duplicate, never a corrupt file.  A decoder reading a stream
+//  keeps the last window bytes it wrote to copy references from (one
+//  writing a file copies them within the file instead).  The index has one
+//  slot per 2^DEDUP_SLOT_BITS bytes of window, and a new chunk takes over
+//  the slot of whatever was there.
+//
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "container.h"
+
+using namespace std;
+
+const size_t DEDUP_MIN_CHUNK = 16 * 1024;
+const size_t DEDUP_MAX_CHUNK = 256 * 1024;
+// a cut after DEDUP_MIN_CHUNK bytes is 2^-DEDUP_AVERAGE_BITS likely at
+// every byte, so chunks average DEDUP_MIN_CHUNK + 64 KiB
+const int DEDUP_AVERAGE_BITS = 16;
+// the gear hash forgets a byte after this many more
+const size_t DEDUP_GEAR_SPAN = 64;
+const int DEDUP_SLOT_BITS = 12;
+const int DEFAULT_DEDUP_WINDOW_LOG = 27;  // 128 MiB
+
+//
+// *This struct is one reference: length bytes copied from distance bytes
+// before the first of them.  distance is never less than length.
+//
+struct DedupReference {
+    uint64_t distance;
+    uint32_t length;
+};
+
+
+//
+// *This function returns the 256 random values the gear hash adds per byte
+// (from a fixed splitmix64 sequence, so chunking never changes).
+//
+inline const uint64_t* _gearTable() {
+    struct Table {
+        uint64_t values[256];
+
+        Table() {
+            uint64_t state = 0;
+            for (int i = 0; i < 256; i++) {
+                uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                values[i] = z ^ (z >> 31);
+            }
+        }
+    };
+    static const Table table;
+    return table.values;
+}
+
+
+//
+// *This function returns a 64-bit fingerprint of the length bytes at data.
+//
+inline uint64_t _dedupFingerprint(const char* data, size_t length) {
+    uint64_t hash = length * 0x9e3779b97f4a7c15ULL;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+    for (; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    }
+    hash = (hash ^ (hash >> 29)) * 0xc4ceb9fe1a85ec53ULL;
+    return hash ^ (hash >> 32);
+}
+
+
+//
+// DedupHistory
+// The last 2^windowLog bytes of a stream, in a ring buffer that only grows
+// to its full size once that much has gone through it.  Bytes are named by
+// their offset from the start of the stream.
+//
+class DedupHistory {
+ public:
+    explicit DedupHistory(int windowLog)
+        : capacity(size_t(1) << windowLog), total(0) {
+    }
+
+    // bytes appended so far
+    uint64_t size() const {
+        return total;
+    }
+
+    // whether the length bytes at offset have been appended and are still
+    // held
+    bool holds(uint64_t offset, size_t length) const {
+        return offset + capacity >= total && offset + length <= total;
+    }
+
+    void append(const char* data, size_t length) {
+        if (length > capacity) {
+            data += length - capacity;
+            total += length - capacity;
+            length = capacity;
+        }
+        while (length > 0) {
+            size_t at = (size_t)(total & (capacity - 1));
+            size_t n = min(length, capacity - at);
+            if (at + n > bytes.size()) {
+                bytes.resize(min(capacity, max(at + n, 2 * bytes.size())));
+            }
+            memcpy(&bytes[at], data, n);
+            data += n;
+            length -= n;
+            total += n;
+        }
+    }
+
+    // copies the length bytes at offset, which must be held, to out
+    void copy(uint64_t offset, size_t length, char* out) const {
+        while (length > 0) {
+            size_t at = (size_t)(offset & (capacity - 1));
+            size_t n = min(length, capacity - at);
+            memcpy(out, &bytes[at], n);
+            out += n;
+            offset += n;
+            length -= n;
+        }
+    }
+
+    // whether the length bytes at offset, which must be held, are data
+    bool equals(uint64_t offset, const char* data, size_t length) const {
+        while (length > 0) {
+            size_t at = (size_t)(offset & (capacity - 1));
+            size_t n = min(length, capacity - at);
+            if (memcmp(data, &bytes[at], n) != 0) {
+                return false;
+            }
+            data += n;
+            offset += n;
+            length -= n;
+        }
+        return true;
+    }
+
+ private:
+    size_t capacity;
+    uint64_t total;
+    vector<char> bytes;
+};
+
+
+//
+// DedupIndex
+// Where the chunks seen last were, by fingerprint, in a fixed table of
+// slots.  A chunk goes in the slot its fingerprint picks, replacing the one
+// that was there.
+//
+class DedupIndex {
+ public:
+    struct Slot {
+        uint64_t fingerprint;
+        uint64_t offset;
+        uint32_t length;  // 0 for an empty slot
+    };
+
+    explicit DedupIndex(int windowLog) {
+        Slot empty = {0, 0, 0};
+        slots.assign(size_t(1) << max(windowLog - DEDUP_SLOT_BITS, 0), empty);
+    }
+
+    // the chunk last filed with this fingerprint, or null
+    const Slot* find(uint64_t fingerprint) const {
+        const Slot& slot = slots[fingerprint & (slots.size() - 1)];
+        return (slot.length != 0 && slot.fingerprint == fingerprint) ? &slot
+                                                                     : nullptr;
+    }
+
+    void insert(uint64_t fingerprint, uint64_t offset, uint32_t length) {
+        Slot slot = {fingerprint, offset, length};
+        slots[fingerprint & (slots.size() - 1)] = slot;
+    }
+
+ private:
+    vector<Slot> slots;
+};
+
+
+//
+// *This struct is one piece of deduplicated input, in input order: bytes
+// to compress, or (if literals is null) references that make up rawLength
+// bytes.  No piece is longer than the block size.
+//
+struct DedupPiece {
+    shared_ptr<vector<char> > literals;
+    vector<DedupReference> references;
+    size_t rawLength;
+};
+
+
+//
+// Deduplicator
+// Takes the input a block at a time and turns it into pieces.  The bytes
+// of the last, unfinished chunk are held back until it ends, so pieces
+// come out behind the input; finish() flushes them.
+//
+class Deduplicator {
+ public:
+    Deduplicator(int windowLog, size_t blockSize)
+        : history(windowLog), index(windowLog), blockSize(blockSize),
+          gearHash(0), referenceLength(0) {
+        chunk.reserve(DEDUP_MAX_CHUNK);
+    }
+
+    //
+    // Feeds the next length bytes of input, appending the pieces they
+    // complete to pieces.
+    //
+    void push(const char* data, size_t length, vector<DedupPiece>& pieces) {
+        while (length > 0) {
+            bool cut = false;
+            size_t n = scan((const unsigned char*)data, length, cut);
+            chunk.insert(chunk.end(), data, data + n);
+            data += n;
+            length -= n;
+            if (cut) {
+                endChunk(pieces);
+            }
+        }
+    }
+
+    // appends the pieces still held back at the end of the input
+    void finish(vector<DedupPiece>& pieces) {
+        if (!chunk.empty()) {
+            endChunk(pieces);
+        }
+        flushLiterals(pieces);
+        flushReferences(pieces);
+    }
+
+ private:
+    //
+    // Returns how many of the length bytes at data belong to the current
+    // chunk, and sets cut if it ends with them.  The hash only depends on
+    // the last DEDUP_GEAR_SPAN bytes, so it starts that far before the
+    // first place the chunk may end.
+    //
+    size_t scan(const unsigned char* data, size_t length, bool& cut) {
+        const uint64_t* gear = _gearTable();
+        size_t have = chunk.size();
+        size_t start = 0;
+        if (have < DEDUP_MIN_CHUNK - DEDUP_GEAR_SPAN) {
+            start = min(length, DEDUP_MIN_CHUNK - DEDUP_GEAR_SPAN - have);
+        }
+        uint64_t hash = gearHash;
+        for (size_t i = start; i < length; i++) {
+            hash = (hash << 1) + gear[data[i]];
+            size_t size = have + i + 1;
+            if (size >= DEDUP_MIN_CHUNK &&
+                ((hash >> (64 - DEDUP_AVERAGE_BITS)) == 0 ||
+                 size == DEDUP_MAX_CHUNK)) {
+                gearHash = 0;
+                cut = true;
+                return i + 1;
+            }
+        }
+        gearHash = hash;
+        return length;
+    }
+
+    void endChunk(vector<DedupPiece>& pieces) {
+        uint64_t position = history.size();
+        uint64_t fingerprint = _dedupFingerprint(chunk.data(), chunk.size());
+        const DedupIndex::Slot* seen = index.find(fingerprint);
+        if (seen != nullptr && seen->length == chunk.size() &&
+            history.holds(seen->offset, chunk.size()) &&
+            history.equals(seen->offset, chunk.data(), chunk.size())) {
+            flushLiterals(pieces);
+            addReference(position - seen->offset, chunk.size(), pieces);
+        } else {
+            flushReferences(pieces);
+            addLiterals(pieces);
+        }
+        index.insert(fingerprint, position, (uint32_t)chunk.size());
+        history.append(chunk.data(), chunk.size());
+        chunk.clear();
+    }
+
+    void addLiterals(vector<DedupPiece>& pieces) {
+        for (size_t i = 0; i < chunk.size(); ) {
+            if (!literals) {
+                literals = make_shared<vector<char> >();
+                literals->reserve(blockSize);
+            }
+            size_t n = min(chunk.size() - i, blockSize - literals->size());
+            literals->insert(literals->end(), chunk.begin() + i,
+                             chunk.begin() + i + n);
+            i += n;
+            if (literals->size() == blockSize) {
+                flushLiterals(pieces);
+            }
+        }
+    }
+
+    void addReference(uint64_t distance, size_t length,
+                      vector<DedupPiece>& pieces) {
+        while (length > 0) {
+            size_t n = min(length, blockSize - referenceLength);
+            if (!references.empty() && references.back().distance == distance) {
+                // the copy goes on where the last one ended
+                references.back().length += (uint32_t)n;
+            } else {
+                DedupReference reference = {distance, (uint32_t)n};
+                references.push_back(reference);
+            }
+            referenceLength += n;
+            length -= n;
+            if (referenceLength == blockSize) {
+                flushReferences(pieces);
+            }
+        }
+    }
+
+    void flushLiterals(vector<DedupPiece>& pieces) {
+        if (literals) {
+            DedupPiece piece;
+            piece.rawLength = literals->size();
+            piece.literals = literals;
+            pieces.push_back(piece);
+            literals.reset();
+        }
+    }
+
+    void flushReferences(vector<DedupPiece>& pieces) {
+        if (!references.empty()) {
+            DedupPiece piece;
+            piece.rawLength = referenceLength;
+            piece.references.swap(references);
+            pieces.push_back(piece);
+            referenceLength = 0;
+        }
+    }
+
+    DedupHistory history;
+    DedupIndex index;
+    size_t blockSize;
+    vector<char> chunk;       // the bytes of the unfinished chunk
+    uint64_t gearHash;
+    shared_ptr<vector<char> > literals;  // the piece being filled, if any
+    vector<DedupReference> references;   // or this one
+    size_t referenceLength;
+};
+
+
+//
+// *This function writes references as the payload of a MODEL_DEDUP block.
+//
+inline void writeReferences(ostream& out,
+                            const vector<DedupReference>& references) {
+    for (size_t i = 0; i < references.size(); i++) {
+        writeLittleEndian(out, references[i].distance, 8);
+        writeLittleEndian(out, references[i].length, 4);
+    }
+}
+
+
+//
+// *This function reads the payload (payloadLength bytes) of a MODEL_DEDUP
+// block into references.  Returns false unless they make up exactly
+// rawLength bytes, none is empty, and none reaches back further than
+// 2^windowLog bytes or into its own bytes.
+//
+inline bool readReferences(const char* payload, size_t payloadLength,
+                           uint32_t rawLength, int windowLog,
+                           vector<DedupReference>& references) {
+    references.clear();
+    uint64_t total = 0;
+    for (size_t at = 0; at + DEDUP_REFERENCE_SIZE <= payloadLength;
+         at += DEDUP_REFERENCE_SIZE) {
+        DedupReference reference = {0, 0};
+        for (int i = 0; i < 8; i++) {
+            reference.distance |=
+                uint64_t((unsigned char)payload[at + i]) << (8 * i);
+        }
+        for (int i = 0; i < 4; i++) {
+            reference.length |=
+                uint32_t((unsigned char)payload[at + 8 + i]) << (8 * i);
+        }
+        if (reference.length == 0 || reference.distance < reference.length ||
+            reference.distance > (uint64_t(1) << windowLog)) {
+            return false;
+        }
+        total += reference.length;
+        references.push_back(reference);
+    }
+    return total == rawLength;
+}
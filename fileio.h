@@ -0,0 +1,305 @@
+//
+//  fileio.h
+//  File Compression II
+//
+//  Thin wrappers over POSIX file descriptors for the paths that need
+//  positional I/O, where several threads read or write different parts of
+//  one file at the same time without sharing a file position, and for
+//  memory-mapped input and output, where the data is used in place
+//  instead of being copied through iostream buffers, and for copying bytes
+//  from one file to another inside the kernel.  Pipes and other files that
+//  cannot be mapped keep using the stream-based code.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+//
+// FileDescriptor
+// Owns an open file descriptor and closes it when destroyed.  Throws a
+// runtime_error if the file cannot be opened.
+//
+class FileDescriptor {
+ public:
+    FileDescriptor(const string& filename, int flags, mode_t mode = 0644)
+        : name(filename) {
+        fd = ::open(filename.c_str(), flags, mode);
+        if (fd < 0) {
+            throw runtime_error("CANNOT OPEN " + filename);
+        }
+    }
+
+    ~FileDescriptor() {
+        ::close(fd);
+    }
+
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    int get() const {
+        return fd;
+    }
+
+    //
+    // Reads exactly length bytes at offset, retrying short reads.
+    //
+    void readAt(char* buffer, size_t length, off_t offset) const {
+        while (length > 0) {
+            ssize_t n = ::pread(fd, buffer, length, offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                throw runtime_error("CANNOT READ " + name);
+            }
+            buffer += n;
+            length -= n;
+            offset += n;
+        }
+    }
+
+    //
+    // Writes exactly length bytes at offset, retrying short writes.
+    //
+    void writeAt(const char* buffer, size_t length, off_t offset) const {
+        while (length > 0) {
+            ssize_t n = ::pwrite(fd, buffer, length, offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                throw runtime_error("CANNOT WRITE " + name);
+            }
+            buffer += n;
+            length -= n;
+            offset += n;
+        }
+    }
+
+    //
+    // Sets the file size, so that positional writes can fill it in any
+    // order.
+    //
+    void resize(off_t length) const {
+        if (::ftruncate(fd, length) != 0) {
+            throw runtime_error("CANNOT WRITE " + name);
+        }
+    }
+
+ private:
+    int fd;
+    string name;
+};
+
+
+//
+// *This function copies length bytes at fromOffset in from to toOffset in
+// to.  On Linux the kernel copies them with copy_file_range, so they never
+// pass through this process (and a filesystem that shares extents may not
+// copy them at all); where that is not supported, such as between
+// filesystems on older kernels, they go through a buffer with positional
+// reads and writes.  Neither file's position is used, so threads can copy
+// into different parts of one file at once.  (sendfile would write at the
+// file position instead, which those threads share.)  Throws a
+// runtime_error if a file cannot be read or written.
+//
+inline void copyRange(const FileDescriptor& from, off_t fromOffset,
+                      const FileDescriptor& to, off_t toOffset,
+                      size_t length) {
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    while (length > 0) {
+        loff_t in = fromOffset;
+        loff_t out = toOffset;
+        ssize_t n = ::copy_file_range(from.get(), &in, to.get(), &out,
+                                      length, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // not supported here, or the end of the input, which the
+            // positional read below reports
+            break;
+        }
+        fromOffset += n;
+        toOffset += n;
+        length -= n;
+    }
+#endif
+    vector<char> buffer(min(length, (size_t)1 << 20));
+    while (length > 0) {
+        size_t n = min(length, buffer.size());
+        from.readAt(buffer.data(), n, fromOffset);
+        to.writeAt(buffer.data(), n, toOffset);
+        fromOffset += n;
+        toOffset += n;
+        length -= n;
+    }
+}
+
+
+//
+// *This function returns whether filename is a regular file, which is what
+// MappedFile needs.
+//
+inline bool isRegularFile(const string& filename) {
+    struct stat info;
+    return ::stat(filename.c_str(), &info) == 0 && S_ISREG(info.st_mode);
+}
+
+
+//
+// MappedFile
+// A regular file mapped read-only into memory.  The kernel is told the
+// mapping will be read front to back, so it reads ahead aggressively.
+// Throws a runtime_error if the file cannot be opened or mapped.
+//
+class MappedFile {
+ public:
+    explicit MappedFile(const string& filename)
+        : file(filename, O_RDONLY), begin(nullptr), length(0) {
+        struct stat info;
+        if (::fstat(file.get(), &info) != 0 || !S_ISREG(info.st_mode)) {
+            throw runtime_error("CANNOT MAP " + filename);
+        }
+        length = (size_t)info.st_size;
+        if (length == 0) {
+            return;
+        }
+        void* mapping = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE,
+                               file.get(), 0);
+        if (mapping == MAP_FAILED) {
+            throw runtime_error("CANNOT MAP " + filename);
+        }
+        begin = (const char*)mapping;
+        ::madvise(mapping, length, MADV_SEQUENTIAL);
+    }
+
+    ~MappedFile() {
+        if (begin != nullptr) {
+            ::munmap((void*)begin, length);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const {
+        return begin;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    // the open file, for copying parts of it with copyRange
+    const FileDescriptor& descriptor() const {
+        return file;
+    }
+
+ private:
+    FileDescriptor file;
+    const char* begin;
+    size_t length;
+};
+
+
+//
+// MappedOutput
+// An output file created at its final size up front (blocks reserved with
+// fallocate where available) and written through a shared mapping, so
+// workers can fill in their parts in any order.  If the blocks cannot be
+// reserved or the mapping cannot be made, at() returns null and write()
+// falls back to positional writes.  Throws a runtime_error if the disk has
+// no room for the file.
+//
+class MappedOutput {
+ public:
+    MappedOutput(const string& filename, size_t size)
+        : file(filename, O_RDWR | O_CREAT | O_TRUNC), begin(nullptr),
+          length(size) {
+        file.resize((off_t)length);
+        if (length == 0) {
+            return;
+        }
+#ifdef __linux__
+        // a mapping cannot report a full disk except as SIGBUS, so stop
+        // here; a file system without fallocate gets positional writes
+        int error = ::posix_fallocate(file.get(), 0, (off_t)length);
+        if (error == ENOSPC || error == EFBIG) {
+            throw runtime_error("CANNOT WRITE " + filename);
+        }
+        if (error == EOPNOTSUPP || error == EINVAL) {
+            return;
+        }
+#endif
+        void* mapping = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                               MAP_SHARED, file.get(), 0);
+        if (mapping != MAP_FAILED) {
+            begin = (char*)mapping;
+        }
+    }
+
+    ~MappedOutput() {
+        if (begin != nullptr) {
+            ::munmap(begin, length);
+        }
+    }
+
+    MappedOutput(const MappedOutput&) = delete;
+    MappedOutput& operator=(const MappedOutput&) = delete;
+
+    //
+    // Returns where the bytes at offset live in memory, or null if the
+    // file is not mapped.
+    //
+    char* at(size_t offset) const {
+        return begin != nullptr ? begin + offset : nullptr;
+    }
+
+    // reads back size bytes already written at offset
+    void read(char* data, size_t size, size_t offset) const {
+        if (begin != nullptr) {
+            memcpy(data, begin + offset, size);
+        } else {
+            file.readAt(data, size, (off_t)offset);
+        }
+    }
+
+    void write(const char* data, size_t size, size_t offset) const {
+        if (begin != nullptr) {
+            if (begin + offset != data) {
+                memcpy(begin + offset, data, size);
+            }
+        } else {
+            file.writeAt(data, size, (off_t)offset);
+        }
+    }
+
+    //
+    // Copies size bytes at fromOffset in from to offset with copyRange, so
+    // they go straight from one file to the other in the kernel.  The
+    // mapping, if any, shares the file's pages and sees them.
+    //
+    void copy(const FileDescriptor& from, size_t fromOffset, size_t size,
+              size_t offset) const {
+        copyRange(from, (off_t)fromOffset, file, (off_t)offset, size);
+    }
+
+ private:
+    FileDescriptor file;
+    char* begin;
+    size_t length;
+};
@@ -0,0 +1,427 @@
+//
+//  fse.h
+//  File Compression II
+//
+//  A table-driven asymmetric numeral system coder (tANS, as in FSE) for
+//  order-0 blocks, in place of a Huffman code.  A Huffman code gives every
+//  byte a whole number of bits, so a byte that makes up 90% of a block
+//  still costs a whole bit where it carries 0.15; an ANS coder keeps a
+//  state that carries the fractions of a bit from one byte to the next and
+//  comes within a fraction of a percent of the entropy.
+//
+//  The byte counts of a block (the same Histogram its Huffman code is built
+//  from) are scaled to normalized counts that add up to 2^tableLog
+//  (normalizeCounts), and each byte value gets that many of the table's
+//  states, spread evenly across it.  Decoding a byte is one lookup of the
+//  current state, which gives the byte, how many bits to read, and what to
+//  add them to for the next state; encoding does the same steps backwards,
+//  from the last byte to the first, so the encoder keeps each byte's bits
+//  and writes them out in order once it is done.  FSE_STATES states take
+//  turns over the bytes so that a decoder has that many independent
+//  lookups going at once, and every byte is the same lookup, shift and add
+//  whatever its value, without a branch.
+//
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <queue>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "bitstream.h"
+#include "hufftable.h"
+#include "container.h"
+
+using namespace std;
+
+// FseDecoder::decodeRounds keeps one local per state and reads a bit of
+// each per refill of 56 bits
+static_assert(FSE_STATES == 4, "FSE decoding unrolls four states");
+static_assert(FSE_STATES * FSE_MAX_TABLE_LOG <= 56,
+              "FSE decoding takes a round of states per refill");
+
+//
+// *This function returns the smallest table log worth trying for a block
+// with the given number of distinct byte values, which leaves every value
+// at least two states on average.
+//
+inline int fseMinTableLog(int distinct) {
+    return max(FSE_MIN_TABLE_LOG,
+               min(FSE_MAX_TABLE_LOG, _countBits((uint32_t)distinct) + 1));
+}
+
+
+//
+// *This function returns the largest table log worth trying for a block
+// of length bytes with the given number of distinct byte values: no more
+// states than a quarter of the block's bytes, since the counts of more
+// would cost more than they save.
+//
+inline int fseMaxTableLog(size_t length, int distinct) {
+    int tableLog = FSE_MAX_TABLE_LOG;
+    if (length > 1) {
+        tableLog = min(tableLog, _countBits((uint32_t)min(
+                                     length - 1, (size_t)1 << 30)) - 2);
+    }
+    return max(tableLog, fseMinTableLog(distinct));
+}
+
+
+//
+// *This function sets normalized (256 entries) to the counts of the 256
+// byte values scaled to add up to 2^tableLog, every value that occurs
+// getting at least 1.  Each count starts at its share rounded down, and the
+// states left over go one at a time to whichever value saves the most bits
+// by one more (or those missing, after raising counts to 1, are taken from
+// whichever loses the fewest), which minimizes the coded size for the
+// table.
+//
+inline void normalizeCounts(const uint64_t* counts, int tableLog,
+                            vector<int>& normalized) {
+    uint64_t total = 0;
+    for (int s = 0; s < 256; s++) {
+        total += counts[s];
+    }
+    normalized.assign(256, 0);
+    if (total == 0) {
+        return;
+    }
+    int64_t tableSize = (int64_t)1 << tableLog;
+    int64_t sum = 0;
+    for (int s = 0; s < 256; s++) {
+        if (counts[s] > 0) {
+            normalized[s] = (int)max<uint64_t>(
+                1, (uint64_t)((double)counts[s] * tableSize / total));
+            sum += normalized[s];
+        }
+    }
+
+    // bits saved by one more state for s (or, negative, lost by one fewer)
+    auto gain = [&](int s, int delta) {
+        double from = normalized[s];
+        return (double)counts[s] * log2((from + delta) / from);
+    };
+    typedef pair<double, int> Choice;
+    if (sum < tableSize) {
+        priority_queue<Choice> best;
+        for (int s = 0; s < 256; s++) {
+            if (counts[s] > 0) {
+                best.push(Choice(gain(s, 1), s));
+            }
+        }
+        for (; sum < tableSize; sum++) {
+            int s = best.top().second;
+            best.pop();
+            normalized[s]++;
+            best.push(Choice(gain(s, 1), s));
+        }
+    } else if (sum > tableSize) {
+        // the top is the one that loses the least
+        priority_queue<Choice> best;
+        for (int s = 0; s < 256; s++) {
+            if (normalized[s] > 1) {
+                best.push(Choice(gain(s, -1), s));
+            }
+        }
+        for (; sum > tableSize; sum--) {
+            int s = best.top().second;
+            best.pop();
+            normalized[s]--;
+            if (normalized[s] > 1) {
+                best.push(Choice(gain(s, -1), s));
+            }
+        }
+    }
+}
+
+
+//
+// *This function returns the bits the bytes counted in counts take with
+// the given normalized counts, not counting the starting states: each
+// byte costs log2(2^tableLog / its count), which an ANS coder matches to
+// within a fraction of a percent.  Returns HUGE_VAL if a byte that occurs
+// has no states.
+//
+inline double fseCostBits(const uint64_t* counts,
+                          const vector<int>& normalized, int tableLog) {
+    double bits = 0;
+    for (int s = 0; s < 256; s++) {
+        if (counts[s] == 0) {
+            continue;
+        }
+        if (normalized[s] == 0) {
+            return HUGE_VAL;
+        }
+        bits += (double)counts[s] * (tableLog - log2((double)normalized[s]));
+    }
+    return bits;
+}
+
+
+//
+// *This function sets spread (2^tableLog entries) to the byte value of
+// every state, each value taking as many states as its normalized count.
+// The step is odd, so stepping through the table visits every state once,
+// and large enough to scatter each value's states across it.
+//
+inline void _fseSpread(const vector<int>& normalized, int tableLog,
+                       vector<unsigned char>& spread) {
+    uint32_t tableSize = 1u << tableLog;
+    uint32_t mask = tableSize - 1;
+    uint32_t step = (tableSize >> 1) + (tableSize >> 3) + 3;
+    spread.resize(tableSize);
+    uint32_t position = 0;
+    for (int s = 0; s < 256; s++) {
+        for (int i = 0; i < normalized[s]; i++) {
+            spread[position] = (unsigned char)s;
+            position = (position + step) & mask;
+        }
+    }
+}
+
+
+//
+// FseEncoder
+// The encoding tables for one set of normalized counts.  States run from
+// 2^tableLog to 2^(tableLog + 1) - 1 here, and are that much less in the
+// decoder.
+//
+class FseEncoder {
+ public:
+    FseEncoder() : tableLog(0) {
+    }
+
+    //
+    // Builds the tables for normalized counts that add up to 2^tableLog.
+    //
+    void build(const vector<int>& normalized, int normalizedLog) {
+        tableLog = normalizedLog;
+        uint32_t tableSize = 1u << tableLog;
+        vector<unsigned char> spread;
+        _fseSpread(normalized, tableLog, spread);
+
+        // the states of each value, in table order, after those of the
+        // values before it
+        uint32_t cumulative[257];
+        cumulative[0] = 0;
+        for (int s = 0; s < 256; s++) {
+            cumulative[s + 1] = cumulative[s] + normalized[s];
+        }
+        nextStates.resize(tableSize);
+        uint32_t position[256];
+        memcpy(position, cumulative, sizeof(position));
+        for (uint32_t u = 0; u < tableSize; u++) {
+            nextStates[position[spread[u]]++] = (uint16_t)(tableSize + u);
+        }
+
+        // a state x codes byte s by writing its low bits until what is left
+        // is within s's count, then moving to that state of s; the number
+        // of bits is (x + deltaBits) >> 16
+        for (int s = 0; s < 256; s++) {
+            Transform& t = transforms[s];
+            int count = normalized[s];
+            if (count == 0) {
+                t.deltaBits = 0;
+                t.deltaState = 0;
+                continue;
+            }
+            int maxBits = tableLog - (_countBits((uint32_t)count - 1) - 1);
+            if (count == 1) {
+                maxBits = tableLog;
+            }
+            uint32_t minState = (uint32_t)count << maxBits;
+            t.deltaBits = ((uint32_t)maxBits << 16) - minState;
+            t.deltaState = (int32_t)cumulative[s] - count;
+        }
+    }
+
+    //
+    // Runs the states over the length bytes of data, last to first, which
+    // leaves the bits byte i takes in steps[i] (the bits, then their
+    // number from bit 16 up) and the states the decoder starts in, less
+    // 2^tableLog, in states (FSE_STATES of them).  Returns the bits of the
+    // payload this makes.
+    //
+    uint64_t encode(const unsigned char* data, size_t length,
+                    vector<uint32_t>& steps, uint32_t* states) const {
+        uint32_t tableSize = 1u << tableLog;
+        uint32_t state[FSE_STATES];
+        for (int k = 0; k < FSE_STATES; k++) {
+            state[k] = tableSize;
+        }
+        steps.resize(length);
+        uint64_t bits = (uint64_t)FSE_STATES * tableLog;
+        const uint16_t* next = nextStates.data();
+        for (size_t i = length; i-- > 0; ) {
+            uint32_t& x = state[i % FSE_STATES];
+            const Transform& t = transforms[data[i]];
+            uint32_t nBits = (x + t.deltaBits) >> 16;
+            steps[i] = (x & ((1u << nBits) - 1)) | (nBits << 16);
+            bits += nBits;
+            x = next[(x >> nBits) + t.deltaState];
+        }
+        for (int k = 0; k < FSE_STATES; k++) {
+            states[k] = state[k] - tableSize;
+        }
+        return bits;
+    }
+
+    //
+    // Writes the starting states and then the steps left by encode, in
+    // the order the decoder reads them, to output.  If bits is not null,
+    // they are also appended to it as '0' and '1' characters.
+    //
+    void write(const vector<uint32_t>& steps, const uint32_t* states,
+               obitstream& output, string* bits) const {
+        for (int k = 0; k < FSE_STATES; k++) {
+            output.writeBits(states[k], tableLog);
+            _appendBits(states[k], tableLog, bits);
+        }
+        for (size_t i = 0; i < steps.size(); i++) {
+            int nBits = steps[i] >> 16;
+            output.writeBits(steps[i] & 0xffff, nBits);
+            _appendBits(steps[i] & 0xffff, nBits, bits);
+        }
+    }
+
+ private:
+    struct Transform {
+        uint32_t deltaBits;
+        int32_t deltaState;
+    };
+
+    static void _appendBits(uint32_t value, int nBits, string* bits) {
+        if (bits != nullptr) {
+            for (int bit = 0; bit < nBits; bit++) {
+                *bits += ((value >> bit) & 1) ? '1' : '0';
+            }
+        }
+    }
+
+    int tableLog;
+    Transform transforms[256];
+    vector<uint16_t> nextStates;  // indexed by count position, then state
+};
+
+
+//
+// FseDecoder
+// Decodes the payload of an FSE block with one lookup table of 2^tableLog
+// states.
+//
+class FseDecoder {
+ public:
+    FseDecoder() : tableLog(0) {
+    }
+
+    //
+    // Builds the table for normalized counts that add up to 2^tableLog (as
+    // readBlockHeader checks).
+    //
+    void build(const vector<int>& normalized, int normalizedLog) {
+        tableLog = normalizedLog;
+        uint32_t tableSize = 1u << tableLog;
+        vector<unsigned char> spread;
+        _fseSpread(normalized, tableLog, spread);
+        uint32_t next[256];
+        for (int s = 0; s < 256; s++) {
+            next[s] = (uint32_t)normalized[s];
+        }
+        // the i-th state of a value (in table order) is where the encoder
+        // leaves state count + i of it: read enough bits to get back
+        // within the table, above what is left
+        table.resize(tableSize);
+        for (uint32_t u = 0; u < tableSize; u++) {
+            Entry& e = table[u];
+            uint32_t x = next[spread[u]]++;
+            e.symbol = spread[u];
+            e.bits = (unsigned char)(tableLog - (_countBits(x) - 1));
+            e.base = (uint16_t)((x << e.bits) - tableSize);
+        }
+    }
+
+    //
+    // Decodes payload (payloadLength bytes) into the length bytes at out.
+    // Every state of the table leads to another, so the only thing that
+    // can go wrong is running out of payload; returns false if it did.
+    //
+    bool decode(const unsigned char* payload, size_t payloadLength,
+                char* out, size_t length) const {
+        BitReader reader(payload, payloadLength);
+        uint32_t state[FSE_STATES];
+        reader.refill();
+        for (int k = 0; k < FSE_STATES; k++) {
+            state[k] = reader.peek(tableLog);
+            reader.consume(tableLog);
+        }
+        size_t n = decodeRounds(reader, state, out, length);
+        for (; n < length; n++) {
+            reader.refill();
+            uint32_t& x = state[n % FSE_STATES];
+            const Entry& e = table[x];
+            out[n] = (char)e.symbol;
+            x = e.base + reader.peek(e.bits);
+            reader.consume(e.bits);
+        }
+        return !reader.overrun();
+    }
+
+ private:
+    struct Entry {
+        uint16_t base;         // added to the bits read for the next state
+        unsigned char symbol;
+        unsigned char bits;
+    };
+
+    //
+    // Decodes FSE_STATES bytes per refill for as long as the payload has
+    // 8 bytes left to load at once, and returns how many bytes that made.
+    // The reader's state is kept in locals for the loop (stores to out
+    // could alias the reader, which would keep it out of registers) and
+    // written back at the end.
+    //
+    size_t decodeRounds(BitReader& reader, uint32_t* state, char* out,
+                        size_t length) const {
+        size_t n = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        const Entry* entries = table.data();
+        uint64_t buf = reader.bitBuf;
+        int count = reader.bitCount;
+        const unsigned char* next = reader.next;
+        const unsigned char* end = reader.end;
+        uint32_t x0 = state[0], x1 = state[1], x2 = state[2], x3 = state[3];
+        auto step = [entries](uint32_t& x, uint64_t& buf, int& count) {
+            const Entry e = entries[x];
+            x = e.base + (uint32_t)(buf & ((1u << e.bits) - 1));
+            buf >>= e.bits;
+            count -= e.bits;
+            return e.symbol;
+        };
+        while (n + FSE_STATES <= length && end - next >= 8) {
+            uint64_t word;
+            memcpy(&word, next, sizeof(word));
+            buf |= word << count;
+            next += (63 - count) >> 3;
+            count |= 56;
+            out[n] = (char)step(x0, buf, count);
+            out[n + 1] = (char)step(x1, buf, count);
+            out[n + 2] = (char)step(x2, buf, count);
+            out[n + 3] = (char)step(x3, buf, count);
+            n += FSE_STATES;
+        }
+        state[0] = x0;
+        state[1] = x1;
+        state[2] = x2;
+        state[3] = x3;
+        reader.bitBuf = buf;
+        reader.bitCount = count;
+        reader.next = next;
+#endif
+        return n;
+    }
+
+    int tableLog;
+    vector<Entry> table;
+};
@@ -3,135 +3,159 @@
 
 #include "hashmap.h"
 #include <vector>
+#include <stdexcept>
 using namespace std;
 
+const int hashmap::EMPTY;
+const int hashmap::MIN_SLOTS;
+
 //
-// This constructor chooses number of buckets, initializes size of map to 0, and
-// creates a bucket array with nBuckets number of pointers to linked lists.
+// This constructor creates an empty map with a small index table.
 //
 hashmap::hashmap() {
-    this->nBuckets=10;
-    this->nElems=0;
-    this->buckets=createBucketArray(nBuckets);
+    slots.assign(MIN_SLOTS, EMPTY);
+}
+
+//
+// The entries and the index are vectors, so they free themselves.
+//
+hashmap::~hashmap() {
 }
 
 //
-// Given a number of buckets, creates a hashtable (array of linked list heads).
-// @param nBuckets the number of buckets you want in the hashtable.
-// return an array of heads of linked lists of key_val_pairs
+// This method returns the slot holding key, or the empty slot where key
+// would go.  The index is never full, so the probe always stops.
 //
-hashmap::bucketArray hashmap::createBucketArray(int nBuckets) {
-    
-    bucketArray newBuckets = new key_val_pair*[nBuckets];
-    for (int i = 0; i < nBuckets; i++) {
-        newBuckets[i] = nullptr;
+int hashmap::findSlot(int key) const {
+    int mask = (int)slots.size() - 1;
+    int slot = hashFunction(key) & mask;
+    while (slots[slot] != EMPTY && entries[slots[slot]].key != key) {
+        slot = (slot + 1) & mask;
     }
-    return newBuckets;
+    return slot;
 }
 
 //
-// This destructor frees memory for all elements of buckets & also all elements
-// of linked lists that those bucket pointers may point to.
+// This method rebuilds the index with nSlots slots (a power of two).
 //
-hashmap::~hashmap() {
-    for (int i=0; i < nBuckets; i++){
-        key_val_pair *front =  buckets[i];
-        while (front != nullptr) {
-            key_val_pair *temp = front->next;
-            delete front;
-            front = temp;
-        }
+void hashmap::rehash(int nSlots) {
+    slots.assign(nSlots, EMPTY);
+    for (size_t i = 0; i < entries.size(); i++) {
+        slots[findSlot(entries[i].key)] = (int)i;
+    }
+}
+
+//
+// This method makes room for n keys, so that putting them does not have to
+// grow the index more than once.
+//
+void hashmap::reserve(int n) {
+    int nSlots = (int)slots.size();
+    while (nSlots < 2 * n) {
+        nSlots *= 2;
+    }
+    entries.reserve(n);
+    if (nSlots != (int)slots.size()) {
+        rehash(nSlots);
     }
-    delete[] buckets;
-    
 }
 
 //
-// This method puts key/value pair in the map.  It checks to see if key is
-// already in map while traversing the list to find the end of it.
+// This method puts key/value pair in the map, replacing the value if key is
+// already in the map.  The index doubles whenever it would become more than
+// half full.
 //
 void hashmap::put(int key, int value) {
-    int b = hashFunction(key)%nBuckets;
-    if(buckets[b] == nullptr){
-        key_val_pair* node = new key_val_pair();
-        node->key = key;
-        node->value = value;
-        node->next = nullptr;
-        buckets[b] = node;
-        nElems++;
+    int slot = findSlot(key);
+    if (slots[slot] != EMPTY) {
+        entries[slots[slot]].value = value;
         return;
     }
-    key_val_pair* curr = buckets[b];
-    key_val_pair* prev = curr;
-
-    while(curr != nullptr){
-        if(curr->key == key){
-            curr->value = value;
-            return;
-        }
-        prev = curr;
-        curr=curr->next;
+    if (2 * (entries.size() + 1) > slots.size()) {
+        rehash(2 * (int)slots.size());
+        slot = findSlot(key);
     }
-    
-    key_val_pair* node = new key_val_pair();
-    node->key = key;
-    node->value = value;
-    node->next = nullptr;
-    prev->next = node;
-    nElems++;
+    entry e = {key, value};
+    slots[slot] = (int)entries.size();
+    entries.push_back(e);
 }
 
 //
 // This method returns the value associated with key.
 //
 int hashmap::get(int key) const {
-    int b = hashFunction(key)%nBuckets;
-
-    key_val_pair* curr = buckets[b];
-    
-    while(curr != nullptr){
-        if(curr->key == key){
-            return curr->value;
-        }
-        curr = curr->next;
+    int slot = findSlot(key);
+    if (slots[slot] == EMPTY) {
+        throw runtime_error("NOT IN MAP");
     }
-    throw runtime_error("NOT IN MAP");
+    return entries[slots[slot]].value;
 }
 
 //
 // This function checks if the key is already in the map.
 //
-bool hashmap::containsKey(int key) {
-    int b = hashFunction(key)%nBuckets;
+bool hashmap::containsKey(int key) const {
+    return slots[findSlot(key)] != EMPTY;
+}
 
-    key_val_pair* curr = buckets[b];
+//
+// This method removes key from the map and returns whether it was there.
+// The last entry moves into the gap, and the keys probed past the freed slot
+// are shifted back so that no probe ever stops short of its key.
+//
+bool hashmap::erase(int key) {
+    int slot = findSlot(key);
+    int index = slots[slot];
+    if (index == EMPTY) {
+        return false;
+    }
 
-    while(curr != nullptr){
-        if(curr->key == key){
-            return true;
+    int mask = (int)slots.size() - 1;
+    int hole = slot;
+    for (int next = (hole + 1) & mask; slots[next] != EMPTY;
+         next = (next + 1) & mask) {
+        int home = hashFunction(entries[slots[next]].key) & mask;
+        // move next into the hole unless its home lies after the hole
+        // (cyclically), in which case it is still reachable
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            slots[hole] = slots[next];
+            hole = next;
         }
-        curr = curr->next;
     }
-  
-    return false;
+    slots[hole] = EMPTY;
+
+    int last = (int)entries.size() - 1;
+    if (index != last) {
+        entries[index] = entries[last];
+        slots[findSlot(entries[index].key)] = index;
+    }
+    entries.pop_back();
+    return true;
 }
 
 //
-// This method goes through all buckets and adds all keys to a vector.
+// This method returns all keys in insertion order.
 //
 vector<int> hashmap::keys() const {
     vector<int> allKeys;
-    
-    for(int i=0;i<nBuckets;i++){
-        key_val_pair* curr = buckets[i];
-        while(curr != nullptr){
-            allKeys.push_back(curr->key);
-            curr=curr->next;
-            
-        }
+    allKeys.reserve(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        allKeys.push_back(entries[i].key);
     }
+    return allKeys;
+}
+
+//
+// These methods let a range-based for loop visit every entry (key and
+// value) in insertion order without allocating.  Putting a new key or
+// erasing one invalidates them.
+//
+hashmap::iterator hashmap::begin() const {
+    return entries.data();
+}
 
-  return allKeys;
+hashmap::iterator hashmap::end() const {
+    return entries.data() + entries.size();
 }
 
 //
@@ -161,60 +185,26 @@ int hashmap::hashFunction(int input) const {
 //
 // This function returns the number of elements in the hashmap.
 //
-int hashmap::size() {
-    return nElems;
+int hashmap::size() const {
+    return (int)entries.size();
 }
 
 //
 // Copy constructor
 //
-hashmap::hashmap(const hashmap &myMap) {
-    // make a deep copy of the map
-    nBuckets = myMap.nBuckets;
-
-    buckets = createBucketArray(nBuckets);
-
-    // walk through the old array and add all elements to this one
-    vector<int> keys = myMap.keys();
-    for (size_t i=0; i < keys.size(); i++) {
-        int key = keys[i];
-        int value = myMap.get(key);
-        put(key,value);
-    }
-
+hashmap::hashmap(const hashmap &myMap)
+    : entries(myMap.entries), slots(myMap.slots) {
 }
 
 //
 // Equals operator.
 //
 hashmap& hashmap::operator= (const hashmap &myMap) {
-    // make a deep copy of the map
-
     // watch for self-assignment
-    if (this == &myMap) {
-        return *this;
+    if (this != &myMap) {
+        entries = myMap.entries;
+        slots = myMap.slots;
     }
-
-    // if data exists in the map, delete it
-    for (int i=0; i < nBuckets; i++) {
-        hashmap::key_val_pair* bucket = buckets[i];
-        while (bucket != nullptr) {
-            // walk the linked list and delete each node
-            hashmap::key_val_pair* temp = bucket;
-            bucket = bucket->next;
-            delete temp;
-        }
-        buckets[i] = nullptr;
-    }
-    nElems = 0;
-    // walk through the old array and add all elements to this one
-    vector<int> keys = myMap.keys();
-    for (size_t i=0; i < keys.size(); i++) {
-        int key = keys[i];
-        int value = myMap.get(key);
-        put(key,value);
-    }
-
     // return the existing object so we can chain this operator
     return *this;
 }
@@ -225,14 +215,11 @@ hashmap& hashmap::operator= (const hashmap &myMap) {
 //
 ostream &operator<<(ostream &out, hashmap &myMap) {
     out << "{";
-    vector<int> keys = myMap.keys();
-    for (size_t i=0; i < keys.size(); i++) {
-        int key = keys[i];
-        int value = myMap.get(key);
-        out << key << ":" << value;
-        if (i < keys.size() - 1) { // no commas after the last one
+    for (hashmap::iterator it = myMap.begin(); it != myMap.end(); ++it) {
+        if (it != myMap.begin()) { // no commas after the last one
             out << ", ";
         }
+        out << it->key << ":" << it->value;
     }
     out << "}";
     return out;
@@ -6,17 +6,36 @@
 
 using namespace std;
 
+//
+// hashmap
+// Maps int keys to int values.  Entries live in one dense array in the order
+// they were first put, and an open-addressing index (linear probing over a
+// power-of-two table, kept at most half full) maps each key to its entry.
+// Iterating walks the dense array, so it allocates nothing, and keys() comes
+// out in insertion order, which is the order << writes and >> reads back.
+//
 class hashmap
 {
 public:
+    struct entry {
+        int key;
+        int value;
+    };
+    typedef const entry* iterator;
+
     hashmap();
     ~hashmap();
 
     int get(int key) const;
     void put(int key, int value);
-    bool containsKey(int key);
+    bool containsKey(int key) const;
+    bool erase(int key);
+    void reserve(int n);
     vector<int> keys() const;
-    int size();
+    int size() const;
+
+    iterator begin() const;
+    iterator end() const;
 
     void sanityCheck();
     hashmap(const hashmap &myMap); // copy constructor
@@ -28,19 +47,13 @@ public:
     // streams/files.
     friend istream &operator>>(istream &in, hashmap &myMap);
 private:
-    struct key_val_pair {
-        int key;
-        int value;
-        key_val_pair* next;
-    };
+    static const int EMPTY = -1;
+    static const int MIN_SLOTS = 16;
 
-    typedef key_val_pair** bucketArray; 
-
-    bucketArray createBucketArray(int nBuckets);
     int hashFunction(int input) const;
+    int findSlot(int key) const;
+    void rehash(int nSlots);
 
-    bucketArray buckets;
-
-    int nBuckets;
-    int nElems;
+    vector<entry> entries;  // in insertion order (erase moves the last one)
+    vector<int> slots;      // index into entries, or EMPTY
 };
@@ -0,0 +1,110 @@
+//
+//  histogram.h
+//  File Compression II
+//
+//  Byte counting for the frequency map.  Counting goes into flat arrays
+//  instead of the hashmap: four interleaved 256-entry tables take turns so
+//  that runs of the same byte do not make every increment wait on the store
+//  of the previous one, and the tables are merged into 64-bit totals at the
+//  end of each span.
+//
+
+#pragma once
+
+#include <istream>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include "container.h"
+
+using namespace std;
+
+struct Histogram {
+    uint64_t counts[NUM_SYMBOLS];  // indexed by symbolIndex
+
+    Histogram() {
+        clear();
+    }
+
+    void clear() {
+        memset(counts, 0, sizeof(counts));
+    }
+
+    //
+    // Returns the number of input bytes counted (PSEUDO_EOF excluded).
+    //
+    uint64_t total() const {
+        uint64_t sum = 0;
+        for (int i = 0; i < 256; i++) {
+            sum += counts[i];
+        }
+        return sum;
+    }
+};
+
+
+//
+// *This function adds the bytes of data to the histogram.
+//
+inline void countBytes(const unsigned char* data, size_t length,
+                       Histogram& histogram) {
+    // 32-bit counters cannot overflow within one segment
+    const size_t SEGMENT_SIZE = size_t(1) << 30;
+    uint32_t tables[4][256];
+
+    while (length > 0) {
+        size_t n = min(length, SEGMENT_SIZE);
+        const unsigned char* p = data;
+        const unsigned char* end = data + n;
+        memset(tables, 0, sizeof(tables));
+
+        // two 8-byte loads per pass; which table a byte lands in does not
+        // matter, so host byte order does not either
+        while (end - p >= 16) {
+            uint64_t a, b;
+            memcpy(&a, p, 8);
+            memcpy(&b, p + 8, 8);
+            tables[0][a & 0xff]++;
+            tables[1][(a >> 8) & 0xff]++;
+            tables[2][(a >> 16) & 0xff]++;
+            tables[3][(a >> 24) & 0xff]++;
+            tables[0][(a >> 32) & 0xff]++;
+            tables[1][(a >> 40) & 0xff]++;
+            tables[2][(a >> 48) & 0xff]++;
+            tables[3][a >> 56]++;
+            tables[0][b & 0xff]++;
+            tables[1][(b >> 8) & 0xff]++;
+            tables[2][(b >> 16) & 0xff]++;
+            tables[3][(b >> 24) & 0xff]++;
+            tables[0][(b >> 32) & 0xff]++;
+            tables[1][(b >> 40) & 0xff]++;
+            tables[2][(b >> 48) & 0xff]++;
+            tables[3][b >> 56]++;
+            p += 16;
+        }
+        while (p < end) {
+            tables[0][*p++]++;
+        }
+
+        for (int i = 0; i < 256; i++) {
+            histogram.counts[i] += uint64_t(tables[0][i]) + tables[1][i] +
+                                   tables[2][i] + tables[3][i];
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+
+//
+// *This function adds every byte left in the input stream to the histogram,
+// reading it in large blocks.
+//
+inline void countStream(istream& input, Histogram& histogram) {
+    const size_t BLOCK_SIZE = 1 << 20;
+    vector<unsigned char> block(BLOCK_SIZE);
+    while (input.read((char*)block.data(), block.size()) ||
+           input.gcount() > 0) {
+        countBytes(block.data(), (size_t)input.gcount(), histogram);
+    }
+}
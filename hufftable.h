@@ -0,0 +1,823 @@
+//
+//  hufftable.h
+//  File Compression II
+//
+//  Table-driven Huffman decoding.  Instead of following the zero/one
+//  pointers of the encoding tree once per input bit, the decoder peeks
+//  PRIMARY_BITS bits at a time and resolves a whole symbol (and its code
+//  length) with a single table load.  Codes longer than PRIMARY_BITS go
+//  through one secondary table indexed by the bits that follow.
+//
+//  Bits are consumed in the same order ibitstream::readBit returns them:
+//  the first bit of the stream is bit 0 of the first byte.  A code is
+//  therefore stored "stream order", with its first bit in bit 0.
+//
+//  Compressed files use canonical codes, which are rebuilt from the code
+//  lengths alone; CanonicalDecoder wraps the table for them and falls back
+//  to decoding bit by bit when a code is too long for the table.
+//
+//  One stream of codes is a chain: where a code starts depends on the
+//  length of the one before, so its symbols decode one after another.  A
+//  block split into SUBSTREAMS streams (see container.h) is decoded by
+//  HuffmanDecodeTable::decodeStreams with one BitReader per stream in the
+//  same loop, so the CPU works on four independent chains at once.
+//
+//  Encoding goes the other way through HuffmanEncodeTable, a flat array
+//  holding each symbol's code as one word, so that encoding a byte is a
+//  single load and one obitstream::writeBits call.
+//
+
+#pragma once
+
+#include <istream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include "bitstream.h"
+
+using namespace std;
+
+const int NUM_SYMBOLS = 257;  // every byte value plus PSEUDO_EOF
+// the largest alphabet a code is built for (literals and match lengths; see
+// lz77.h)
+const int MAX_ALPHABET = 288;
+
+//
+// *This function maps a character as stored in the frequency map (a signed
+// char, or PSEUDO_EOF) to its index in a code length table.
+//
+inline int symbolIndex(int character) {
+    return character == PSEUDO_EOF ? 256 : (unsigned char)character;
+}
+
+
+//
+// *This function is the inverse of symbolIndex.
+//
+inline int indexCharacter(int index) {
+    return index == 256 ? PSEUDO_EOF : (int)(char)index;
+}
+
+
+const int SUBSTREAMS = 4;
+
+//
+// *This function sets bounds[0] to bounds[streams] to where each sub-stream
+// of a block of length symbols starts, and where the last ends: every
+// stream but the last gets length / streams rounded up.
+//
+inline void subStreamBounds(size_t length, size_t* bounds,
+                            int streams = SUBSTREAMS) {
+    size_t share = (length + streams - 1) / streams;
+    for (int k = 0; k <= streams; k++) {
+        bounds[k] = min(length, k * share);
+    }
+}
+
+
+
+//
+// BitReader
+// Reads bits LSB-first from a byte span, refilling the span from an istream
+// in large chunks when one is attached.  peek() may look up to 32 bits
+// ahead; past the end of input it pads with zero bits, and overrun()
+// reports whether more bits were consumed than the input held.
+//
+class BitReader {
+ public:
+    static const size_t CHUNK_SIZE = 1 << 16;
+
+    explicit BitReader(istream& input)
+        : in(&input), chunk(CHUNK_SIZE), next(nullptr), end(nullptr),
+          bitBuf(0), bitCount(0), padBits(0), overran(false) {
+    }
+
+    BitReader(const unsigned char* data, size_t length)
+        : in(nullptr), next(data), end(data + length),
+          bitBuf(0), bitCount(0), padBits(0), overran(false) {
+    }
+
+    //
+    // Tops the bit buffer up to at least 57 bits, padding with zeros once
+    // the input runs out.
+    //
+    void refill() {
+        while (bitCount <= 56) {
+            if (next == end && !fillChunk()) {
+                padBits += 64 - bitCount;
+                bitCount = 64;
+                break;
+            }
+            bitBuf |= (uint64_t)(*next++) << bitCount;
+            bitCount += 8;
+        }
+    }
+
+    uint32_t peek(int nBits) const {
+        return (uint32_t)(bitBuf & ((((uint64_t)1) << nBits) - 1));
+    }
+
+    void consume(int nBits) {
+        bitBuf >>= nBits;
+        bitCount -= nBits;
+        if (bitCount < padBits) {
+            padBits = bitCount;
+            overran = true;
+        }
+    }
+
+    bool overrun() const {
+        return overran;
+    }
+
+ private:
+    // decode with the buffer in locals
+    friend class HuffmanDecodeTable;
+    friend class FseDecoder;
+
+    bool fillChunk() {
+        if (in == nullptr) {
+            return false;
+        }
+        in->read((char*)chunk.data(), chunk.size());
+        streamsize got = in->gcount();
+        if (got <= 0) {
+            return false;
+        }
+        next = chunk.data();
+        end = next + got;
+        return true;
+    }
+
+    istream* in;
+    vector<unsigned char> chunk;
+    const unsigned char* next;
+    const unsigned char* end;
+    uint64_t bitBuf;
+    int bitCount;
+    int padBits;  // how many of the buffered bits are zero padding
+    bool overran;
+};
+
+
+//
+// *This function reverses the low nBits bits of code, converting between the
+// usual most-significant-bit-first form of a code and stream order.
+//
+inline uint64_t reverseBits(uint64_t code, int nBits) {
+    uint64_t reversed = 0;
+    for (int i = 0; i < nBits; i++) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    return reversed;
+}
+
+
+//
+// *This function assigns canonical Huffman codes to a list of code lengths,
+// where a length of 0 marks an unused symbol.  Shorter codes come first and
+// codes of the same length are ordered by symbol, so the lengths alone are
+// enough to rebuild the code.  Codes are returned in stream order.  Returns
+// false if the lengths oversubscribe the code space or exceed 63 bits.
+//
+inline bool canonicalCodes(const vector<int>& lengths,
+                           vector<uint64_t>& codes) {
+    const int MAX_LENGTH = 63;
+    vector<uint64_t> lengthCount(MAX_LENGTH + 1, 0);
+    for (size_t i = 0; i < lengths.size(); i++) {
+        if (lengths[i] < 0 || lengths[i] > MAX_LENGTH) {
+            return false;
+        }
+        lengthCount[lengths[i]]++;
+    }
+    lengthCount[0] = 0;
+
+    vector<uint64_t> nextCode(MAX_LENGTH + 1, 0);
+    uint64_t code = 0;
+    for (int len = 1; len <= MAX_LENGTH; len++) {
+        code = (code + lengthCount[len - 1]) << 1;
+        nextCode[len] = code;
+        if (code + lengthCount[len] > (uint64_t(1) << len)) {
+            return false;
+        }
+    }
+
+    codes.assign(lengths.size(), 0);
+    for (size_t i = 0; i < lengths.size(); i++) {
+        if (lengths[i] > 0) {
+            codes[i] = reverseBits(nextCode[lengths[i]]++, lengths[i]);
+        }
+    }
+    return true;
+}
+
+
+//
+// HuffmanEncodeTable
+// The code of every symbol, indexed by symbolIndex (or by symbol for
+// alphabets other than bytes, up to MAX_ALPHABET), in stream order.  A
+// length of 0 marks a symbol without a code.
+//
+class HuffmanEncodeTable {
+ public:
+    static const int MAX_CODE_LENGTH = 64;
+
+    struct Entry {
+        uint64_t code;
+        unsigned char length;
+    };
+
+    HuffmanEncodeTable() {
+        clear();
+    }
+
+    void clear() {
+        memset(entries, 0, sizeof(entries));
+    }
+
+    //
+    // Sets the canonical codes of a list of code lengths.  Returns false if
+    // the lengths do not describe a valid prefix code.
+    //
+    bool build(const vector<int>& lengths) {
+        vector<uint64_t> codes;
+        if (!canonicalCodes(lengths, codes)) {
+            return false;
+        }
+        clear();
+        for (int i = 0; i < MAX_ALPHABET && i < (int)lengths.size(); i++) {
+            entries[i].code = codes[i];
+            entries[i].length = (unsigned char)lengths[i];
+        }
+        return true;
+    }
+
+    //
+    // Sets the code of one character from its '0'/'1' string, as stored in
+    // an encoding map.  Returns false if the code is longer than
+    // MAX_CODE_LENGTH.
+    //
+    bool set(int character, const string& bits) {
+        if (bits.size() > MAX_CODE_LENGTH) {
+            return false;
+        }
+        Entry& e = entries[symbolIndex(character)];
+        e.code = 0;
+        for (size_t i = 0; i < bits.size(); i++) {
+            e.code |= uint64_t(bits[i] == '1') << i;
+        }
+        e.length = (unsigned char)bits.size();
+        return true;
+    }
+
+    const Entry& operator[](int index) const {
+        return entries[index];
+    }
+
+ private:
+    Entry entries[MAX_ALPHABET];
+};
+
+
+//
+// HuffmanDecodeTable
+// Two-level lookup table built from a list of (symbol, code, length)
+// triples.  Codes must form a prefix code and be given in stream order.
+//
+class HuffmanDecodeTable {
+ public:
+    static const int PRIMARY_BITS = 11;
+    static const int MAX_CODE_LENGTH = 32;  // longest code the table handles
+
+    struct Entry {
+        int symbol;            // decoded symbol, or subtable offset for links
+        unsigned char length;  // total code length in bits
+        unsigned char subBits; // nonzero if this entry links to a subtable
+    };
+
+    HuffmanDecodeTable() : primaryBits(0), longestCode(0) {
+    }
+
+    //
+    // Builds the table.  Returns false (leaving the table unusable) if a
+    // code is longer than MAX_CODE_LENGTH; callers fall back to a bitwise
+    // decode in that case.  Prefixes that match no code decode to
+    // NOT_A_CHAR.
+    //
+    bool build(const vector<int>& symbols, const vector<uint64_t>& codes,
+               const vector<int>& lengths) {
+        int maxLength = 0;
+        for (size_t i = 0; i < lengths.size(); i++) {
+            maxLength = max(maxLength, lengths[i]);
+        }
+        table.clear();
+        if (maxLength > MAX_CODE_LENGTH) {
+            return false;
+        }
+        longestCode = maxLength;
+        primaryBits = min(maxLength, (int)PRIMARY_BITS);
+        uint32_t primarySize = 1u << primaryBits;
+        Entry invalid = {NOT_A_CHAR, 0, 0};
+        table.assign(primarySize, invalid);
+
+        // size each subtable to the longest code sharing its prefix
+        vector<int> extraBits(primarySize, 0);
+        for (size_t i = 0; i < symbols.size(); i++) {
+            if (lengths[i] > primaryBits) {
+                uint32_t prefix = uint32_t(codes[i]) & (primarySize - 1);
+                extraBits[prefix] = max(extraBits[prefix],
+                                        lengths[i] - primaryBits);
+            }
+        }
+        for (uint32_t prefix = 0; prefix < primarySize; prefix++) {
+            if (extraBits[prefix] > 0) {
+                Entry link = {(int)table.size(), 0,
+                              (unsigned char)extraBits[prefix]};
+                table[prefix] = link;
+                table.resize(table.size() + (1u << extraBits[prefix]),
+                             invalid);
+            }
+        }
+
+        for (size_t i = 0; i < symbols.size(); i++) {
+            Entry e = {symbols[i], (unsigned char)lengths[i], 0};
+            if (lengths[i] <= primaryBits) {
+                for (uint32_t idx = uint32_t(codes[i]); idx < primarySize;
+                     idx += 1u << lengths[i]) {
+                    table[idx] = e;
+                }
+            } else {
+                const Entry& link =
+                    table[uint32_t(codes[i]) & (primarySize - 1)];
+                uint32_t subSize = 1u << link.subBits;
+                for (uint32_t idx = uint32_t(codes[i] >> primaryBits);
+                     idx < subSize; idx += 1u << (lengths[i] - primaryBits)) {
+                    table[link.symbol + idx] = e;
+                }
+            }
+        }
+        return true;
+    }
+
+    //
+    // Decodes one symbol, consuming its bits from reader.  The reader must
+    // hold at least MAX_CODE_LENGTH buffered bits (see BitReader::refill).
+    //
+    int decodeSymbol(BitReader& reader) const {
+        const Entry* e = &table[reader.peek(primaryBits)];
+        if (e->subBits != 0) {
+            uint32_t bits = reader.peek(primaryBits + e->subBits);
+            e = &table[e->symbol + (bits >> primaryBits)];
+        }
+        reader.consume(e->length);
+        return e->symbol;
+    }
+
+    size_t decode(BitReader& reader, char* out, size_t maxSymbols) const;
+
+    bool decodeStreams(BitReader* readers, char* out,
+                       const size_t* bounds) const;
+
+    static size_t decodeContextRounds(
+        const HuffmanDecodeTable* const* byContext, BitReader* readers,
+        char* out, const size_t* bounds, int* previous, int& bad);
+
+    bool empty() const {
+        return table.empty();
+    }
+
+ private:
+    struct TableLookup;
+    struct ContextLookup;
+
+    template <int PER_REFILL, typename Lookup>
+    static size_t decodeRounds(Lookup lookup, BitReader* readers, char* out,
+                               const size_t* bounds, int* previous,
+                               int& bad);
+
+    vector<Entry> table;
+    int primaryBits;
+    int longestCode;
+};
+
+
+//
+// *This function builds table for the canonical code with the given code
+// lengths, where symbol i decodes to i + offset (so that, with a large
+// enough offset, no symbol is NOT_A_CHAR).  Returns false if the lengths
+// are not a valid prefix code or a code is too long for the table.
+//
+inline bool buildOffsetTable(const vector<int>& lengths, int offset,
+                             HuffmanDecodeTable& table) {
+    vector<uint64_t> codes;
+    if (!canonicalCodes(lengths, codes)) {
+        return false;
+    }
+    vector<int> symbols;
+    vector<uint64_t> usedCodes;
+    vector<int> usedLengths;
+    for (int i = 0; i < (int)lengths.size(); i++) {
+        if (lengths[i] > 0) {
+            symbols.push_back(i + offset);
+            usedCodes.push_back(codes[i]);
+            usedLengths.push_back(lengths[i]);
+        }
+    }
+    return table.build(symbols, usedCodes, usedLengths);
+}
+
+
+//
+// CanonicalBitDecoder
+// Decodes a canonical code one bit at a time, for codes too long for
+// HuffmanDecodeTable.  Each bit extends the code, and the code is a symbol
+// as soon as it falls below the first code of the next length.
+//
+class CanonicalBitDecoder {
+ public:
+    //
+    // lengths is indexed by symbolIndex; 0 marks an unused symbol.
+    //
+    void build(const vector<int>& lengths) {
+        maxLength = 0;
+        for (size_t i = 0; i < lengths.size(); i++) {
+            maxLength = max(maxLength, lengths[i]);
+        }
+        lengthCount.assign(maxLength + 1, 0);
+        sortedSymbols.clear();
+        for (int len = 1; len <= maxLength; len++) {
+            for (int i = 0; i < (int)lengths.size(); i++) {
+                if (lengths[i] == len) {
+                    lengthCount[len]++;
+                    sortedSymbols.push_back(indexCharacter(i));
+                }
+            }
+        }
+    }
+
+    int decodeSymbol(BitReader& reader) const {
+        uint64_t code = 0;
+        uint64_t first = 0;
+        uint64_t index = 0;
+        for (int len = 1; len <= maxLength; len++) {
+            reader.refill();
+            code |= reader.peek(1);
+            reader.consume(1);
+            if (code - first < lengthCount[len]) {
+                return sortedSymbols[index + (code - first)];
+            }
+            index += lengthCount[len];
+            first = (first + lengthCount[len]) << 1;
+            code <<= 1;
+        }
+        return NOT_A_CHAR;
+    }
+
+    size_t decode(BitReader& reader, char* out, size_t maxSymbols) const;
+
+ private:
+    int maxLength;
+    vector<uint64_t> lengthCount;
+    vector<int> sortedSymbols;  // characters ordered by (length, symbol)
+};
+
+
+//
+// *This function decodes up to maxSymbols symbols into out.  It stops early,
+// returning how many it decoded, at PSEUDO_EOF, at a bit pattern that is not
+// a code, or when the input runs out.
+//
+template <typename Decoder>
+inline size_t decodeSymbols(const Decoder& decoder, BitReader& reader,
+                            char* out, size_t maxSymbols) {
+    size_t n = 0;
+    while (n < maxSymbols) {
+        reader.refill();
+        int symbol = decoder.decodeSymbol(reader);
+        if (symbol == PSEUDO_EOF || symbol == NOT_A_CHAR ||
+            reader.overrun()) {
+            break;
+        }
+        out[n++] = (char)symbol;
+    }
+    return n;
+}
+
+inline size_t HuffmanDecodeTable::decode(BitReader& reader, char* out,
+                                         size_t maxSymbols) const {
+    return decodeSymbols(*this, reader, out, maxSymbols);
+}
+
+
+//
+// HuffmanDecodeTable::TableLookup
+// Decodes a symbol from the low bits of a bit buffer with one table,
+// whatever symbol came before it.
+//
+struct HuffmanDecodeTable::TableLookup {
+    const Entry* entries;
+    int primary;
+    uint64_t mask;
+
+    explicit TableLookup(const HuffmanDecodeTable& table)
+        : entries(table.table.data()), primary(table.primaryBits),
+          mask((((uint64_t)1) << table.primaryBits) - 1) {
+    }
+
+    int operator()(uint64_t& buf, int& count, int) const {
+        const Entry* e = &entries[buf & mask];
+        if (e->subBits != 0) {
+            uint64_t subMask = (((uint64_t)1) << e->subBits) - 1;
+            e = &entries[e->symbol + ((buf >> primary) & subMask)];
+        }
+        buf >>= e->length;
+        count -= e->length;
+        return e->symbol;
+    }
+};
+
+
+//
+// HuffmanDecodeTable::ContextLookup
+// Decodes a symbol with the table of the byte before it (see context.h).
+// The table and mask of every context are copied out up front, so a
+// symbol takes no more loads than with TableLookup.
+//
+struct HuffmanDecodeTable::ContextLookup {
+    const Entry* entries[256];
+    uint32_t masks[256];
+    unsigned char primary[256];
+
+    explicit ContextLookup(const HuffmanDecodeTable* const* byContext) {
+        for (int c = 0; c < 256; c++) {
+            entries[c] = byContext[c]->table.data();
+            primary[c] = (unsigned char)byContext[c]->primaryBits;
+            masks[c] = (1u << primary[c]) - 1;
+        }
+    }
+
+    int operator()(uint64_t& buf, int& count, int context) const {
+        const Entry* table = entries[context];
+        const Entry* e = &table[buf & masks[context]];
+        if (e->subBits != 0) {
+            uint64_t subMask = (((uint64_t)1) << e->subBits) - 1;
+            e = &table[e->symbol + ((buf >> primary[context]) & subMask)];
+        }
+        buf >>= e->length;
+        count -= e->length;
+        return e->symbol;
+    }
+};
+
+
+//
+// *This function decodes PER_REFILL symbols from each of the SUBSTREAMS
+// readers per round, for as long as every stream has that many symbols and
+// 8 bytes of input left, and returns how many symbols each stream decoded.
+// lookup(buf, count, previous) decodes one symbol from the low bits of buf,
+// given the byte before it.  Stream k writes to out + bounds[k].  previous
+// holds the last symbol of each stream (as a byte) on the way in and out.
+// bad gets a bit set if a symbol was not a byte, in which case the output
+// is garbage.  The readers' state is kept in locals for the loop (stores
+// to out could alias the readers, which would keep it out of registers)
+// and written back at the end.
+//
+template <int PER_REFILL, typename Lookup>
+inline size_t HuffmanDecodeTable::decodeRounds(Lookup lookup,
+                                               BitReader* readers, char* out,
+                                               const size_t* bounds,
+                                               int* previous, int& bad) {
+    size_t shortest = bounds[1] - bounds[0];
+    for (int k = 1; k < SUBSTREAMS; k++) {
+        shortest = min(shortest, bounds[k + 1] - bounds[k]);
+    }
+    auto refill = [](uint64_t& buf, int& count, const unsigned char*& next) {
+        uint64_t word;
+        memcpy(&word, next, sizeof(word));
+        buf |= word << count;
+        next += (63 - count) >> 3;
+        count |= 56;
+    };
+
+    uint64_t buf0 = readers[0].bitBuf, buf1 = readers[1].bitBuf;
+    uint64_t buf2 = readers[2].bitBuf, buf3 = readers[3].bitBuf;
+    int count0 = readers[0].bitCount, count1 = readers[1].bitCount;
+    int count2 = readers[2].bitCount, count3 = readers[3].bitCount;
+    const unsigned char* next0 = readers[0].next;
+    const unsigned char* next1 = readers[1].next;
+    const unsigned char* next2 = readers[2].next;
+    const unsigned char* next3 = readers[3].next;
+    int s0 = previous[0], s1 = previous[1], s2 = previous[2];
+    int s3 = previous[3];
+    char* out0 = out + bounds[0];
+    char* out1 = out + bounds[1];
+    char* out2 = out + bounds[2];
+    char* out3 = out + bounds[3];
+    size_t done = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (done + PER_REFILL <= shortest &&
+           readers[0].end - next0 >= 8 && readers[1].end - next1 >= 8 &&
+           readers[2].end - next2 >= 8 && readers[3].end - next3 >= 8) {
+        refill(buf0, count0, next0);
+        refill(buf1, count1, next1);
+        refill(buf2, count2, next2);
+        refill(buf3, count3, next3);
+        for (int j = 0; j < PER_REFILL; j++) {
+            // a symbol that is not a byte is caught below before it can
+            // pick a table
+            s0 = lookup(buf0, count0, s0 & 0xff);
+            s1 = lookup(buf1, count1, s1 & 0xff);
+            s2 = lookup(buf2, count2, s2 & 0xff);
+            s3 = lookup(buf3, count3, s3 & 0xff);
+            // characters are -128 to 127; PSEUDO_EOF and NOT_A_CHAR are not
+            bad |= ((s0 + 128) | (s1 + 128) | (s2 + 128) | (s3 + 128)) &
+                   ~0xff;
+            out0[done + j] = (char)s0;
+            out1[done + j] = (char)s1;
+            out2[done + j] = (char)s2;
+            out3[done + j] = (char)s3;
+        }
+        done += PER_REFILL;
+    }
+#endif
+    readers[0].bitBuf = buf0;
+    readers[1].bitBuf = buf1;
+    readers[2].bitBuf = buf2;
+    readers[3].bitBuf = buf3;
+    readers[0].bitCount = count0;
+    readers[1].bitCount = count1;
+    readers[2].bitCount = count2;
+    readers[3].bitCount = count3;
+    readers[0].next = next0;
+    readers[1].next = next1;
+    readers[2].next = next2;
+    readers[3].next = next3;
+    previous[0] = s0 & 0xff;
+    previous[1] = s1 & 0xff;
+    previous[2] = s2 & 0xff;
+    previous[3] = s3 & 0xff;
+    return done;
+}
+
+
+//
+// *This function decodes the SUBSTREAMS streams of a block at once, one
+// reader per stream: stream k fills out + bounds[k] up to out +
+// bounds[k + 1].  As many symbols as fit in one refill (up to 3 with the
+// default 15-bit limit) are decoded from each stream per round.  Returns
+// false if a stream does not decode to exactly its share.
+//
+inline bool HuffmanDecodeTable::decodeStreams(BitReader* readers, char* out,
+                                              const size_t* bounds) const {
+    int bad = 0;
+    int previous[SUBSTREAMS] = {0, 0, 0, 0};
+    size_t done;
+    TableLookup lookup(*this);
+    int perRefill = longestCode > 0 ? 56 / longestCode : 3;
+    if (perRefill >= 3) {
+        done = decodeRounds<3>(lookup, readers, out, bounds, previous, bad);
+    } else if (perRefill == 2) {
+        done = decodeRounds<2>(lookup, readers, out, bounds, previous, bad);
+    } else {
+        done = decodeRounds<1>(lookup, readers, out, bounds, previous, bad);
+    }
+    if (bad != 0) {
+        return false;
+    }
+    for (int k = 0; k < SUBSTREAMS; k++) {
+        size_t rest = bounds[k + 1] - bounds[k] - done;
+        if (decodeSymbols(*this, readers[k], out + bounds[k] + done, rest) !=
+                rest ||
+            readers[k].overrun()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+//
+// *This function decodes the SUBSTREAMS streams of an order-1 block for as
+// long as every stream has enough input left to decode without checks,
+// and returns how many symbols each stream decoded.  byContext[c] is the
+// table of the symbols that follow symbol c (as a byte), and previous
+// holds the symbol before the first of each stream on the way in and the
+// last one decoded on the way out.  bad gets a bit set if a symbol was not
+// a byte, in which case the output is garbage.
+//
+inline size_t HuffmanDecodeTable::decodeContextRounds(
+        const HuffmanDecodeTable* const* byContext, BitReader* readers,
+        char* out, const size_t* bounds, int* previous, int& bad) {
+    int longest = 0;
+    for (int c = 0; c < 256; c++) {
+        longest = max(longest, byContext[c]->longestCode);
+    }
+    ContextLookup lookup(byContext);
+    int perRefill = longest > 0 ? 56 / longest : 3;
+    if (perRefill >= 3) {
+        return decodeRounds<3>(lookup, readers, out, bounds, previous, bad);
+    } else if (perRefill == 2) {
+        return decodeRounds<2>(lookup, readers, out, bounds, previous, bad);
+    }
+    return decodeRounds<1>(lookup, readers, out, bounds, previous, bad);
+}
+
+inline size_t CanonicalBitDecoder::decode(BitReader& reader, char* out,
+                                          size_t maxSymbols) const {
+    return decodeSymbols(*this, reader, out, maxSymbols);
+}
+
+
+//
+// CanonicalDecoder
+// Decodes the canonical code of a code length table, through the lookup
+// table when every code fits in it and bit by bit otherwise.
+//
+class CanonicalDecoder {
+ public:
+    //
+    // Returns false if the lengths do not describe a valid prefix code.
+    //
+    bool build(const vector<int>& lengths) {
+        vector<uint64_t> codes;
+        if (!canonicalCodes(lengths, codes)) {
+            return false;
+        }
+        vector<int> symbols;
+        vector<uint64_t> usedCodes;
+        vector<int> usedLengths;
+        for (int i = 0; i < (int)lengths.size(); i++) {
+            if (lengths[i] > 0) {
+                symbols.push_back(indexCharacter(i));
+                usedCodes.push_back(codes[i]);
+                usedLengths.push_back(lengths[i]);
+            }
+        }
+        useTable = table.build(symbols, usedCodes, usedLengths);
+        if (!useTable) {
+            bitwise.build(lengths);
+        }
+        return true;
+    }
+
+    size_t decode(BitReader& reader, char* out, size_t maxSymbols) const {
+        if (useTable) {
+            return table.decode(reader, out, maxSymbols);
+        }
+        return bitwise.decode(reader, out, maxSymbols);
+    }
+
+    // the lookup table, or null if the code is decoded bit by bit
+    const HuffmanDecodeTable* lookupTable() const {
+        return useTable ? &table : nullptr;
+    }
+
+    //
+    // Decodes one symbol.  The reader must have been refilled first.
+    //
+    int decodeSymbol(BitReader& reader) const {
+        if (useTable) {
+            return table.decodeSymbol(reader);
+        }
+        return bitwise.decodeSymbol(reader);
+    }
+
+    //
+    // Decodes the length symbols of a block coded as SUBSTREAMS byte-aligned
+    // streams, one after another in payload (payloadLength bytes), where
+    // streamLengths holds the byte lengths of all but the last.  Returns
+    // false if the streams do not decode to exactly length symbols.
+    //
+    bool decodeStreams(const unsigned char* payload, size_t payloadLength,
+                       const vector<uint32_t>& streamLengths, char* out,
+                       size_t length) const {
+        size_t bounds[SUBSTREAMS + 1];
+        subStreamBounds(length, bounds);
+        vector<BitReader> readers;
+        readers.reserve(SUBSTREAMS);
+        size_t offset = 0;
+        for (int k = 0; k < SUBSTREAMS; k++) {
+            size_t streamLength = k + 1 < SUBSTREAMS ? streamLengths[k]
+                                                     : payloadLength - offset;
+            readers.push_back(BitReader(payload + offset, streamLength));
+            offset += streamLength;
+        }
+        if (useTable) {
+            return table.decodeStreams(readers.data(), out, bounds);
+        }
+        for (int k = 0; k < SUBSTREAMS; k++) {
+            size_t count = bounds[k + 1] - bounds[k];
+            if (bitwise.decode(readers[k], out + bounds[k], count) != count) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+ private:
+    HuffmanDecodeTable table;
+    CanonicalBitDecoder bitwise;
+    bool useTable;
+};
@@ -0,0 +1,447 @@
+//
+//  lz77.h
+//  File Compression II
+//
+//  LZ77 match finding ahead of the Huffman stage.  Huffman coding alone
+//  gives every byte a code however often the string around it has been
+//  seen; logs and JSON repeat whole lines and keys, so most of what they
+//  hold can be said as "copy length bytes from distance bytes back".
+//  lzParse turns a block into tokens, each a literal byte or such a match,
+//  finding matches with hash chains: every position is filed under a hash
+//  of its first LZ_MIN_MATCH bytes, and each hash keeps the positions
+//  before it in a chain, newest first, up to LZ_WINDOW bytes back.
+//
+//  Tokens are coded as in deflate.  Literals and match lengths share one
+//  alphabet of LZ_LITLEN_SYMBOLS symbols (256 literals, then the length
+//  codes), distances have their own of LZ_DISTANCE_SYMBOLS, and the low
+//  bits of a length or distance follow its code as extra bits.  The
+//  distance codes past deflate's 30 reach back the whole 64 KiB window.
+//  Each alphabet gets a canonical Huffman code like any other (see
+//  codelengths.h), and matches never reach outside their block, so blocks
+//  still compress and decode independently.
+//
+//  The effort level (1 to LZ_MAX_LEVEL) sets how many chain entries are
+//  tried per position, when a match is long enough to stop looking, and
+//  from level 4 whether to look one byte ahead for a longer match before
+//  taking one (lazy matching).
+//
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include "bitstream.h"
+#include "hufftable.h"
+#include "container.h"
+
+using namespace std;
+
+const int LZ_MIN_MATCH = 3;
+const int LZ_MAX_MATCH = 258;
+const size_t LZ_WINDOW = 1 << 16;
+const size_t LZ_MAX_DISTANCE = LZ_WINDOW - 1;
+const int LZ_HASH_BITS = 15;
+// a match of LZ_MIN_MATCH bytes farther back than this costs more bits
+// than the literals it replaces
+const size_t LZ_TOO_FAR = 4096;
+const int LZ_MAX_LEVEL = 9;
+const int LZ_DEFAULT_LEVEL = 6;
+// decoding tables hold symbol + LZ_SYMBOL_OFFSET, so that no symbol is
+// NOT_A_CHAR
+const int LZ_SYMBOL_OFFSET = 512;
+
+const int LZ_LENGTH_BASE[LZ_LENGTH_CODES] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const int LZ_LENGTH_EXTRA[LZ_LENGTH_CODES] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const int LZ_DISTANCE_BASE[LZ_DISTANCE_SYMBOLS] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+    16385, 24577, 32769, 49153};
+const int LZ_DISTANCE_EXTRA[LZ_DISTANCE_SYMBOLS] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 14, 14};
+
+//
+// *This struct is the search effort of one level.
+//
+struct LzLevel {
+    int maxChain;    // chain entries tried per position
+    int niceLength;  // a match this long ends the search
+    int lazyLength;  // look one byte ahead for matches shorter than this
+                     // (0 for never)
+};
+
+const LzLevel LZ_LEVELS[LZ_MAX_LEVEL + 1] = {
+    {0, 0, 0},  // level 0 is no LZ77 stage at all
+    {4, 8, 0}, {8, 16, 0}, {32, 32, 0},
+    {16, 16, 4}, {32, 32, 16}, {128, 128, 16},
+    {256, 128, 32}, {1024, LZ_MAX_MATCH, 128},
+    {4096, LZ_MAX_MATCH, LZ_MAX_MATCH}};
+
+//
+// *This struct is one token: a literal byte (distance 0, the byte in
+// length) or a match of length bytes distance bytes back.
+//
+struct LzToken {
+    uint16_t length;
+    uint16_t distance;
+};
+
+
+//
+// *This function returns the length code (0 to LZ_LENGTH_CODES - 1) of a
+// match length.
+//
+inline int lzLengthCode(int length) {
+    struct Codes {
+        unsigned char code[LZ_MAX_MATCH + 1];
+
+        Codes() {
+            memset(code, 0, sizeof(code));
+            for (int c = 0; c < LZ_LENGTH_CODES; c++) {
+                for (int n = 0; n < (1 << LZ_LENGTH_EXTRA[c]); n++) {
+                    if (LZ_LENGTH_BASE[c] + n <= LZ_MAX_MATCH) {
+                        code[LZ_LENGTH_BASE[c] + n] = (unsigned char)c;
+                    }
+                }
+            }
+        }
+    };
+    static const Codes codes;
+    return codes.code[length];
+}
+
+
+//
+// *This function returns the distance code (0 to LZ_DISTANCE_SYMBOLS - 1)
+// of a match distance.  Past the first four, every power of two is split
+// into two codes.
+//
+inline int lzDistanceCode(size_t distance) {
+    uint32_t d = (uint32_t)distance - 1;
+    if (d < 4) {
+        return (int)d;
+    }
+    int top = 31 - __builtin_clz(d);
+    return 2 * top + ((d >> (top - 1)) & 1);
+}
+
+
+inline uint32_t _lzHash(const unsigned char* p) {
+    uint32_t bytes = p[0] | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16);
+    return (bytes * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+
+//
+// *This function returns how many of the first limit bytes of a and b are
+// equal, comparing eight at a time.
+//
+inline size_t _lzMatchLength(const unsigned char* a, const unsigned char* b,
+                             size_t limit) {
+    size_t n = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (n + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, a + n, sizeof(x));
+        memcpy(&y, b + n, sizeof(y));
+        if (x != y) {
+            return n + (__builtin_ctzll(x ^ y) >> 3);
+        }
+        n += 8;
+    }
+#endif
+    while (n < limit && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+
+//
+// LzMatcher
+// The hash chains of one block.  head holds the newest position filed
+// under each hash and chain[p % LZ_WINDOW] the one filed before p, so a
+// chain is walked newest first until it leaves the window.
+//
+class LzMatcher {
+ public:
+    LzMatcher(const unsigned char* data, size_t length, const LzLevel& level)
+        : data(data), length(length), level(level),
+          head(size_t(1) << LZ_HASH_BITS, -1), chain(LZ_WINDOW, -1) {
+    }
+
+    // files position p under the hash of the bytes there
+    void insert(size_t p) {
+        if (p + LZ_MIN_MATCH <= length) {
+            int32_t& newest = head[_lzHash(data + p)];
+            chain[p & (LZ_WINDOW - 1)] = newest;
+            newest = (int32_t)p;
+        }
+    }
+
+    //
+    // Returns the length of the longest match for the bytes at p (0 if
+    // there is none of at least LZ_MIN_MATCH bytes) and sets distance to
+    // how far back it starts.  p must not be filed yet.
+    //
+    int find(size_t p, size_t& distance) const {
+        size_t limit = min((size_t)LZ_MAX_MATCH, length - p);
+        if (limit < (size_t)LZ_MIN_MATCH) {
+            return 0;
+        }
+        const unsigned char* here = data + p;
+        size_t best = LZ_MIN_MATCH - 1;
+        int32_t candidate = head[_lzHash(here)];
+        for (int tries = level.maxChain;
+             candidate >= 0 && p - candidate <= LZ_MAX_DISTANCE &&
+             tries > 0 && best < limit;
+             tries--) {
+            const unsigned char* there = data + candidate;
+            // a longer match has to match at the end of the best so far
+            if (there[best] == here[best]) {
+                size_t n = _lzMatchLength(there, here, limit);
+                if (n > best && (n > (size_t)LZ_MIN_MATCH ||
+                                 p - candidate <= LZ_TOO_FAR)) {
+                    best = n;
+                    distance = p - candidate;
+                    if (n >= (size_t)level.niceLength) {
+                        break;
+                    }
+                }
+            }
+            int32_t next = chain[candidate & (LZ_WINDOW - 1)];
+            if (next >= candidate) {
+                break;
+            }
+            candidate = next;
+        }
+        return best >= (size_t)LZ_MIN_MATCH ? (int)best : 0;
+    }
+
+ private:
+    const unsigned char* data;
+    size_t length;
+    LzLevel level;
+    vector<int32_t> head;
+    vector<int32_t> chain;
+};
+
+
+//
+// *This function sets tokens to the LZ77 parse of the length bytes of data
+// at the given effort level (1 to LZ_MAX_LEVEL).
+//
+inline void lzParse(const unsigned char* data, size_t length, int level,
+                    vector<LzToken>& tokens) {
+    const LzLevel& settings = LZ_LEVELS[level];
+    LzMatcher matcher(data, length, settings);
+    tokens.clear();
+    size_t p = 0;
+    if (settings.lazyLength == 0) {
+        while (p < length) {
+            size_t distance = 0;
+            int n = matcher.find(p, distance);
+            matcher.insert(p);
+            if (n == 0) {
+                LzToken literal = {data[p++], 0};
+                tokens.push_back(literal);
+                continue;
+            }
+            LzToken match = {(uint16_t)n, (uint16_t)distance};
+            tokens.push_back(match);
+            for (size_t q = p + 1; q < p + n; q++) {
+                matcher.insert(q);
+            }
+            p += n;
+        }
+        return;
+    }
+
+    // the byte at p - 1 is waiting on whether the match at p is longer
+    // than its own (pending bytes, 0 if none)
+    bool waiting = false;
+    int pending = 0;
+    size_t pendingDistance = 0;
+    while (p < length) {
+        size_t distance = 0;
+        int n = 0;
+        if (pending < settings.lazyLength) {
+            n = matcher.find(p, distance);
+        }
+        matcher.insert(p);
+        if (pending > 0 && n <= pending) {
+            LzToken match = {(uint16_t)pending, (uint16_t)pendingDistance};
+            tokens.push_back(match);
+            size_t end = p - 1 + pending;
+            for (size_t q = p + 1; q < end; q++) {
+                matcher.insert(q);
+            }
+            p = end;
+            waiting = false;
+            pending = 0;
+            continue;
+        }
+        if (waiting) {
+            LzToken literal = {data[p - 1], 0};
+            tokens.push_back(literal);
+        }
+        waiting = true;
+        pending = n;
+        pendingDistance = distance;
+        p++;
+    }
+    if (waiting) {
+        LzToken last = {data[length - 1], 0};
+        if (pending > 0) {
+            last.length = (uint16_t)pending;
+            last.distance = (uint16_t)pendingDistance;
+        }
+        tokens.push_back(last);
+    }
+}
+
+
+//
+// *This function counts the literal/length symbols of tokens into
+// literalCounts (LZ_LITLEN_SYMBOLS of them) and the distance symbols into
+// distanceCounts (LZ_DISTANCE_SYMBOLS), and returns the number of extra
+// bits the tokens need.
+//
+inline uint64_t countLzTokens(const vector<LzToken>& tokens,
+                              uint64_t* literalCounts,
+                              uint64_t* distanceCounts) {
+    memset(literalCounts, 0, LZ_LITLEN_SYMBOLS * sizeof(uint64_t));
+    memset(distanceCounts, 0, LZ_DISTANCE_SYMBOLS * sizeof(uint64_t));
+    uint64_t extraBits = 0;
+    for (size_t i = 0; i < tokens.size(); i++) {
+        const LzToken& token = tokens[i];
+        if (token.distance == 0) {
+            literalCounts[token.length]++;
+            continue;
+        }
+        int lengthCode = lzLengthCode(token.length);
+        int distanceCode = lzDistanceCode(token.distance);
+        literalCounts[256 + lengthCode]++;
+        distanceCounts[distanceCode]++;
+        extraBits += LZ_LENGTH_EXTRA[lengthCode] +
+                     LZ_DISTANCE_EXTRA[distanceCode];
+    }
+    return extraBits;
+}
+
+
+//
+// *This function writes tokens to output with the codes in literals and
+// distances, and appends the bits to bits as '0' and '1' characters if it
+// is not null.
+//
+inline void writeLzTokens(const vector<LzToken>& tokens,
+                          const HuffmanEncodeTable& literals,
+                          const HuffmanEncodeTable& distances,
+                          obitstream& output, string* bits) {
+    auto write = [&output, bits](uint64_t code, int nBits) {
+        output.writeBits(code, nBits);
+        if (bits != nullptr) {
+            for (int bit = 0; bit < nBits; bit++) {
+                *bits += ((code >> bit) & 1) ? '1' : '0';
+            }
+        }
+    };
+    for (size_t i = 0; i < tokens.size(); i++) {
+        const LzToken& token = tokens[i];
+        if (token.distance == 0) {
+            write(literals[token.length].code, literals[token.length].length);
+            continue;
+        }
+        int lengthCode = lzLengthCode(token.length);
+        const HuffmanEncodeTable::Entry& length = literals[256 + lengthCode];
+        write(length.code, length.length);
+        write(token.length - LZ_LENGTH_BASE[lengthCode],
+              LZ_LENGTH_EXTRA[lengthCode]);
+        int distanceCode = lzDistanceCode(token.distance);
+        const HuffmanEncodeTable::Entry& distance = distances[distanceCode];
+        write(distance.code, distance.length);
+        write(token.distance - LZ_DISTANCE_BASE[distanceCode],
+              LZ_DISTANCE_EXTRA[distanceCode]);
+    }
+}
+
+
+//
+// LzDecoder
+// Decodes the payload of an LZ77 block with lookup tables for its two
+// codes.
+//
+class LzDecoder {
+ public:
+    //
+    // Returns false if either list of code lengths is not a valid prefix
+    // code or has a code too long for the tables.
+    //
+    bool build(const vector<int>& literalLengths,
+               const vector<int>& distanceLengths) {
+        return buildOffsetTable(literalLengths, LZ_SYMBOL_OFFSET, literals) &&
+               buildOffsetTable(distanceLengths, LZ_SYMBOL_OFFSET,
+                                distances);
+    }
+
+    //
+    // Decodes payload (payloadLength bytes) into the length bytes at out.
+    // Returns false unless the tokens make exactly length bytes, every
+    // match stays inside them, and the payload holds every bit read.
+    //
+    bool decode(const unsigned char* payload, size_t payloadLength,
+                char* out, size_t length) const {
+        BitReader reader(payload, payloadLength);
+        size_t n = 0;
+        while (n < length) {
+            reader.refill();
+            int symbol = literals.decodeSymbol(reader) - LZ_SYMBOL_OFFSET;
+            if (symbol < 256) {
+                if (symbol < 0) {
+                    return false;
+                }
+                out[n++] = (char)symbol;
+                continue;
+            }
+            int lengthCode = symbol - 256;
+            size_t matchLength = LZ_LENGTH_BASE[lengthCode] +
+                                 reader.peek(LZ_LENGTH_EXTRA[lengthCode]);
+            reader.consume(LZ_LENGTH_EXTRA[lengthCode]);
+            reader.refill();
+            int distanceCode = distances.decodeSymbol(reader) -
+                               LZ_SYMBOL_OFFSET;
+            if (distanceCode < 0) {
+                return false;
+            }
+            size_t distance = LZ_DISTANCE_BASE[distanceCode] +
+                              reader.peek(LZ_DISTANCE_EXTRA[distanceCode]);
+            reader.consume(LZ_DISTANCE_EXTRA[distanceCode]);
+            if (distance > n || matchLength > length - n) {
+                return false;
+            }
+            const char* from = out + n - distance;
+            if (distance >= matchLength) {
+                memcpy(out + n, from, matchLength);
+            } else {
+                // the match overlaps itself: a repeating pattern
+                for (size_t i = 0; i < matchLength; i++) {
+                    out[n + i] = from[i];
+                }
+            }
+            n += matchLength;
+        }
+        return !reader.overrun();
+    }
+
+ private:
+    HuffmanDecodeTable literals;
+    HuffmanDecodeTable distances;
+};
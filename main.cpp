@@ -12,13 +12,19 @@
 #include <functional>
 #include <ctype.h>
 #include <math.h>
+#include <stdlib.h>
 #include "bitstream.h"
 #include "util.h"
+#include "batch.h"
 #include "hashmap.h"
 
 using namespace std;
 
 string menu();
+int runCommandLine(int argc, const char * argv[]);
+bool readFileList(const string &listName, vector<string> &files);
+void printThroughput(const string &name, uint64_t bytesIn, uint64_t bytesOut,
+                     double seconds);
 bool is123456(string choice);
 void do123456(string choice, string &filename, bool &isFile,
              hashmap &frequencyMap,
@@ -27,6 +33,9 @@ void do123456(string choice, string &filename, bool &isFile,
 
 
 int main(int argc, const char * argv[]) {
+    if (argc > 1) {
+        return runCommandLine(argc, argv);
+    }
     hashmap frequencyMap;
     HuffmanNode* encodingTree = nullptr;
     mymap <int, string> encodingMap;
@@ -43,11 +52,21 @@ int main(int argc, const char * argv[]) {
         } else if (choice == "C") {
             cout << "Enter filename: ";
             cin >> filename;
-            compress(filename);
+            try {
+                compress(filename, false);
+            } catch (const runtime_error& e) {
+                cout << "Cannot compress " << filename << ": " << e.what()
+                     << endl;
+            }
         } else if (choice == "D") {
             cout << "Enter filename: ";
             cin >> filename;
-            decompress(filename);
+            try {
+                decompress(filename);
+            } catch (const runtime_error& e) {
+                cout << "Cannot decompress " << filename << ": " << e.what()
+                     << endl;
+            }
         } else if (choice == "B") {
             cout << "Enter filename: ";
             cin >> filename;
@@ -60,6 +79,240 @@ int main(int argc, const char * argv[]) {
     }
     return 0;
 }
+//
+// runCommandLine
+// Compresses or decompresses the files named on the command line without
+// the menu.  The options, as in usage:
+//     -c              compress every file to file.huf, overwriting it
+//     -d              decompress every file.huf to file (any other name to
+//                     file.out), overwriting an existing output file
+//     -j threads      threads to use, 0 for one per core (default 1)
+//     -b blockKiB     input bytes per block, 1 to 1048576 KiB (default 1024)
+//     -L bits         longest code, 9 to 32 bits or 0 for none (default 15)
+//     --split         end blocks where the content changes (see compressChunk)
+//     --order1        code each byte by the one before where that is smaller
+//                     (see context.h)
+//     -T tables       order-1 tables per block, 2 to 32 (default 16); implies
+//                     --order1
+//     --lz            code repeated strings as LZ77 matches where that is
+//                     smaller (see lz77.h)
+//     -z level        LZ77 effort, 1 to 9 or 0 for none (default 6 with --lz)
+//     --bwt           try a Burrows-Wheeler transform, before LZ77, on blocks
+//                     of up to 16 MiB (see bwt.h)
+//     --fse           code order-0 blocks with tANS where that is smaller
+//                     (see fse.h)
+//     --dedup         replace repeated chunks with references to the first
+//                     copy (see dedup.h)
+//     -W bits         dedup window of 2^bits bytes, 20 to 32 (default 27);
+//                     implies --dedup
+//     -v              print every compressed file's throughput
+//     --stats         print every file's stats (see stats.h) to standard
+//                     error as one line of JSON
+//     file...         the files; none or "-" reads standard input and writes
+//                     standard output
+//     @list           the files named in list, one per line
+// -d takes only -j and --stats.  Files to compress share one pool (see
+// batch.h), and the total throughput is printed when there is more than
+// one.  Returns the exit status.
+//
+int runCommandLine(int argc, const char * argv[]) {
+    string usage = string("usage: ") + argv[0] +
+        " -c [-j threads] [-b blockKiB] [-L bits] [--split]"
+        " [--order1] [-T tables] [--lz] [-z level] [--bwt] [--fse]"
+        " [--dedup] [-W bits] [-v] [--stats]"
+        " [file... | @list]"
+        " | -d [-j threads] [--stats] [file.huf... | @list]";
+    char mode = 0;
+    CompressOptions options;
+    vector<string> files;
+    bool showStats = false;
+    bool verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-c" || arg == "-d") {
+            mode = arg[1];
+        } else if (arg == "--stats") {
+            if (!HUFF_STATS) {
+                cerr << "--stats: built with HUFF_STATS=0" << endl;
+                return 2;
+            }
+            showStats = true;
+        } else if (arg == "--split") {
+            options.splitBlocks = true;
+        } else if (arg == "--order1") {
+            if (options.contextTables == 0) {
+                options.contextTables = DEFAULT_CONTEXT_TABLES;
+            }
+        } else if (arg == "--lz") {
+            if (options.lzLevel == 0) {
+                options.lzLevel = LZ_DEFAULT_LEVEL;
+            }
+        } else if (arg == "--bwt") {
+            options.bwt = true;
+        } else if (arg == "--fse") {
+            options.fse = true;
+        } else if (arg == "--dedup") {
+            if (options.dedupWindowLog == 0) {
+                options.dedupWindowLog = DEFAULT_DEDUP_WINDOW_LOG;
+            }
+        } else if (arg == "-v") {
+            verbose = true;
+        } else if (arg.size() > 1 && arg[0] == '@') {
+            if (!readFileList(arg.substr(1), files)) {
+                cerr << arg << ": cannot read file list" << endl;
+                return 2;
+            }
+        } else if ((arg == "-j" || arg == "-b" || arg == "-L" ||
+                    arg == "-T" || arg == "-z" || arg == "-W") &&
+                   i + 1 < argc) {
+            int value = atoi(argv[++i]);
+            if (arg == "-j" && value >= 0) {
+                options.threads = value;
+            } else if (arg == "-b" && value > 0 && value <= (1 << 20)) {
+                options.blockSize = (size_t)value * 1024;
+            } else if (arg == "-L" && (value == 0 ||
+                       (value >= MIN_CODE_LENGTH_LIMIT &&
+                        value <= MAX_CODE_LENGTH_LIMIT))) {
+                options.maxCodeLength = value;
+            } else if (arg == "-T" && value >= 2 &&
+                       value <= MAX_CONTEXT_TABLES) {
+                options.contextTables = value;
+            } else if (arg == "-z" && value >= 0 && value <= LZ_MAX_LEVEL) {
+                options.lzLevel = value;
+            } else if (arg == "-W" && value >= MIN_DEDUP_WINDOW_LOG &&
+                       value <= MAX_DEDUP_WINDOW_LOG) {
+                options.dedupWindowLog = value;
+            } else {
+                cerr << "bad value for " << arg << endl << usage << endl;
+                return 2;
+            }
+        } else if (arg[0] == '-' && arg != "-") {
+            cerr << usage << endl;
+            return 2;
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (mode == 0) {
+        cerr << usage << endl;
+        return 2;
+    }
+    CompressionStats stats;
+    options.stats = showStats ? &stats : nullptr;
+    if (files.empty() || (files.size() == 1 && files[0] == "-")) {
+        try {
+            ios::sync_with_stdio(false);
+            // reading cin would flush cout, which the writer thread owns
+            cin.tie(nullptr);
+            if (mode == 'c') {
+                compressStream(cin, cout, options);
+            } else {
+                decompressStream(cin, cout, options.threads, nullptr,
+                                 options.stats);
+            }
+            cout.flush();
+        } catch (const runtime_error& e) {
+            cerr << "stdin: " << e.what() << endl;
+            return 1;
+        }
+        if (showStats) {
+            writeStatsJson(cerr, stats, "-");
+        }
+        return cout ? 0 : 1;
+    }
+
+    int status = 0;
+    if (mode == 'c') {
+        uint64_t totalIn = 0;
+        uint64_t totalOut = 0;
+        size_t failures = 0;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        compressBatch(files, options, [&](const BatchResult &result) {
+            if (!result.error.empty()) {
+                cerr << result.name << ": " << result.error << endl;
+                failures++;
+                return;
+            }
+            totalIn += result.bytesIn;
+            totalOut += result.bytesOut;
+            if (verbose) {
+                printThroughput(result.name, result.bytesIn, result.bytesOut,
+                                result.seconds);
+            }
+            if (showStats) {
+                writeStatsJson(cerr, result.stats, result.name);
+            }
+        });
+        double seconds = chrono::duration<double>(
+            chrono::steady_clock::now() - start).count();
+        if (files.size() > 1) {
+            printThroughput(to_string(files.size() - failures) + " files",
+                            totalIn, totalOut, seconds);
+        }
+        return failures > 0 ? 1 : 0;
+    }
+
+    for (size_t i = 0; i < files.size(); i++) {
+        stats.clear();
+        try {
+            string outName = files[i];
+            size_t pos = outName.rfind(".huf");
+            if (pos != string::npos && pos + 4 == outName.size()) {
+                outName = outName.substr(0, pos);
+            } else {
+                outName += ".out";
+            }
+            decompressFile(files[i], outName, options.threads, nullptr,
+                           options.stats);
+            if (showStats) {
+                writeStatsJson(cerr, stats, files[i]);
+            }
+        } catch (const runtime_error& e) {
+            cerr << files[i] << ": " << e.what() << endl;
+            status = 1;
+        }
+    }
+    return status;
+}
+
+//
+// readFileList
+// Adds the names in the file listName, one per line, to files, skipping
+// empty lines.  Returns false if the list cannot be read.
+//
+bool readFileList(const string &listName, vector<string> &files) {
+    ifstream list(listName);
+    if (!list.is_open()) {
+        return false;
+    }
+    string line;
+    while (getline(list, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            files.push_back(line);
+        }
+    }
+    return !list.bad();
+}
+
+//
+// printThroughput
+// Prints one line of sizes and speed for name to standard error.
+//
+void printThroughput(const string &name, uint64_t bytesIn, uint64_t bytesOut,
+                     double seconds) {
+    double ratio = bytesIn > 0 ? 100.0 * bytesOut / bytesIn : 0;
+    double speed = seconds > 0 ? bytesIn / seconds / 1e6 : 0;
+    char line[128];
+    snprintf(line, sizeof(line), "%llu -> %llu bytes (%.1f%%), %.3f s, "
+             "%.1f MB/s", (unsigned long long)bytesIn,
+             (unsigned long long)bytesOut, ratio, seconds, speed);
+    cerr << name << ": " << line << endl;
+}
+
 string menu() {
     cout << "Welcome to the file compression app!" << endl;
     cout << "1.  Build character frequency map" << endl;
@@ -156,7 +409,7 @@ void do123456(string choice, string &filename, bool &isFile,
         // note: << is overloaded for the hashmap class.  super nice!
         ss << frequencyMap;
         output << frequencyMap;  // add the frequency map to the file
-        int size = 0;
+        long long size = 0;
         string codeStr = encode(input, encodingMap, output, size, true);
         // count bytes in frequency map header
         size = ss.str().length() + ceil((double)size / 8);
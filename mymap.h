@@ -3,10 +3,22 @@
 #include <iostream>
 #include <sstream>
 #include <vector>
+#include <stdexcept>
 
 
 using namespace std;
 
+//
+// mymap
+// A threaded binary search tree: a node with no right child (isThreaded)
+// points right to its in-order successor instead, so the tree can be walked
+// in order without a stack.  Every node counts the nodes in its left (nL)
+// and right (nR) subtrees, and a subtree is balanced while
+// max(nL, nR) <= 2 * min(nL, nR) + 1.  put() only rebuilds the highest
+// subtree on its path that this condition fails for, so inserting n keys
+// costs O(n log n) overall.  Nodes come from a pool that hands them out of
+// large blocks and frees them all at once.
+//
 template<typename keyType, typename valueType>
 class mymap {
  private:
@@ -22,6 +34,12 @@ class mymap {
     NODE* root;  // pointer to root node of the BST
     int size;  // # of key/value pairs in the mymap
 
+    vector<NODE*> blocks;  // node pool; each block twice the last one
+    size_t blockUsed;  // nodes handed out from the last block
+    size_t blockSize;  // nodes in the last block
+    vector<NODE*> scratch;  // reused by rebuilds
+    vector<NODE*> path;  // reused by put
+
     //
     // iterator:
     // This iterator is used so that mymap will work with a foreach loop.
@@ -71,109 +89,59 @@ class mymap {
     };
 
 
- public:
-    /* mymap
-     *
-     * sets the root pointer to null and size to zero
-     */
-    mymap() {
-        root = nullptr;
-        size = 0;
-    }
-
-
-    /* copytree
+    /* newNode
      *
-     * Helper function Copies over the tree from the parameter by using preorder
-     * traversal. Uses recursion and returns the new node added.
+     * Takes the next node from the pool, starting a new block twice the size
+     * of the last one when it is used up.
      */
-    NODE* copytree(NODE* other){
-        if (other == nullptr) {
-            return nullptr;
-        } else{
-            NODE* newnode = new NODE();
-            newnode->key = other->key;
-            newnode->value = other->value;
-            newnode->isThreaded = other->isThreaded;
-            newnode->nL = other->nL;
-            newnode->nR = other->nR;
-
-            if (newnode->isThreaded) {
-                newnode->right = other->right;
-                newnode->left = other->left;
-            } else {
-                newnode->left = copytree(other->left);
-                newnode->right = copytree(other->right);
-            }
-            return newnode;
+    NODE* newNode(keyType key, valueType value) {
+        if (blocks.empty() || blockUsed == blockSize) {
+            blockSize = blocks.empty() ? 16 : 2 * blockSize;
+            blocks.push_back(new NODE[blockSize]);
+            blockUsed = 0;
         }
+        NODE* node = &blocks.back()[blockUsed++];
+        node->key = key;
+        node->value = value;
+        node->left = nullptr;
+        node->right = nullptr;
+        node->nL = 0;
+        node->nR = 0;
+        node->isThreaded = true;
+        return node;
     }
 
 
-    /* mymap copy constructor
-     *
-     * Calls the recusive helper function and sets the size value
-     */
-    mymap(const mymap& other) {
-        root = copytree(other.root);
-        size = other.size;
-    }
-        
-    
-    /* mymap copy operator
-     *
-     * First calls the clear tree functionCalls the recusive helper function
-     * and sets the size value and returns the current pointer
-     */
-    mymap& operator=(const mymap& other) {
-        cleartree(root);
-        size = other.size;
-        root = copytree(other.root);
-        return *this;
-    }
-
-
-    /* cleartree
+    /* freeNodes
      *
-     * deletes all the nodes using postorder recursive traversal
+     * Releases every block of the pool.
      */
-    void cleartree(NODE* curr){
-        if (curr == nullptr) {
-            delete curr;
-            return;
-        }
-
-        if (curr->isThreaded) {
-            delete curr;
-            return;
-        } else {
-            cleartree(curr->left);
-            cleartree(curr->right);
-            delete curr;
+    void freeNodes() {
+        for (size_t i = 0; i < blocks.size(); i++) {
+            delete[] blocks[i];
         }
-    }
-
-
-    /* clear
-     *
-     * Calls the clear tree helper functon and sets the root and size to defult
-     * values
-     */
-    void clear() {
-        cleartree(root);
+        blocks.clear();
+        blockUsed = 0;
+        blockSize = 0;
         root = nullptr;
         size = 0;
     }
 
-    /* ~mymap
+
+    /* copyFrom
      *
-     * Calls the clear tree helper functon and sets the root and size to defult
-     * values
+     * Rebuilds this map as a balanced copy of other, which must not be this
+     * map.
      */
-    ~mymap() {
-        cleartree(root);
-        root = nullptr;
-        size = 0;
+    void copyFrom(const mymap& other) {
+        freeNodes();
+        scratch.clear();
+        for (NODE* curr = leftMost(other.root); curr != nullptr;
+             curr = next(curr)) {
+            scratch.push_back(newNode(curr->key, curr->value));
+        }
+        size = (int)scratch.size();
+        root = _build(0, size - 1, nullptr);
     }
 
 
@@ -182,7 +150,7 @@ class mymap {
      * Checks to see if the current node is balanced by using a algorithm, return
      * true if it is and false if it is not.
      */
-    bool isbalanced(NODE* node){
+    static bool isbalanced(NODE* node){
         if (!(max(node->nL, node->nR) <= 2 * min(node->nL, node->nR) + 1)) {
             return false;
         }
@@ -190,244 +158,209 @@ class mymap {
     }
 
 
-    /* createNewNode
+    /* _build
      *
-     * Helper function to create a new node and add it to the tree
+     * Links scratch[left..right], which is in key order, into a perfectly
+     * balanced subtree and returns its root.  after is the in-order
+     * successor of the whole range, which the last node threads to.
      */
-    void createNewNode(keyType key, valueType value, NODE* prev){
-        NODE* newnode = new NODE();
-        newnode->left = nullptr;
-        newnode->right = nullptr;
-        newnode->key = key;
-        newnode->value = value;
-        newnode->isThreaded=true;
-        newnode->nL = 0;
-        newnode->nR = 0;
-
-        if(prev == nullptr){
-            root = newnode;
-        }
-        else if(key < prev->key){
-            newnode->right = prev;
-            prev->left = newnode;
+    NODE* _build(int left, int right, NODE* after) {
+        if (left > right) {
+            return nullptr;
         }
-        else if(key>prev->key){
-            newnode->right = prev->right;
-            prev->isThreaded = false;
-            prev->right = newnode;
+        int mid = left + (right - left) / 2;
+        NODE* newroot = scratch[mid];
+        newroot->left = _build(left, mid - 1, newroot);
+        newroot->nL = mid - left;
+        newroot->nR = right - mid;
+        if (mid < right) {
+            newroot->right = _build(mid + 1, right, after);
+            newroot->isThreaded = false;
+        } else {
+            newroot->right = after;
+            newroot->isThreaded = true;
         }
-        changeNumNodes(key);
-        size++;
+        return newroot;
     }
 
 
-    /* rebalanceTree
+    /* rebuild
      *
-     * Helper function to rebalance tree. Adds all the nodes to be balanced to a vector
-     * and calls the recusive rebalance function
+     * Rebuilds the subtree rooted at node into a perfectly balanced one and
+     * returns its new root.  O(size of the subtree).
      */
-    void rebalanceTree(keyType key, vector<NODE*> toBeBalanced, vector<NODE*> allNodes){
-        NODE* temp = searchforkey(key);
-        
-        if(temp!=nullptr){
-            NODE* parenttemp = searchforParentkey(key);
-            addtovector(temp, toBeBalanced);
-            addentire(root, allNodes);
-
-            NODE* newsubtreeroot =  _rebalance(0, int(toBeBalanced.size()-1), toBeBalanced, allNodes, parenttemp);
-
-            if(parenttemp==nullptr){
-                root = newsubtreeroot;
-            }
-            else{
-                if(newsubtreeroot->key < parenttemp->key){
-                    parenttemp->left = newsubtreeroot;
-
-                }
-                else{
-                    parenttemp->right = newsubtreeroot;
-                }
-            }
+    NODE* rebuild(NODE* node) {
+        scratch.clear();
+        NODE* curr = leftMost(node);
+        int count = node->nL + node->nR + 1;
+        for (int i = 0; i < count; i++) {
+            scratch.push_back(curr);
+            curr = next(curr);
         }
+        // curr is now the first node after the subtree
+        return _build(0, count - 1, curr);
     }
 
 
-    /* put
+    /* next
      *
-     * This is the main put function that calls other helper function.
+     * Returns the in-order successor of node, or nullptr after the last.
      */
-    void put(keyType key, valueType value) {
-        NODE* curr = root;
-        NODE* prev = nullptr;
-        vector<NODE*> toBeBalanced;
-        vector<NODE*> allNodes;
-
-        while (curr!=nullptr) {
-            if(key == curr->key){
-                curr->value = value;
-                return;
-            } else if (key < curr->key) {
-                prev = curr;
-                curr = curr->left;
-            } else {
-                if (curr->isThreaded) {
-                    prev = curr;
-                    curr = nullptr;
-                  } else {
-                      prev = curr;
-                      curr = curr->right;
-                  }
-            }
+    static NODE* next(NODE* node) {
+        if (node->isThreaded) {
+            return node->right;
         }
-        createNewNode(key, value, prev);
-        rebalanceTree(key, toBeBalanced, allNodes);
+        return leftMost(node->right);
     }
 
 
-    /* changeNumNodes
+    /* find
      *
-     * Changes the count for the number of left and right nodes for the necessary nodes
-     * does this by finding the inserted noded and increamenting as it goes along
+     * Returns the node holding key, or nullptr.  O(logN)
      */
-    void changeNumNodes(keyType key){
+    NODE* find(keyType key) const {
         NODE* curr = root;
         while (curr != nullptr) {
             if (key == curr->key) {
-                return ;
-            } else if (key<curr->key) {
-                curr->nL++;
+                return curr;
+            } else if (key < curr->key) {
                 curr = curr->left;
+            } else if (curr->isThreaded) {
+                return nullptr;
             } else {
-                if (!curr->isThreaded) {
-                    curr->nR++;
-                    curr = curr->right;
-                }
+                curr = curr->right;
             }
         }
+        return nullptr;
     }
 
 
-    /* searchforkey
+ public:
+    /* mymap
      *
-     * Searches for a key using pre order traversal
+     * sets the root pointer to null and size to zero
      */
-    NODE* searchforkey(keyType key){
-        NODE* curr = root;
-        while (curr != nullptr) {
-            if (!isbalanced(curr)) {
-                return curr;
-            } else {
-                if (key == curr->key) {
-                    return nullptr;
-                } else if (key<curr->key) {
-                    curr = curr->left;
-                } else{
-                    if (!curr->isThreaded) {
-                        curr = curr->right;
-                    }
-                }
-            }
-        }
-        return nullptr;
+    mymap() : root(nullptr), size(0), blockUsed(0), blockSize(0) {
     }
-    
-    /* searchforParentkey
+
+
+    /* mymap copy constructor
      *
-     * Searches for a parent node using pre order traversal
+     * Copies other into a balanced tree of this map's own nodes.
      */
-    NODE* searchforParentkey(keyType key){
-        NODE* curr = root;
-        NODE* prev = nullptr;
+    mymap(const mymap& other)
+        : root(nullptr), size(0), blockUsed(0), blockSize(0) {
+        copyFrom(other);
+    }
 
-        while (curr != nullptr) {
-            if (!isbalanced(curr)) {
-                return prev;
-            } else {
-                if (key == curr->key) {
-                    prev = curr;
-                    return nullptr;
-                } else if (key<curr->key) {
-                    prev = curr;
-                    curr = curr->left;
-                } else {
-                    if (!curr->isThreaded) {
-                        prev = curr;
-                        curr = curr->right;
-                    }
-                }
-            }
+
+    /* mymap copy operator
+     *
+     * Frees the current nodes, copies other, and returns the current pointer
+     */
+    mymap& operator=(const mymap& other) {
+        if (this != &other) {
+            copyFrom(other);
         }
-        return nullptr;
+        return *this;
+    }
+
+
+    /* clear
+     *
+     * Frees every node and sets the root and size to defult values
+     */
+    void clear() {
+        freeNodes();
+    }
+
+    /* ~mymap
+     *
+     * Frees every node
+     */
+    ~mymap() {
+        freeNodes();
     }
-    
-    
-    /* _rebalance
+
+
+    /* put
      *
-     * This is a recursive function that uses post order to rebalance the tree from the
-     * vector of nodes.
+     * Sets the value of key, adding it if it is new.  The new node is counted
+     * on the way down; then the highest node on its path that is no longer
+     * balanced has its subtree rebuilt.  Amortized O(logN)
      */
-    NODE* _rebalance(int left, int right, vector<NODE*>& tobebalanced, vector<NODE*>& allNodes, NODE* prev){
-        if (left>right) { return nullptr; }
-        
-        int mid = (left + right) / 2;
-        NODE* newroot = tobebalanced[mid];
-        newroot->left = _rebalance(left, mid-1, tobebalanced, allNodes, prev);
-        newroot->nL = mid-left;
-        newroot->right = _rebalance(mid+1, right, tobebalanced, allNodes, prev);
-        newroot->nR = right-mid;
-        
-        if (newroot->right == nullptr) {
-            if (mid+1 < tobebalanced.size()) {
-                newroot->right = tobebalanced[mid+1];
-                newroot->isThreaded = true;
+    void put(keyType key, valueType value) {
+        NODE* existing = find(key);
+        if (existing != nullptr) {
+            existing->value = value;
+            return;
+        }
+
+        NODE* node = newNode(key, value);
+        size++;
+        if (root == nullptr) {
+            root = node;
+            return;
+        }
+
+        path.clear();
+        NODE* curr = root;
+        while (true) {
+            path.push_back(curr);
+            if (key < curr->key) {
+                curr->nL++;
+                if (curr->left == nullptr) {
+                    node->right = curr;  // curr follows the new node
+                    curr->left = node;
+                    break;
+                }
+                curr = curr->left;
             } else {
-                if (allNodes[allNodes.size()-1]->key == newroot->key) {
-                    newroot->right = nullptr;
+                curr->nR++;
+                if (curr->isThreaded) {
+                    node->right = curr->right;
+                    curr->right = node;
+                    curr->isThreaded = false;
+                    break;
+                }
+                curr = curr->right;
+            }
+        }
+
+        for (size_t i = 0; i < path.size(); i++) {
+            if (!isbalanced(path[i])) {
+                NODE* newsubtreeroot = rebuild(path[i]);
+                if (i == 0) {
+                    root = newsubtreeroot;
+                } else if (path[i - 1]->left == path[i]) {
+                    path[i - 1]->left = newsubtreeroot;
                 } else {
-                    for(int i = 0; i < allNodes.size(); i++){
-                        if(allNodes[i]->key == newroot->key){
-                            newroot->right = allNodes[i+1];
-                        }
-                    }
+                    path[i - 1]->right = newsubtreeroot;
                 }
-                newroot->isThreaded = true;
+                break;
             }
-        } else {
-            newroot->isThreaded = false;
         }
-        return newroot;
     }
 
 
-    /* addtovector
+    /* buildFromSorted
      *
-     * This function gets all the nodes that needs to be added based on the root
-     * parameter given
+     * Replaces the contents of the map with items, which must be sorted by
+     * strictly increasing key, as one perfectly balanced tree.  O(N)
      */
-    void addtovector(NODE* imbalanced, vector<NODE*>& toBeBalanced){
-        if (imbalanced == NULL) {return;}
-        imbalanced->nL = 0;
-        imbalanced->nR = 0;
-
-        addtovector(imbalanced->left, toBeBalanced);
-        toBeBalanced.push_back(imbalanced);
-        if (!imbalanced->isThreaded) {
-            addtovector(imbalanced->right, toBeBalanced);
+    void buildFromSorted(const vector<pair<keyType, valueType> >& items) {
+        for (size_t i = 1; i < items.size(); i++) {
+            if (!(items[i - 1].first < items[i].first)) {
+                throw runtime_error("KEYS NOT SORTED");
+            }
         }
-    }
-
-    /* addentire
-     *
-     * This function adds all the nodes into a vector
-     */
-    void addentire(NODE* imbalanced, vector<NODE*>& toBeBalanced){
-        if (imbalanced == NULL){return;}
-
-        addentire(imbalanced->left, toBeBalanced);
-        toBeBalanced.push_back(imbalanced);
-        if (!imbalanced->isThreaded) {
-            addentire(imbalanced->right, toBeBalanced);
+        freeNodes();
+        scratch.clear();
+        for (size_t i = 0; i < items.size(); i++) {
+            scratch.push_back(newNode(items[i].first, items[i].second));
         }
+        size = (int)scratch.size();
+        root = _build(0, size - 1, nullptr);
     }
 
 
@@ -437,21 +370,7 @@ class mymap {
      * return true. If not return false.
      */
     bool contains(keyType key) {
-        NODE* curr = root;
-        while (curr != nullptr) {
-            if (key == curr->key) {
-                return true;
-            } else if (key < curr->key) {
-                curr = curr->left;
-            } else {
-                if (!curr->isThreaded) {
-                    curr = curr->right;
-                } else {
-                    curr = nullptr;
-                }
-            }
-        }
-        return false;
+        return find(key) != nullptr;
     }
 
 
@@ -461,47 +380,26 @@ class mymap {
      * BST then return the valuetype();
      */
     valueType get(keyType key) {
-        NODE* curr = root;
-        while (curr != nullptr) {
-            if (key == curr->key) {
-                return curr->value;
-            } else if (key < curr->key) {
-                curr = curr->left;
-            } else {
-                if (!curr->isThreaded) {
-                    curr = curr->right;
-                } else {
-                    curr = nullptr;
-                }
-            }
-        }
-        return valueType();
+        NODE* node = find(key);
+        return node != nullptr ? node->value : valueType();
     }
 
-    
+
     /* operator[]
      *
      * This function returns the value at a given key. If the key does not exist
      * then add it to the BST with val as valuetype()
      */
     valueType operator[](keyType key) {
-        NODE* curr = leftMost(root);
-        while (curr != nullptr) {
-            if (curr->key == key) {
-                return curr->value;
-            }
-            if (curr->isThreaded) {
-                curr = curr->right;
-            } else {
-                curr = leftMost(curr->right);
-            }
+        NODE* node = find(key);
+        if (node != nullptr) {
+            return node->value;
         }
-
         put(key, valueType());
         return  valueType();
     }
-    
-    
+
+
     /* Size
      *
      * Returns the size
@@ -516,24 +414,16 @@ class mymap {
      * Returns the leftmost node in the BST
      */
     iterator begin() {
-        NODE* curr = root;
-        while (curr->left != nullptr) {
-            curr = curr->left;
-        }
-        return iterator(curr);  // TODO: Update this return.
+        return iterator(leftMost(root));
     }
 
 
     /* end
      *
-     * Returns the rightmost node in the BST
+     * Returns the position after the rightmost node, where its thread ends
      */
     iterator end() {
-        NODE* curr = root;
-        while (curr->right != nullptr){
-            curr = curr->right;
-        }
-        return iterator(curr);
+        return iterator(nullptr);
     }
 
 
@@ -541,17 +431,17 @@ class mymap {
      *
      * Returns the leftMost node in the BST
      */
-   NODE* leftMost(NODE* n){
-       if (n == nullptr) {
-           return nullptr;
-       }
-       while (n->left != NULL) {
-           n = n->left;
-       }
+    static NODE* leftMost(NODE* n){
+        if (n == nullptr) {
+            return nullptr;
+        }
+        while (n->left != NULL) {
+            n = n->left;
+        }
         return n;
     }
-    
-  
+
+
     /* _buildString
      *
      * Ouputs the BST as a string using inorder traversal recursion
@@ -566,7 +456,7 @@ class mymap {
            _buildString(node->right, out);
        }
     }
-    
+
     /* toString
      *
      * calls the helper function to output BST as a string
@@ -583,18 +473,10 @@ class mymap {
      * Converts the BST into a vector of pairs
      */
     vector<pair<keyType, valueType> > toVector() {
-        
-        NODE* curr = leftMost(root);
         vector<pair<keyType, valueType>> map;
-        
-        while (curr != nullptr) {
+        map.reserve(size);
+        for (NODE* curr = leftMost(root); curr != nullptr; curr = next(curr)) {
             map.push_back(make_pair(curr->key, curr->value));
-
-            if (curr->isThreaded) {
-                curr = curr->right;
-            } else {
-                curr = leftMost(curr->right);
-            }
         }
         return map;
     }
@@ -609,7 +491,7 @@ class mymap {
             return;
         }
         out << "key: " << node->key << ", nL: " << node->nL << ", nR: " << node->nR << "\n";
-        
+
         _buildBalanceString(node->left, out);
         if(!node->isThreaded){
             _buildBalanceString(node->right, out);
@@ -0,0 +1,211 @@
+//
+//  stats.h
+//  File Compression II
+//
+//  Per-stage timing and counters for one compress or decompress run.  The
+//  caller passes a CompressionStats to fill in; the instrumentation in util.h
+//  is written with STATS_ONLY and STATS_TIMER, which expand to nothing when
+//  HUFF_STATS is 0 (build with -DHUFF_STATS=0), so a build without stats does
+//  not even read the clock.  The struct itself is always there, so code using
+//  it compiles either way.
+//
+//  Stage times are summed over every thread that ran the stage, so with
+//  several workers they can add up to more than totalSeconds.
+//
+
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include "histogram.h"
+
+using namespace std;
+
+#ifndef HUFF_STATS
+#define HUFF_STATS 1
+#endif
+
+// STATS_TIMER times the rest of the enclosing scope into stats->field, if
+// stats is not null.
+#if HUFF_STATS
+#define STATS_ONLY(...) __VA_ARGS__
+#define STATS_TIMER(stats, field) \
+    StageTimer field##Timer((stats) != nullptr ? &(stats)->field : nullptr)
+#else
+#define STATS_ONLY(...)
+#define STATS_TIMER(stats, field)
+#endif
+
+struct CompressionStats {
+    double readSeconds;    // reading input (and parsing block headers)
+    double dedupSeconds;   // finding repeated chunks, or copying them back
+    double countSeconds;   // counting bytes
+    double matchSeconds;   // finding LZ77 matches
+    double transformSeconds; // Burrows-Wheeler transform, or undoing it
+    double treeSeconds;    // code lengths, encode tables, decode tables
+    double encodeSeconds;
+    double decodeSeconds;
+    double writeSeconds;   // writing output
+    double totalSeconds;   // wall time of the whole run
+
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    uint64_t symbols;         // symbols coded
+    uint64_t blocks;
+    uint64_t dedupBytes;      // input bytes replaced by references
+    uint64_t storedBytes;     // input bytes in blocks stored as they are
+    uint64_t headerBytes;     // every compressed byte that is not payload
+                              // (references count as header)
+    uint64_t payloadBits;     // sum of the code lengths of the symbols
+                              // (payload bytes * 8 when decompressing)
+    double entropyBits;       // Shannon bound of the symbols, each block
+                              // under its own byte frequencies (only
+                              // when compressing)
+    uint64_t peakBufferBytes; // most block bytes read but not yet written
+
+    CompressionStats() {
+        clear();
+    }
+
+    void clear() {
+        readSeconds = dedupSeconds = countSeconds = matchSeconds = 0;
+        transformSeconds = treeSeconds = 0;
+        encodeSeconds = decodeSeconds = writeSeconds = totalSeconds = 0;
+        bytesIn = bytesOut = symbols = blocks = dedupBytes = 0;
+        storedBytes = 0;
+        headerBytes = payloadBits = peakBufferBytes = 0;
+        entropyBits = 0;
+    }
+
+    //
+    // Adds the stage times and counters of other (the stats of one block)
+    // into these.
+    //
+    void merge(const CompressionStats& other) {
+        readSeconds += other.readSeconds;
+        dedupSeconds += other.dedupSeconds;
+        countSeconds += other.countSeconds;
+        matchSeconds += other.matchSeconds;
+        transformSeconds += other.transformSeconds;
+        treeSeconds += other.treeSeconds;
+        encodeSeconds += other.encodeSeconds;
+        decodeSeconds += other.decodeSeconds;
+        writeSeconds += other.writeSeconds;
+        symbols += other.symbols;
+        blocks += other.blocks;
+        dedupBytes += other.dedupBytes;
+        storedBytes += other.storedBytes;
+        headerBytes += other.headerBytes;
+        payloadBits += other.payloadBits;
+        entropyBits += other.entropyBits;
+        peakBufferBytes = max(peakBufferBytes, other.peakBufferBytes);
+    }
+
+    // bits per symbol actually spent, and the best order-0 code could do
+    double averageCodeLength() const {
+        return symbols > 0 ? double(payloadBits) / symbols : 0;
+    }
+
+    double entropy() const {
+        return symbols > 0 ? entropyBits / symbols : 0;
+    }
+};
+
+
+//
+// StageTimer
+// Adds the time from its construction to its destruction to *seconds,
+// unless seconds is null.
+//
+class StageTimer {
+ public:
+    explicit StageTimer(double* seconds)
+        : seconds(seconds), start(chrono::steady_clock::now()) {
+    }
+
+    ~StageTimer() {
+        if (seconds != nullptr) {
+            *seconds += chrono::duration<double>(
+                chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+ private:
+    double* seconds;
+    chrono::steady_clock::time_point start;
+};
+
+
+//
+// *This function returns the Shannon entropy, in bits, of all the symbols
+// counted in the histogram: the fewest bits any code fixed for the whole
+// histogram could spend on them.
+//
+inline double histogramEntropyBits(const Histogram& histogram) {
+    uint64_t total = 0;
+    for (int i = 0; i < NUM_SYMBOLS; i++) {
+        total += histogram.counts[i];
+    }
+    double bits = 0;
+    for (int i = 0; i < NUM_SYMBOLS; i++) {
+        if (histogram.counts[i] > 0) {
+            double count = double(histogram.counts[i]);
+            bits += count * log2(double(total) / count);
+        }
+    }
+    return bits;
+}
+
+
+//
+// *This function writes the stats as one JSON object on one line.  name (if
+// not empty) is added as a "file" member, with quotes and backslashes
+// escaped.
+//
+inline void writeStatsJson(ostream& out, const CompressionStats& stats,
+                           const string& name = "") {
+    out << "{";
+    if (!name.empty()) {
+        out << "\"file\": \"";
+        for (size_t i = 0; i < name.size(); i++) {
+            if (name[i] == '"' || name[i] == '\\') {
+                out << '\\';
+            }
+            out << name[i];
+        }
+        out << "\", ";
+    }
+    char buffer[640];
+    snprintf(buffer, sizeof(buffer),
+             "\"seconds\": {\"read\": %.6f, \"dedup\": %.6f, "
+             "\"count\": %.6f, \"match\": %.6f, \"transform\": %.6f, "
+             "\"tree\": %.6f, \"encode\": %.6f, \"decode\": %.6f, "
+             "\"write\": %.6f, \"total\": %.6f}, "
+             "\"bytesIn\": %llu, \"bytesOut\": %llu, \"symbols\": %llu, "
+             "\"blocks\": %llu, \"dedupBytes\": %llu, "
+             "\"storedBytes\": %llu, \"headerBytes\": %llu, "
+             "\"averageCodeLength\": %.4f, \"entropy\": %.4f, "
+             "\"peakBufferBytes\": %llu}",
+             stats.readSeconds, stats.dedupSeconds, stats.countSeconds,
+             stats.matchSeconds, stats.transformSeconds, stats.treeSeconds,
+             stats.encodeSeconds, stats.decodeSeconds, stats.writeSeconds,
+             stats.totalSeconds,
+             (unsigned long long)stats.bytesIn,
+             (unsigned long long)stats.bytesOut,
+             (unsigned long long)stats.symbols,
+             (unsigned long long)stats.blocks,
+             (unsigned long long)stats.dedupBytes,
+             (unsigned long long)stats.storedBytes,
+             (unsigned long long)stats.headerBytes,
+             stats.averageCodeLength(), stats.entropy(),
+             (unsigned long long)stats.peakBufferBytes);
+    out << buffer << endl;
+}
@@ -0,0 +1,371 @@
+//
+//  threadpool.h
+//  File Compression II
+//
+//  A fixed set of worker threads taking tasks from one shared queue.
+//  submit() returns a future, so callers that need results in order (for
+//  example blocks that must be written in sequence) keep the futures in
+//  a queue and wait on the oldest one.  OrderedSink does exactly that on a
+//  thread of its own, so that producing, processing and consuming results
+//  all overlap.
+//
+//  WorkStealingPool is for batches of tasks that spawn more tasks (a file
+//  split into blocks): every worker has a queue of its own, and a worker
+//  that runs out takes work from the others.
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+class ThreadPool {
+ public:
+    //
+    // Starts nThreads workers; 0 starts one per hardware thread.
+    //
+    explicit ThreadPool(int nThreads) : stopping(false) {
+        if (nThreads <= 0) {
+            nThreads = defaultThreads();
+        }
+        for (int i = 0; i < nThreads; i++) {
+            workers.push_back(thread(&ThreadPool::workerLoop, this));
+        }
+    }
+
+    //
+    // Finishes the tasks already queued, then joins the workers.
+    //
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(queueLock);
+            stopping = true;
+        }
+        queueReady.notify_all();
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    //
+    // Queues task and returns a future for its result.  An exception
+    // thrown by the task is rethrown by future::get.
+    //
+    template <typename Result>
+    future<Result> submit(function<Result()> task) {
+        shared_ptr<packaged_task<Result()> > packaged =
+            make_shared<packaged_task<Result()> >(task);
+        future<Result> result = packaged->get_future();
+        {
+            lock_guard<mutex> lock(queueLock);
+            tasks.push_back([packaged]() { (*packaged)(); });
+        }
+        queueReady.notify_one();
+        return result;
+    }
+
+    int size() const {
+        return (int)workers.size();
+    }
+
+    static int defaultThreads() {
+        int n = (int)thread::hardware_concurrency();
+        return n > 0 ? n : 1;
+    }
+
+ private:
+    void workerLoop() {
+        while (true) {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(queueLock);
+                queueReady.wait(lock, [this]() {
+                    return stopping || !tasks.empty();
+                });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    vector<thread> workers;
+    deque<function<void()> > tasks;
+    mutex queueLock;
+    condition_variable queueReady;
+    bool stopping;
+};
+
+
+//
+// WorkStealingPool
+// A fixed set of workers, each with its own task queue.  A task submitted
+// from one of the pool's workers goes on that worker's queue, which it runs
+// newest first, so a worker finishes the work it split up before going back
+// to older tasks; tasks submitted from outside are dealt out round-robin.
+// A worker whose queue is empty steals the oldest task of another queue.
+// Each queue has its own lock, so workers mostly do not contend.
+//
+class WorkStealingPool {
+ public:
+    //
+    // Starts nThreads workers; 0 starts one per hardware thread.
+    //
+    explicit WorkStealingPool(int nThreads)
+        : queued(0), nextQueue(0), stopping(false) {
+        if (nThreads <= 0) {
+            nThreads = ThreadPool::defaultThreads();
+        }
+        for (int i = 0; i < nThreads; i++) {
+            queues.push_back(unique_ptr<WorkQueue>(new WorkQueue()));
+        }
+        for (int i = 0; i < nThreads; i++) {
+            workers.push_back(thread(&WorkStealingPool::workerLoop, this, i));
+        }
+    }
+
+    //
+    // Finishes every task, including ones queued by tasks while stopping,
+    // then joins the workers.
+    //
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> lock(idleLock);
+            stopping = true;
+        }
+        workReady.notify_all();
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    //
+    // Queues task and returns a future for its result.  An exception
+    // thrown by the task is rethrown by future::get.
+    //
+    template <typename Result>
+    future<Result> submit(function<Result()> task) {
+        shared_ptr<packaged_task<Result()> > packaged =
+            make_shared<packaged_task<Result()> >(task);
+        future<Result> result = packaged->get_future();
+        post([packaged]() { (*packaged)(); });
+        return result;
+    }
+
+    //
+    // Queues a task nobody waits for.  It must not throw.
+    //
+    void post(function<void()> task) {
+        int worker = currentWorker(this);
+        if (worker < 0) {
+            worker = (int)(nextQueue++ % queues.size());
+        }
+        {
+            lock_guard<mutex> lock(queues[worker]->lock);
+            queues[worker]->tasks.push_back(move(task));
+        }
+        {
+            lock_guard<mutex> lock(idleLock);
+            queued++;
+        }
+        workReady.notify_one();
+    }
+
+    int size() const {
+        return (int)workers.size();
+    }
+
+ private:
+    struct WorkQueue {
+        deque<function<void()> > tasks;
+        mutex lock;
+    };
+
+    //
+    // Returns the index of the calling thread among pool's workers, or -1
+    // if it is not one of them.
+    //
+    static int currentWorker(const WorkStealingPool* pool) {
+        return currentPool() == pool ? currentIndex() : -1;
+    }
+
+    static const WorkStealingPool*& currentPool() {
+        static thread_local const WorkStealingPool* pool = nullptr;
+        return pool;
+    }
+
+    static int& currentIndex() {
+        static thread_local int index = -1;
+        return index;
+    }
+
+    //
+    // Takes the newest task of worker's own queue, or else the oldest task
+    // of the first other queue that has one.
+    //
+    bool takeTask(int worker, function<void()>& task) {
+        {
+            WorkQueue& own = *queues[worker];
+            lock_guard<mutex> lock(own.lock);
+            if (!own.tasks.empty()) {
+                task = move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            WorkQueue& other = *queues[(worker + i) % queues.size()];
+            lock_guard<mutex> lock(other.lock);
+            if (!other.tasks.empty()) {
+                task = move(other.tasks.front());
+                other.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(int worker) {
+        currentPool() = this;
+        currentIndex() = worker;
+        while (true) {
+            {
+                unique_lock<mutex> lock(idleLock);
+                workReady.wait(lock, [this]() {
+                    return stopping || queued > 0;
+                });
+                if (queued == 0) {
+                    return;
+                }
+                // claim one of the queued tasks; it is found below, since
+                // nobody else can take it
+                queued--;
+            }
+            function<void()> task;
+            while (!takeTask(worker, task)) {
+                this_thread::yield();
+            }
+            task();
+        }
+    }
+
+    vector<unique_ptr<WorkQueue> > queues;
+    vector<thread> workers;
+    size_t queued;  // tasks in all queues not yet claimed; under idleLock
+    atomic<size_t> nextQueue;
+    mutex idleLock;
+    condition_variable workReady;
+    bool stopping;
+};
+
+
+//
+// OrderedSink
+// Waits on futures in the order they were pushed and hands each result to
+// consume() on a dedicated thread.  push() blocks while capacity results
+// are already waiting, which bounds the memory held by results in flight.
+// If consume() or a task throws, later results are still waited on but
+// discarded, and finish() rethrows the first exception.
+//
+template <typename Result>
+class OrderedSink {
+ public:
+    OrderedSink(size_t capacity, function<void(Result&)> consume)
+        : capacity(capacity), consume(consume), closed(false) {
+        consumer = thread(&OrderedSink::consumerLoop, this);
+    }
+
+    ~OrderedSink() {
+        if (consumer.joinable()) {
+            close();
+            consumer.join();
+        }
+    }
+
+    OrderedSink(const OrderedSink&) = delete;
+    OrderedSink& operator=(const OrderedSink&) = delete;
+
+    void push(future<Result> result) {
+        unique_lock<mutex> lock(queueLock);
+        spaceReady.wait(lock, [this]() {
+            return pending.size() < capacity;
+        });
+        pending.push_back(move(result));
+        itemReady.notify_one();
+    }
+
+    //
+    // Waits until every pushed result has been consumed.
+    //
+    void finish() {
+        close();
+        consumer.join();
+        if (failure) {
+            rethrow_exception(failure);
+        }
+    }
+
+ private:
+    void close() {
+        lock_guard<mutex> lock(queueLock);
+        closed = true;
+        itemReady.notify_one();
+    }
+
+    void consumerLoop() {
+        while (true) {
+            future<Result> next;
+            {
+                unique_lock<mutex> lock(queueLock);
+                itemReady.wait(lock, [this]() {
+                    return closed || !pending.empty();
+                });
+                if (pending.empty()) {
+                    return;
+                }
+                next = move(pending.front());
+                pending.pop_front();
+                spaceReady.notify_one();
+            }
+            try {
+                Result result = next.get();
+                if (!failure) {
+                    consume(result);
+                }
+            } catch (...) {
+                if (!failure) {
+                    failure = current_exception();
+                }
+            }
+        }
+    }
+
+    size_t capacity;
+    function<void(Result&)> consume;
+    deque<future<Result> > pending;
+    mutex queueLock;
+    condition_variable itemReady;
+    condition_variable spaceReady;
+    bool closed;
+    exception_ptr failure;  // only touched by the consumer until joined
+    thread consumer;
+};
@@ -6,14 +6,31 @@
 #include <vector>         // std::vector
 #include <functional>     // std::greater
 #include <string>
+#include <algorithm>
+#include <sstream>
+#include <memory>
+#include <atomic>
 #include "bitstream.h"
 #include "hashmap.h"
 #include "mymap.h"
+#include "hufftable.h"
+#include "container.h"
+#include "histogram.h"
+#include "threadpool.h"
+#include "fileio.h"
+#include "codelengths.h"
+#include "stats.h"
+#include "blocksplit.h"
+#include "context.h"
+#include "lz77.h"
+#include "dedup.h"
+#include "bwt.h"
+#include "fse.h"
 #pragma once
 
 struct HuffmanNode {
     int character;
-    int count;
+    uint64_t count;
     HuffmanNode* zero;
     HuffmanNode* one;
 };
@@ -43,37 +60,35 @@ void freeTree(HuffmanNode* node) {
 //
 // *This function build the frequency map.  If isFile is true, then it reads
 // from filename.  If isFile is false, then it reads from a string filename.
+// The bytes are counted in a flat histogram first, so the map is only touched
+// once per distinct character.
 //
 void buildFrequencyMap(string filename, bool isFile, hashmap &map) {
+    Histogram histogram;
     if (!isFile) {
-        for (char c : filename) {
-            if (map.containsKey(c)) {
-                int freq = map.get(c);
-                freq++;
-                map.put(c, freq);
-            } else {
-                map.put(c, 1);
-            }
-        }
+        countBytes((const unsigned char*)filename.data(), filename.size(),
+                   histogram);
     } else {
-        ifstream inFS(filename);
-        char c;
-        while (inFS.get(c)) {
-            if (map.containsKey(c)) {
-                int freq = map.get(c);
-                freq++;
-                map.put(c, freq);
-            } else {
-                map.put(c, 1);
-            }
+        ifstream inFS(filename, ios::binary);
+        countStream(inFS, histogram);
+    }
+    for (int i = 0; i < 256; i++) {
+        if (histogram.counts[i] == 0) {
+            continue;
         }
+        int c = indexCharacter(i);
+        int freq = map.containsKey(c) ? map.get(c) : 0;
+        map.put(c, freq + (int)histogram.counts[i]);
     }
     map.put(PSEUDO_EOF, 1);
 }
 
 
 //
-// *This function builds an encoding tree from the frequency map.
+// *This function builds an encoding tree from the frequency map.  Files with
+// the textual frequency map header are decoded with this tree, so how it
+// breaks ties must not change.  Ties depend on the order of keys(), which is
+// the order the header lists them in when the map was read with >>.
 //
 HuffmanNode* buildEncodingTree(hashmap &map) {
     vector<int> allKeys = map.keys();
@@ -136,50 +151,208 @@ mymap <int, string> buildEncodingMap(HuffmanNode* tree) {
     return encodingMap;
 }
 
+//
+// *This function recursively records the depth of every leaf as its code
+// length.
+//
+void _buildCodeLengths(HuffmanNode* node, int depth, vector<int>& lengths) {
+    if (node == nullptr) {
+        return;
+    } else if (node->character != NOT_A_CHAR) {
+        lengths[symbolIndex(node->character)] = depth;
+        return;
+    }
+    _buildCodeLengths(node->zero, depth + 1, lengths);
+    _buildCodeLengths(node->one, depth + 1, lengths);
+}
+
+
+//
+// *This function returns the code length of every symbol (indexed by
+// symbolIndex) in the encoding tree, 0 for symbols not in the tree.  A tree
+// with a single leaf gets a 1-bit code so that every used symbol has a
+// nonzero length.
+//
+vector<int> buildCodeLengths(HuffmanNode* tree) {
+    vector<int> lengths(NUM_SYMBOLS, 0);
+    _buildCodeLengths(tree, 0, lengths);
+    if (tree != nullptr && tree->character != NOT_A_CHAR) {
+        lengths[symbolIndex(tree->character)] = 1;
+    }
+    return lengths;
+}
+
+
+//
+// *This function builds the encoding map of the canonical code with the given
+// code lengths.  The map is keyed the same way as one built by
+// buildEncodingMap, so it can be passed to encode().  The codes are sorted
+// by character first, so the map is built in one balanced pass.
+//
+mymap <int, string> buildCanonicalEncodingMap(const vector<int>& lengths) {
+    mymap <int, string> encodingMap;
+    vector<uint64_t> codes;
+    if (!canonicalCodes(lengths, codes)) {
+        throw runtime_error("BAD CODE LENGTHS");
+    }
+    vector<pair<int, string> > entries;
+    for (int i = 0; i < (int)lengths.size(); i++) {
+        if (lengths[i] > 0) {
+            string value;
+            for (int bit = 0; bit < lengths[i]; bit++) {
+                value += ((codes[i] >> bit) & 1) ? '1' : '0';
+            }
+            entries.push_back(make_pair(indexCharacter(i), value));
+        }
+    }
+    sort(entries.begin(), entries.end());
+    encodingMap.buildFromSorted(entries);
+    return encodingMap;
+}
+
+
+//
+// *This function fills a flat encoding table from an encoding map, so that
+// encoding does not look every byte up in the map.  Throws a runtime_error
+// if a code is too long for the table.
+//
+void buildEncodeTable(mymap <int, string> &encodingMap,
+                      HuffmanEncodeTable &table) {
+    table.clear();
+    for (int i = 0; i < NUM_SYMBOLS; i++) {
+        int c = indexCharacter(i);
+        if (encodingMap.contains(c) && !table.set(c, encodingMap.get(c))) {
+            throw runtime_error("CODE TOO LONG");
+        }
+    }
+}
+
+
+//
+// *This function appends the code of a table entry to bits as '0' and '1'
+// characters.
+//
+void _appendCode(const HuffmanEncodeTable::Entry &entry, string* bits) {
+    for (int bit = 0; bit < entry.length; bit++) {
+        *bits += ((entry.code >> bit) & 1) ? '1' : '0';
+    }
+}
+
+
+//
+// *This function writes the codes of length bytes of data to output (if it is
+// not null) and appends them to bits (if it is not null), adding the number
+// of bits to size.  Characters without a code are skipped.
+//
+void _encodeBytes(const char* data, size_t length,
+                  const HuffmanEncodeTable &table, obitstream* output,
+                  long long &size, string* bits) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < length; i++) {
+        const HuffmanEncodeTable::Entry& e = table[bytes[i]];
+        size += e.length;
+        if (output != nullptr) {
+            output->writeBits(e.code, e.length);
+        }
+        if (bits != nullptr) {
+            _appendCode(e, bits);
+        }
+    }
+}
+
+
 //
 // *This function encodes the data in the input stream into the output stream
-// using the encodingMap.  This function calculates the number of bits
-// written to the output stream and sets result to the size parameter, which is
-// passed by reference.  This function also returns a string representation of
-// the output file, which is particularly useful for testing.
+// using the encodingMap.  The input is read in fixed-size chunks and each code
+// is written as soon as it is looked up, so memory use does not grow with the
+// input.  This function calculates the number of bits written to the output
+// stream and sets result to the size parameter, which is passed by reference.
+// If makeString is true, this function also returns a string representation
+// of the output file, which is particularly useful for testing; otherwise it
+// returns an empty string.
 //
 string encode(ifstream& input, mymap <int, string> &encodingMap,
-              ofbitstream& output, int &size, bool makeFile) {
-    char c;
+              ofbitstream& output, long long &size, bool makeFile,
+              bool makeString = true) {
     string binaryString = "";
-    while (input.get(c)) {
-        if (encodingMap.contains(c)) {
-            binaryString += encodingMap.get(c);
-        }
-    }
-    
-    binaryString += encodingMap.get(PSEUDO_EOF);
+    string* bits = makeString ? &binaryString : nullptr;
+    obitstream* out = makeFile ? &output : nullptr;
+    HuffmanEncodeTable table;
+    buildEncodeTable(encodingMap, table);
+    vector<char> chunk(BitReader::CHUNK_SIZE);
+    size = 0;
 
-    size =  binaryString.size();
+    while (input.read(chunk.data(), chunk.size()) || input.gcount() > 0) {
+        _encodeBytes(chunk.data(), input.gcount(), table, out, size, bits);
+    }
+    const HuffmanEncodeTable::Entry& eof = table[symbolIndex(PSEUDO_EOF)];
+    size += eof.length;
     if (makeFile) {
-        for (char c : binaryString) {
-            if (c == '0') {
-                output.writeBit(0);
-            } else {
-                output.writeBit(1);
-            }
-        }
+        output.writeBits(eof.code, eof.length);
+        output.flushBits();
+    }
+    if (makeString) {
+        _appendCode(eof, bits);
     }
     return binaryString;
 }
 
 
 //
-// *This function decodes the input stream and writes the result to the output
-// stream using the encodingTree.  This function also returns a string
-// representation of the output file, which is particularly useful for testing.
+// *This function recursively collects the code of every leaf below node.
+// Codes are built in stream order (the first bit taken from the root is bit
+// 0), which is the order the decoding table expects.
 //
-string decode(ifbitstream &input, HuffmanNode* encodingTree, ofstream &output) {
+void _collectCodes(HuffmanNode* node, uint64_t code, int length,
+                   vector<int>& symbols, vector<uint64_t>& codes,
+                   vector<int>& lengths) {
+    if (node == nullptr) {
+        return;
+    } else if (node->character != NOT_A_CHAR) {
+        symbols.push_back(node->character);
+        codes.push_back(code);
+        lengths.push_back(length);
+        return;
+    }
+    uint64_t oneBit = (length < 64) ? (uint64_t(1) << length) : 0;
+    _collectCodes(node->zero, code, length + 1, symbols, codes, lengths);
+    _collectCodes(node->one, code | oneBit, length + 1, symbols, codes,
+                  lengths);
+}
+
+
+//
+// *This function builds a table-driven decoder for the codes of the encoding
+// tree.  It returns false if the tree is too deep for the table, in which
+// case the tree itself has to be walked.
+//
+bool buildDecodingTable(HuffmanNode* tree, HuffmanDecodeTable &table) {
+    vector<int> symbols;
+    vector<uint64_t> codes;
+    vector<int> lengths;
+    _collectCodes(tree, 0, 0, symbols, codes, lengths);
+    return table.build(symbols, codes, lengths);
+}
+
+
+//
+// *This function decodes the input stream by walking the encoding tree one
+// bit at a time.  It is only used for trees deeper than the decoding table
+// supports.
+//
+string decodeBitwise(istream &input, HuffmanNode* encodingTree,
+                     ostream &output) {
+    BitReader reader(input);
     HuffmanNode* curr = encodingTree;
     HuffmanNode* root = encodingTree;
     string outputFile;
-    while (!input.eof()) {
-        int bit = input.readBit();
+    while (true) {
+        reader.refill();
+        int bit = reader.peek(1);
+        reader.consume(1);
+        if (reader.overrun()) {
+            break;
+        }
         if (bit == 0) {
             curr = curr->zero;
         } else {
@@ -199,72 +372,1667 @@ string decode(ifbitstream &input, HuffmanNode* encodingTree, ofstream &output) {
 }
 
 
+//
+// *This function runs decoder over the input stream, writing the result to the
+// output stream in large chunks.  Decoding stops at PSEUDO_EOF or when the
+// input runs out.
+//
+template <typename Decoder>
+string _decodeStream(istream &input, const Decoder &decoder,
+                     ostream &output) {
+    BitReader reader(input);
+    string outputFile;
+    vector<char> buffer(BitReader::CHUNK_SIZE);
+    size_t n;
+    do {
+        n = decoder.decode(reader, buffer.data(), buffer.size());
+        output.write(buffer.data(), n);
+        outputFile.append(buffer.data(), n);
+    } while (n == buffer.size());
+    return outputFile;
+}
+
+
+//
+// *This function decodes the input stream with a decoding table, resolving a
+// whole code per lookup.
+//
+string decodeTable(istream &input, const HuffmanDecodeTable &table,
+                   ostream &output) {
+    return _decodeStream(input, table, output);
+}
+
+
+//
+// *This function decodes a payload coded with the encodingTree, through a
+// decoding table when the tree is shallow enough.
+//
+string decodeTree(istream &input, HuffmanNode* encodingTree, ostream &output) {
+    HuffmanDecodeTable table;
+    if (!buildDecodingTable(encodingTree, table)) {
+        return decodeBitwise(input, encodingTree, output);
+    }
+    return decodeTable(input, table, output);
+}
+
+
+//
+// *This function decodes the input stream and writes the result to the output
+// stream using the encodingTree.  This function also returns a string
+// representation of the output file, which is particularly useful for testing.
+//
+string decode(ifbitstream &input, HuffmanNode* encodingTree, ofstream &output) {
+    return decodeTree(input, encodingTree, output);
+}
+
+
+//
+// *This struct holds the settings of a block compression run.
+//
+struct CompressOptions {
+    int threads;        // worker threads; 0 for one per core
+    size_t blockSize;   // input bytes per block
+    int maxCodeLength;  // longest code allowed; 0 for no limit
+    bool splitBlocks;   // split blocks where the content changes (slower)
+    int contextTables;  // most tables of an order-1 block; 0 for order-0
+    int lzLevel;        // LZ77 effort (1 to LZ_MAX_LEVEL); 0 for none
+    bool bwt;           // try Burrows-Wheeler blocks (slower)
+    bool fse;           // code order-0 blocks with tANS where it is smaller
+    int dedupWindowLog; // log2 of how far back duplicate chunks are found;
+                        // 0 for no deduplication
+    CompressionStats* stats;  // filled in if not null
+
+    CompressOptions()
+        : threads(1), blockSize(1 << 20),
+          maxCodeLength(DEFAULT_CODE_LENGTH_LIMIT), splitBlocks(false),
+          contextTables(0), lzLevel(0), bwt(false), fse(false),
+          dedupWindowLog(0), stats(nullptr) {
+    }
+};
+
+
+//
+// *This function sets lengths to the Huffman code lengths of the histogram,
+// none longer than maxCodeLength (0 for no limit).
+//
+void _blockCodeLengths(const Histogram &histogram, int maxCodeLength,
+                       vector<int> &lengths) {
+    HuffmanBuilder builder;
+    builder.build(histogram.counts);
+    builder.codeLengths(lengths);
+    limitCodeLengths(histogram, lengths, maxCodeLength);
+}
+
+
+//
+// *This function returns the number of payload bits the symbols counted in
+// histogram take with the given code lengths, or UINT64_MAX if one of them
+// has no code.
+//
+uint64_t _payloadBits(const Histogram &histogram, const vector<int> &lengths) {
+    uint64_t payloadBits = 0;
+    for (int i = 0; i < NUM_SYMBOLS; i++) {
+        if (histogram.counts[i] > 0 && lengths[i] == 0) {
+            return UINT64_MAX;
+        }
+        payloadBits += histogram.counts[i] * lengths[i];
+    }
+    return payloadBits;
+}
+
+
+//
+// *This function adds a block of length symbols (counted in histogram) to
+// stats, if stats is not null: headerBytes of block header and payloadBits
+// of payload.
+//
+void _addBlockStats(CompressionStats* stats, size_t length,
+                    const Histogram &histogram, size_t headerBytes,
+                    uint64_t payloadBits) {
+    if (stats == nullptr) {
+        return;
+    }
+    stats->symbols += length;
+    stats->blocks++;
+    stats->headerBytes += headerBytes;
+    stats->payloadBits += payloadBits;
+    stats->entropyBits += histogramEntropyBits(histogram);
+}
+
+
+//
+// *This function returns the length bytes of data (counted in histogram) as
+// a MODEL_STORED block.  With payload false the block stops after its
+// header, and the caller writes the bytes after it.  bits and stats are as
+// for _encodeBlock.
+//
+string _encodeStoredBlock(const char* data, size_t length,
+                          const Histogram &histogram, bool payload,
+                          string* bits, CompressionStats* stats) {
+    BlockHeader header;
+    header.model = MODEL_STORED;
+    header.rawLength = (uint32_t)length;
+    header.payloadLength = (uint32_t)length;
+    ostringstream block;
+    writeBlockHeader(block, header);
+    if (payload) {
+        block.write(data, length);
+    }
+    if (bits != nullptr) {
+        for (size_t i = 0; i < length; i++) {
+            HuffmanEncodeTable::Entry byte = {(unsigned char)data[i], 8};
+            _appendCode(byte, bits);
+        }
+    }
+    STATS_ONLY(
+        _addBlockStats(stats, length, histogram,
+                       block.str().size() - (payload ? length : 0),
+                       8 * (uint64_t)length);
+        if (stats != nullptr) {
+            stats->storedBytes += length;
+        }
+    )
+    return block.str();
+}
+
+
+// blocks shorter than this keep one stream, since the jump table and the
+// padding of every stream would cost more than faster decoding is worth
+const size_t SUBSTREAM_MIN_LENGTH = 16 * 1024;
+
+//
+// *This function returns how many sub-streams a block of length bytes is
+// split into.
+//
+int _blockStreams(size_t length) {
+    return length >= SUBSTREAM_MIN_LENGTH ? SUBSTREAMS : 1;
+}
+
+//
+// *This function encodes the length bytes of data (counted in histogram)
+// behind header, whose code lengths (and sameLengths) must already be set,
+// and returns the block.  The payload is split into streams sub-streams (1
+// or SUBSTREAMS); 0 picks SUBSTREAMS for blocks of at least
+// SUBSTREAM_MIN_LENGTH bytes.  A payload too long for the header's 32-bit
+// lengths is stored instead (see _encodeStoredBlock), leaving header with
+// no code lengths.
+//
+string _encodeBlock(const char* data, size_t length,
+                    const Histogram &histogram, BlockHeader &header,
+                    string* bits, CompressionStats* stats, int streams = 0) {
+    HuffmanEncodeTable table;
+    {
+        STATS_TIMER(stats, treeSeconds);
+        table.build(header.codeLengths);
+    }
+    if (streams == 0) {
+        streams = _blockStreams(length);
+    }
+    size_t bounds[SUBSTREAMS + 1] = {0, length};
+    vector<uint64_t> streamBits(1, 0);
+    uint64_t payloadBits = _payloadBits(histogram, header.codeLengths);
+    uint64_t payloadBytes = (payloadBits + 7) / 8;
+    header.rawLength = (uint32_t)length;
+    header.streams = streams;
+    header.streamLengths.clear();
+    if (streams > 1) {
+        subStreamBounds(length, bounds);
+        streamBits.clear();
+        payloadBytes = 0;
+        for (int k = 0; k < streams; k++) {
+            Histogram part;
+            countBytes((const unsigned char*)data + bounds[k],
+                       bounds[k + 1] - bounds[k], part);
+            streamBits.push_back(_payloadBits(part, header.codeLengths));
+            uint64_t bytes = (streamBits.back() + 7) / 8;
+            if (k + 1 < streams) {
+                header.streamLengths.push_back((uint32_t)bytes);
+            }
+            payloadBytes += bytes;
+        }
+    }
+    if (payloadBytes > UINT32_MAX) {
+        // the header's 32-bit lengths (each stream's is part of the
+        // payload's) cannot hold codes this long, but a block's own bytes
+        // always fit
+        header = BlockHeader();
+        return _encodeStoredBlock(data, length, histogram, true, bits,
+                                  stats);
+    }
+    header.payloadLength = (uint32_t)payloadBytes;
+
+    string block;
+    {
+        STATS_TIMER(stats, encodeSeconds);
+        ostringbitstream output;
+        writeBlockHeader(output, header);
+        long long size = 0;
+        for (int k = 0; k < streams; k++) {
+            _encodeBytes(data + bounds[k], bounds[k + 1] - bounds[k], table,
+                         &output, size, bits);
+            // every stream starts on a byte
+            output.writeBits(0, (8 - streamBits[k] % 8) % 8);
+        }
+        block = output.str();
+    }
+    STATS_ONLY(
+        _addBlockStats(stats, length, histogram,
+                       block.size() - header.payloadLength, payloadBits);
+    )
+    return block;
+}
+
+
+//
+// *This function decides whether the length bytes of data (counted in
+// histogram) are better coded as an order-1 block (see context.h) with at
+// most options.contextTables tables.  clusterContexts only estimates that
+// from entropies, which a Huffman code cannot reach (no code is shorter
+// than a bit), so the tables it picks are built and their payload and
+// header bits compared with those of one order-0 code.  If order-1 wins,
+// it sets the model, context map and code lengths of header and returns
+// true.  If stats is not null, the time taken is added to it.
+//
+bool _contextCodeLengths(const char* data, size_t length,
+                         const Histogram &histogram,
+                         const CompressOptions &options, BlockHeader &header,
+                         CompressionStats* stats) {
+    vector<Histogram> contexts;
+    {
+        STATS_TIMER(stats, countSeconds);
+        countContexts((const unsigned char*)data, length,
+                      _blockStreams(length), contexts);
+    }
+    STATS_TIMER(stats, treeSeconds);
+    vector<Histogram> clusters;
+    BlockHeader order1;
+    if (!clusterContexts(contexts, options.contextTables, order1.contextMap,
+                         clusters)) {
+        return false;
+    }
+    // one builder for every table, so building them allocates nothing
+    HuffmanBuilder builder;
+    order1.model = MODEL_ORDER1;
+    order1.contextLengths.assign(clusters.size(), vector<int>());
+    uint64_t order1Bits = 0;
+    for (size_t t = 0; t < clusters.size(); t++) {
+        builder.build(clusters[t].counts);
+        builder.codeLengths(order1.contextLengths[t]);
+        limitCodeLengths(clusters[t], order1.contextLengths[t],
+                         options.maxCodeLength);
+        order1Bits += _payloadBits(clusters[t], order1.contextLengths[t]);
+    }
+    // (both would have the same sub-streams, so neither counts them)
+    BlockHeader order0;
+    _blockCodeLengths(histogram, options.maxCodeLength, order0.codeLengths);
+    if (order1Bits + 8 * blockHeaderSize(order1) >=
+        _payloadBits(histogram, order0.codeLengths) +
+        8 * blockHeaderSize(order0)) {
+        return false;
+    }
+    header.model = MODEL_ORDER1;
+    header.contextMap.swap(order1.contextMap);
+    header.contextLengths.swap(order1.contextLengths);
+    header.codeLengths.clear();
+    header.sameLengths = false;
+    return true;
+}
+
+
+//
+// *This function encodes the length bytes of data (counted in histogram) as
+// an order-1 block behind header, whose context map and code lengths must
+// already be set (see _contextCodeLengths), and returns the block.  A
+// payload too long for the header is stored instead, as in _encodeBlock.
+//
+string _encodeContextBlock(const char* data, size_t length,
+                           const Histogram &histogram, BlockHeader &header,
+                           string* bits, CompressionStats* stats) {
+    vector<HuffmanEncodeTable> tables(header.contextLengths.size());
+    const HuffmanEncodeTable* byContext[NUM_CONTEXTS];
+    {
+        STATS_TIMER(stats, treeSeconds);
+        for (size_t t = 0; t < tables.size(); t++) {
+            tables[t].build(header.contextLengths[t]);
+        }
+        for (int c = 0; c < NUM_CONTEXTS; c++) {
+            byContext[c] = &tables[header.contextMap[c]];
+        }
+    }
+    const unsigned char* bytes = (const unsigned char*)data;
+    int streams = _blockStreams(length);
+    size_t bounds[SUBSTREAMS + 1] = {0, length};
+    if (streams > 1) {
+        subStreamBounds(length, bounds);
+    }
+
+    string block;
+    uint64_t payloadBits = 0;
+    {
+        STATS_TIMER(stats, encodeSeconds);
+        uint64_t streamBits[SUBSTREAMS];
+        header.rawLength = (uint32_t)length;
+        header.streams = streams;
+        header.streamLengths.clear();
+        uint64_t payloadBytes = 0;
+        for (int k = 0; k < streams; k++) {
+            int previous = 0;
+            streamBits[k] = 0;
+            for (size_t i = bounds[k]; i < bounds[k + 1]; i++) {
+                streamBits[k] += (*byContext[previous])[bytes[i]].length;
+                previous = bytes[i];
+            }
+            uint64_t streamBytes = (streamBits[k] + 7) / 8;
+            if (k + 1 < streams) {
+                header.streamLengths.push_back((uint32_t)streamBytes);
+            }
+            payloadBytes += streamBytes;
+            payloadBits += streamBits[k];
+        }
+        if (payloadBytes > UINT32_MAX) {
+            // as in _encodeBlock
+            header = BlockHeader();
+            return _encodeStoredBlock(data, length, histogram, true, bits,
+                                      stats);
+        }
+        header.payloadLength = (uint32_t)payloadBytes;
+
+        ostringbitstream output;
+        writeBlockHeader(output, header);
+        for (int k = 0; k < streams; k++) {
+            int previous = 0;
+            for (size_t i = bounds[k]; i < bounds[k + 1]; i++) {
+                const HuffmanEncodeTable::Entry& e =
+                    (*byContext[previous])[bytes[i]];
+                output.writeBits(e.code, e.length);
+                if (bits != nullptr) {
+                    _appendCode(e, bits);
+                }
+                previous = bytes[i];
+            }
+            // every stream starts on a byte
+            output.writeBits(0, (8 - streamBits[k] % 8) % 8);
+        }
+        block = output.str();
+    }
+    STATS_ONLY(
+        _addBlockStats(stats, length, histogram,
+                       block.size() - header.payloadLength, payloadBits);
+    )
+    return block;
+}
+
+
+//
+// *This function sets the table log and normalized counts of header for an
+// FSE block (see fse.h) of the length bytes counted in histogram, and
+// returns the bits that block would take, header included, as estimated
+// from them.  Of the table logs worth trying, it picks the one that makes
+// the block smallest: a larger table lets rare bytes take less from common
+// ones, but has more counts to write.
+//
+double _fseBlockBits(const Histogram &histogram, size_t length,
+                     BlockHeader &header) {
+    int distinct = 0;
+    for (int s = 0; s < 256; s++) {
+        distinct += (histogram.counts[s] > 0);
+    }
+    BlockHeader candidate;
+    candidate.model = MODEL_FSE;
+    double best = HUGE_VAL;
+    for (candidate.fseTableLog = fseMinTableLog(distinct);
+         candidate.fseTableLog <= fseMaxTableLog(length, distinct);
+         candidate.fseTableLog++) {
+        normalizeCounts(histogram.counts, candidate.fseTableLog,
+                        candidate.fseCounts);
+        double bits = fseCostBits(histogram.counts, candidate.fseCounts,
+                                  candidate.fseTableLog) +
+                      FSE_STATES * candidate.fseTableLog +
+                      8.0 * blockHeaderSize(candidate);
+        if (bits < best) {
+            best = bits;
+            header = candidate;
+        }
+    }
+    return best;
+}
+
+
+//
+// *This function returns true if an FSE block of the length bytes counted
+// in histogram would be no bigger than the block of payloadBits behind
+// header, in which case a model that only beats an order-0 Huffman block
+// should make way for it.
+//
+bool _fseIsSmaller(const Histogram &histogram, size_t length,
+                   const BlockHeader &header, uint64_t payloadBits) {
+    BlockHeader fse;
+    return _fseBlockBits(histogram, length, fse) <=
+           payloadBits + 8.0 * blockHeaderSize(header);
+}
+
+
+//
+// *This function codes the length bytes of data (counted in histogram) as
+// an LZ77 block (see lz77.h) at effort options.lzLevel behind header and
+// returns the block, or returns an empty string if the block would not
+// be smaller than an order-0 block (or, with options.fse, an FSE one).
+//
+string _encodeLzBlock(const char* data, size_t length,
+                      const Histogram &histogram,
+                      const CompressOptions &options, BlockHeader &header,
+                      string* bits, CompressionStats* stats) {
+    vector<LzToken> tokens;
+    {
+        STATS_TIMER(stats, matchSeconds);
+        lzParse((const unsigned char*)data, length, options.lzLevel, tokens);
+    }
+    HuffmanEncodeTable literals;
+    HuffmanEncodeTable distances;
+    uint64_t payloadBits = 0;
+    {
+        STATS_TIMER(stats, treeSeconds);
+        uint64_t literalCounts[LZ_LITLEN_SYMBOLS];
+        uint64_t distanceCounts[LZ_DISTANCE_SYMBOLS];
+        payloadBits = countLzTokens(tokens, literalCounts, distanceCounts);
+        int maxLength = effectiveCodeLengthLimit(options.maxCodeLength);
+        HuffmanBuilder builder;
+        builder.build(literalCounts, LZ_LITLEN_SYMBOLS);
+        builder.codeLengths(header.literalLengths);
+        limitCodeLengths(literalCounts, header.literalLengths, maxLength);
+        builder.build(distanceCounts, LZ_DISTANCE_SYMBOLS);
+        builder.codeLengths(header.distanceLengths);
+        limitCodeLengths(distanceCounts, header.distanceLengths, maxLength);
+        for (int i = 0; i < LZ_LITLEN_SYMBOLS; i++) {
+            payloadBits += literalCounts[i] * header.literalLengths[i];
+        }
+        for (int i = 0; i < LZ_DISTANCE_SYMBOLS; i++) {
+            payloadBits += distanceCounts[i] * header.distanceLengths[i];
+        }
+        literals.build(header.literalLengths);
+        distances.build(header.distanceLengths);
+    }
+    header.model = MODEL_LZ77;
+    header.codeLengths.clear();
+    header.sameLengths = false;
+    header.rawLength = (uint32_t)length;
+    header.payloadLength = (uint32_t)((payloadBits + 7) / 8);
+    header.streams = 1;
+    header.streamLengths.clear();
+    // an order-0 header is about as big, so payloads can be compared
+    vector<int> order0;
+    {
+        STATS_TIMER(stats, treeSeconds);
+        _blockCodeLengths(histogram, options.maxCodeLength, order0);
+    }
+    if (payloadBits >= _payloadBits(histogram, order0) ||
+        (options.fse && _fseIsSmaller(histogram, length, header,
+                                      payloadBits))) {
+        header = BlockHeader();
+        return "";
+    }
+
+    string block;
+    {
+        STATS_TIMER(stats, encodeSeconds);
+        ostringbitstream output;
+        writeBlockHeader(output, header);
+        writeLzTokens(tokens, literals, distances, output, bits);
+        output.writeBits(0, (8 - payloadBits % 8) % 8);
+        block = output.str();
+    }
+    STATS_ONLY(
+        _addBlockStats(stats, length, histogram,
+                       block.size() - header.payloadLength, payloadBits);
+    )
+    return block;
+}
+
+
+//
+// *This function codes the length bytes of data (counted in histogram) as
+// a BWT block (see bwt.h) behind header and returns the block, or returns
+// an empty string if the block is too long for one or would not be
+// smaller than an order-0 block (or, with options.fse, an FSE one).
+//
+string _encodeBwtBlock(const char* data, size_t length,
+                       const Histogram &histogram,
+                       const CompressOptions &options, BlockHeader &header,
+                       string* bits, CompressionStats* stats) {
+    if (length > BWT_MAX_LENGTH) {
+        return "";
+    }
+    vector<uint16_t> symbols;
+    uint64_t counts[BWT_SYMBOLS];
+    {
+        STATS_TIMER(stats, transformSeconds);
+        vector<unsigned char> transformed(length);
+        vector<int32_t> sa;
+        bwtForward((const unsigned char*)data, length, transformed.data(),
+                   header.bwtRows, sa);
+        bwtSymbols(transformed.data(), length, symbols, counts);
+    }
+    HuffmanEncodeTable table;
+    uint64_t payloadBits = 0;
+    vector<int> order0;
+    {
+        STATS_TIMER(stats, treeSeconds);
+        int maxLength = effectiveCodeLengthLimit(options.maxCodeLength);
+        HuffmanBuilder builder;
+        builder.build(counts, BWT_SYMBOLS);
+        builder.codeLengths(header.bwtLengths);
+        limitCodeLengths(counts, header.bwtLengths, maxLength);
+        for (int i = 0; i < BWT_SYMBOLS; i++) {
+            payloadBits += counts[i] * header.bwtLengths[i];
+        }
+        table.build(header.bwtLengths);
+        _blockCodeLengths(histogram, options.maxCodeLength, order0);
+    }
+    // the header is an order-0 one plus the rows
+    if (payloadBits + 32 * BWT_CHAINS >= _payloadBits(histogram, order0)) {
+        header = BlockHeader();
+        return "";
+    }
+    header.model = MODEL_BWT;
+    header.codeLengths.clear();
+    header.sameLengths = false;
+    header.rawLength = (uint32_t)length;
+    header.payloadLength = (uint32_t)((payloadBits + 7) / 8);
+    header.streams = 1;
+    header.streamLengths.clear();
+    if (options.fse && _fseIsSmaller(histogram, length, header,
+                                     payloadBits)) {
+        header = BlockHeader();
+        return "";
+    }
+
+    string block;
+    {
+        STATS_TIMER(stats, encodeSeconds);
+        ostringbitstream output;
+        writeBlockHeader(output, header);
+        writeBwtSymbols(symbols, table, output, bits);
+        output.writeBits(0, (8 - payloadBits % 8) % 8);
+        block = output.str();
+    }
+    STATS_ONLY(
+        _addBlockStats(stats, length, histogram,
+                       block.size() - header.payloadLength, payloadBits);
+    )
+    return block;
+}
+
+
+
+//
+// *This function encodes the length bytes of data (counted in histogram) as
+// an FSE block behind header, whose normalized counts must already be set
+// (see _fseBlockBits), and returns the block.  bits and stats are as for
+// _encodeBlock.
+//
+string _encodeFseBlock(const char* data, size_t length,
+                       const Histogram &histogram, BlockHeader &header,
+                       string* bits, CompressionStats* stats) {
+    FseEncoder encoder;
+    {
+        STATS_TIMER(stats, treeSeconds);
+        encoder.build(header.fseCounts, header.fseTableLog);
+    }
+    header.model = MODEL_FSE;
+    header.codeLengths.clear();
+    header.sameLengths = false;
+    header.rawLength = (uint32_t)length;
+    header.streams = 1;
+    header.streamLengths.clear();
+
+    string block;
+    uint64_t payloadBits;
+    {
+        STATS_TIMER(stats, encodeSeconds);
+        vector<uint32_t> steps;
+        uint32_t states[FSE_STATES];
+        payloadBits = encoder.encode((const unsigned char*)data, length,
+                                     steps, states);
+        header.payloadLength = (uint32_t)((payloadBits + 7) / 8);
+        ostringbitstream output;
+        writeBlockHeader(output, header);
+        encoder.write(steps, states, output, bits);
+        output.writeBits(0, (8 - payloadBits % 8) % 8);
+        block = output.str();
+    }
+    STATS_ONLY(
+        _addBlockStats(stats, length, histogram,
+                       block.size() - header.payloadLength, payloadBits);
+    )
+    return block;
+}
+
+
+// bytes carrying at least this many bits each are stored without building
+// a code for them: an order-0 code could save at most 1/512 of the block,
+// and rounding its codes to whole bits mostly eats even that
+const double STORED_BITS_PER_BYTE = 8 - 1.0 / 512;
+
+//
+// *This function returns whether the length bytes counted in histogram are
+// better stored as they are (see _encodeStoredBlock) than coded.  Their
+// entropy is checked first, so nearly uniform bytes (compressed, encrypted
+// or media data) are stored without building a code at all; otherwise they
+// are stored if their order-0 code (or FSE block, with options.fse), header
+// included, would not be smaller.  If stats is not null, the time taken is
+// added to it.
+//
+bool _storeBlock(const Histogram &histogram, size_t length,
+                 const CompressOptions &options, CompressionStats* stats) {
+    STATS_TIMER(stats, treeSeconds);
+    if (histogramEntropyBits(histogram) >= STORED_BITS_PER_BYTE * length) {
+        return true;
+    }
+    BlockHeader header;
+    _blockCodeLengths(histogram, options.maxCodeLength, header.codeLengths);
+    header.streams = _blockStreams(length);
+    header.streamLengths.assign(header.streams - 1, 0);
+    BlockHeader stored;
+    stored.model = MODEL_STORED;
+    uint64_t storedBits = 8 * (length + blockHeaderSize(stored));
+    if (_payloadBits(histogram, header.codeLengths) +
+            8 * blockHeaderSize(header) < storedBits) {
+        return false;
+    }
+    BlockHeader fse;
+    return !options.fse || _fseBlockBits(histogram, length, fse) >= storedBits;
+}
+
+
+//
+// *This function compresses one block of input into a self-contained block
+// (see container.h): the block is counted, gets its own Huffman code lengths
+// and canonical code, and is encoded into memory.  No code is longer than
+// maxCodeLength (0 for no limit).  If bits is not null, the bit pattern of
+// the payload is appended to it.  If stats is not null, the block's stage
+// times and counters are added to it.  streams is as for _encodeBlock.
+//
+string compressBlock(const char* data, size_t length, int maxCodeLength,
+                     string* bits, CompressionStats* stats = nullptr,
+                     int streams = 0) {
+    Histogram histogram;
+    {
+        STATS_TIMER(stats, countSeconds);
+        countBytes((const unsigned char*)data, length, histogram);
+    }
+    BlockHeader header;
+    {
+        STATS_TIMER(stats, treeSeconds);
+        _blockCodeLengths(histogram, maxCodeLength, header.codeLengths);
+    }
+    return _encodeBlock(data, length, histogram, header, bits, stats,
+                        streams);
+}
+
+
+//
+// *This function compresses one chunk of input (at most options.blockSize
+// bytes) into one or more blocks and returns them.  Normally the chunk is
+// one block.  With options.splitBlocks, it is split where
+// chooseBlockBoundaries says separate codes pay for their headers, and a
+// block whose own code would not save more than its code lengths cost is
+// coded with the lengths of the block before it instead.  Blocks only
+// reuse lengths within the chunk, so chunks stay independent.  With
+// options.contextTables, each block is coded order-1 where that is
+// estimated to be smaller (see _contextCodeLengths).  With options.lzLevel,
+// each block is coded as LZ77 tokens where that beats order-0 (see
+// _encodeLzBlock), and by the other models otherwise.  With options.bwt,
+// a block is first tried as a BWT block (see _encodeBwtBlock), which is
+// kept if it beats order-0.  With options.fse, an order-0 block is coded
+// with tANS instead of its Huffman code (see fse.h) where that is estimated
+// to be smaller.  A block that none of them would shrink (see
+// _storeBlock) is stored as it is, without trying any of them.  blocks gets
+// one entry per block, with offsets from the start of the chunk.  bits and
+// stats are as for compressBlock.  If storedPayload is not null and the
+// whole chunk is stored as one block, the chunk is left off the end of the
+// returned block for the caller to copy from the input itself, and
+// storedPayload is set to its length (0 otherwise).
+//
+string compressChunk(const char* data, size_t length,
+                     const CompressOptions &options,
+                     vector<BlockIndexEntry> &blocks, string* bits,
+                     CompressionStats* stats = nullptr,
+                     uint32_t* storedPayload = nullptr) {
+    vector<size_t> bounds;
+    if (options.splitBlocks) {
+        STATS_TIMER(stats, countSeconds);
+        bounds = chooseBlockBoundaries((const unsigned char*)data, length);
+    } else {
+        bounds.push_back(0);
+        bounds.push_back(length);
+    }
+
+    string chunk;
+    blocks.clear();
+    if (storedPayload != nullptr) {
+        *storedPayload = 0;
+    }
+    vector<int> previous;
+    for (size_t k = 0; k + 1 < bounds.size(); k++) {
+        const char* begin = data + bounds[k];
+        size_t blockLength = bounds[k + 1] - bounds[k];
+        Histogram histogram;
+        {
+            STATS_TIMER(stats, countSeconds);
+            countBytes((const unsigned char*)begin, blockLength, histogram);
+        }
+        BlockHeader header;
+        BlockIndexEntry entry;
+        entry.offset = chunk.size();
+        entry.rawLength = (uint32_t)blockLength;
+        bool stored = _storeBlock(histogram, blockLength, options, stats);
+        uint32_t leftOff = 0;
+        string lzBlock;
+        if (!stored && options.bwt) {
+            lzBlock = _encodeBwtBlock(begin, blockLength, histogram, options,
+                                      header, bits, stats);
+        }
+        if (!stored && lzBlock.empty() && options.lzLevel > 0) {
+            lzBlock = _encodeLzBlock(begin, blockLength, histogram, options,
+                                     header, bits, stats);
+        }
+        if (stored) {
+            if (storedPayload != nullptr && bounds.size() == 2) {
+                leftOff = (uint32_t)blockLength;
+                *storedPayload = leftOff;
+            }
+            chunk += _encodeStoredBlock(begin, blockLength, histogram,
+                                        leftOff == 0, bits, stats);
+        } else if (!lzBlock.empty()) {
+            chunk += lzBlock;
+        } else if (options.contextTables > 1 &&
+            _contextCodeLengths(begin, blockLength, histogram, options,
+                                header, stats)) {
+            chunk += _encodeContextBlock(begin, blockLength, histogram,
+                                         header, bits, stats);
+        } else {
+            BlockHeader fse;
+            bool useFse = false;
+            {
+                STATS_TIMER(stats, treeSeconds);
+                _blockCodeLengths(histogram, options.maxCodeLength,
+                                  header.codeLengths);
+                if (!previous.empty()) {
+                    uint64_t headerBits = 8 * reusedLengthsSaving(header);
+                    uint64_t reused = _payloadBits(histogram, previous);
+                    uint64_t own = _payloadBits(histogram,
+                                                header.codeLengths);
+                    if (reused != UINT64_MAX && reused <= own + headerBits) {
+                        header.codeLengths = previous;
+                        header.sameLengths = true;
+                    }
+                }
+                if (options.fse) {
+                    // (leaving out the jump table of the Huffman block)
+                    double huffmanBits =
+                        _payloadBits(histogram, header.codeLengths) +
+                        8.0 * blockHeaderSize(header);
+                    useFse = _fseBlockBits(histogram, blockLength, fse) <
+                             huffmanBits;
+                }
+            }
+            if (useFse) {
+                chunk += _encodeFseBlock(begin, blockLength, histogram, fse,
+                                         bits, stats);
+                header.codeLengths.clear();
+            } else {
+                chunk += _encodeBlock(begin, blockLength, histogram, header,
+                                      bits, stats);
+            }
+        }
+        entry.blockLength = (uint32_t)(chunk.size() - entry.offset + leftOff);
+        blocks.push_back(entry);
+        // order-1, LZ77, BWT, stored and FSE blocks leave none for the next
+        // one to reuse
+        previous = header.codeLengths;
+    }
+    return chunk;
+}
+
+
+//
+// *This function decodes the payload of one block into out, which must have
+// room for header.rawLength bytes.  Throws a runtime_error if the payload does
+// not decode to exactly that many bytes.  If stats is not null, the block's
+// stage times and counters are added to it.
+//
+void decompressBlock(const BlockHeader &header, const char* payload,
+                     char* out, CompressionStats* stats = nullptr) {
+    if (header.model == MODEL_STORED) {
+        STATS_TIMER(stats, decodeSeconds);
+        memcpy(out, payload, header.rawLength);
+    } else if (header.model == MODEL_FSE) {
+        FseDecoder decoder;
+        {
+            STATS_TIMER(stats, treeSeconds);
+            decoder.build(header.fseCounts, header.fseTableLog);
+        }
+        STATS_TIMER(stats, decodeSeconds);
+        if (!decoder.decode((const unsigned char*)payload,
+                            header.payloadLength, out, header.rawLength)) {
+            throw runtime_error("CORRUPT BLOCK");
+        }
+    } else if (header.model == MODEL_BWT) {
+        BwtDecoder decoder;
+        {
+            STATS_TIMER(stats, treeSeconds);
+            if (!decoder.build(header.bwtLengths)) {
+                throw runtime_error("BAD CODE LENGTHS");
+            }
+        }
+        {
+            STATS_TIMER(stats, decodeSeconds);
+            if (!decoder.decodeSymbols((const unsigned char*)payload,
+                                       header.payloadLength, out,
+                                       header.rawLength)) {
+                throw runtime_error("CORRUPT BLOCK");
+            }
+        }
+        STATS_TIMER(stats, transformSeconds);
+        if (!decoder.invert(header.bwtRows, out, header.rawLength)) {
+            throw runtime_error("CORRUPT BLOCK");
+        }
+    } else if (header.model == MODEL_LZ77) {
+        LzDecoder decoder;
+        {
+            STATS_TIMER(stats, treeSeconds);
+            if (!decoder.build(header.literalLengths,
+                               header.distanceLengths)) {
+                throw runtime_error("BAD CODE LENGTHS");
+            }
+        }
+        STATS_TIMER(stats, decodeSeconds);
+        if (!decoder.decode((const unsigned char*)payload,
+                            header.payloadLength, out, header.rawLength)) {
+            throw runtime_error("CORRUPT BLOCK");
+        }
+    } else if (header.model == MODEL_ORDER1) {
+        ContextDecoder decoder;
+        {
+            STATS_TIMER(stats, treeSeconds);
+            if (!decoder.build(header.contextLengths, header.contextMap)) {
+                throw runtime_error("BAD CODE LENGTHS");
+            }
+        }
+        STATS_TIMER(stats, decodeSeconds);
+        if (!decoder.decodeStreams((const unsigned char*)payload,
+                                   header.payloadLength,
+                                   header.streams,
+                                   header.streamLengths, out,
+                                   header.rawLength)) {
+            throw runtime_error("CORRUPT BLOCK");
+        }
+    } else {
+        CanonicalDecoder decoder;
+        {
+            STATS_TIMER(stats, treeSeconds);
+            if (!decoder.build(header.codeLengths)) {
+                throw runtime_error("BAD CODE LENGTHS");
+            }
+        }
+        STATS_TIMER(stats, decodeSeconds);
+        if (header.streams > 1) {
+            if (!decoder.decodeStreams((const unsigned char*)payload,
+                                       header.payloadLength,
+                                       header.streamLengths, out,
+                                       header.rawLength)) {
+                throw runtime_error("CORRUPT BLOCK");
+            }
+        } else {
+            BitReader reader((const unsigned char*)payload,
+                             header.payloadLength);
+            if (decoder.decode(reader, out, header.rawLength) !=
+                header.rawLength) {
+                throw runtime_error("CORRUPT BLOCK");
+            }
+        }
+    }
+    STATS_ONLY(
+        if (stats != nullptr) {
+            stats->symbols += header.rawLength;
+            stats->blocks++;
+            stats->payloadBits += 8 * (uint64_t)header.payloadLength;
+            if (header.model == MODEL_STORED) {
+                stats->storedBytes += header.rawLength;
+            }
+        }
+    )
+}
+
+
+
+//
+// *This function returns a MODEL_DEDUP block of references that make up
+// rawLength bytes (see dedup.h), and sets blocks to its one entry.  If stats
+// is not null, the block is added to it.
+//
+string _encodeDedupBlock(const vector<DedupReference> &references,
+                         size_t rawLength, vector<BlockIndexEntry> &blocks,
+                         CompressionStats* stats) {
+    BlockHeader header;
+    header.rawLength = (uint32_t)rawLength;
+    header.payloadLength = (uint32_t)(references.size() * DEDUP_REFERENCE_SIZE);
+    header.model = MODEL_DEDUP;
+    ostringstream block;
+    writeBlockHeader(block, header);
+    writeReferences(block, references);
+    BlockIndexEntry entry = {0, header.rawLength,
+                             (uint32_t)block.str().size()};
+    blocks.assign(1, entry);
+    STATS_ONLY(
+        if (stats != nullptr) {
+            stats->blocks++;
+            stats->dedupBytes += rawLength;
+            stats->headerBytes += entry.blockLength;
+        }
+    )
+    return block.str();
+}
+
+
+//
+// *This struct is one compressed chunk (see compressChunk) on its way to the
+// output.
+//
+struct CompressedBlock {
+    string data;
+    uint32_t rawLength;
+    vector<BlockIndexEntry> blocks;  // offsets from the start of data
+    uint32_t storedLength;           // input bytes that follow data, if
+                                     // compressChunk left them off
+    string bits;
+    CompressionStats stats;
+
+    CompressedBlock() : rawLength(0), storedLength(0) {
+    }
+};
+
+
+//
+// *This function compresses a sequence of blocks to output: the header, every
+// block in order, then the block index.  nextBlock is called on this thread
+// to fetch each block of input; it sets begin and owner (which must keep the
+// bytes alive) and returns the block's length, or 0 at the end of the input.
+// Each block of input is compressed by compressChunk (so it can come out as
+// several blocks) on a pool of options.threads workers while a writer
+// thread writes finished blocks in order, so reading, compressing and writing
+// all overlap.  At most two blocks per worker are in flight, so memory use
+// depends on the block size and thread count but not on the input.  With
+// options.dedupWindowLog, the input goes through a Deduplicator on this
+// thread first, and runs of duplicate chunks become MODEL_DEDUP blocks
+// instead (which adds the window to the memory used).  If bits is not
+// null, the bit pattern of every payload is appended to it.  If
+// options.stats is not null, the run's stats are added to it.
+//
+void _compressBlocks(function<size_t(const char*&, shared_ptr<void>&)>
+                         nextBlock,
+                     ostream &output, const CompressOptions &options,
+                     string* bits) {
+    CompressionStats* stats = options.stats;
+    STATS_TIMER(stats, totalSeconds);
+    // the reader and the writer each keep their own, merged at the end
+    CompressionStats readStats;
+    CompressionStats writeStats;
+    atomic<uint64_t> inFlight(0);
+
+    ContainerHeader header;
+    header.version = CONTAINER_VERSION;
+    header.blockSize = (uint32_t)options.blockSize;
+    header.maxCodeLength = options.maxCodeLength;
+    header.dedupWindowLog = options.dedupWindowLog;
+    ostringstream headerBytes;
+    writeHeader(headerBytes, header);
+    output << headerBytes.str();
+    uint64_t offset = headerBytes.str().size();
+
+    vector<BlockIndexEntry> index;
+    ThreadPool pool(options.threads);
+    OrderedSink<CompressedBlock> writer(2 * pool.size(),
+        [&](CompressedBlock &block) {
+            {
+                STATS_TIMER(stats != nullptr ? &writeStats : nullptr,
+                            writeSeconds);
+                output.write(block.data.data(), block.data.size());
+            }
+            STATS_ONLY(
+                if (stats != nullptr) {
+                    writeStats.merge(block.stats);
+                    writeStats.bytesIn += block.rawLength;
+                    inFlight -= block.rawLength;
+                }
+            )
+            for (size_t i = 0; i < block.blocks.size(); i++) {
+                BlockIndexEntry entry = block.blocks[i];
+                entry.offset += offset;
+                index.push_back(entry);
+            }
+            offset += block.data.size();
+            if (bits != nullptr) {
+                *bits += block.bits;
+            }
+        });
+
+    bool makeBits = (bits != nullptr);
+    bool makeStats = (stats != nullptr);
+    // compresses the length bytes at begin, which owner keeps alive
+    auto submit = [&](const char* begin, size_t length,
+                      shared_ptr<void> owner) {
+        STATS_ONLY(
+            if (makeStats) {
+                readStats.peakBufferBytes =
+                    max(readStats.peakBufferBytes,
+                        (uint64_t)(inFlight += length));
+            }
+        )
+        function<CompressedBlock()> task = [=]() {
+            shared_ptr<void> keepAlive = owner;
+            CompressedBlock block;
+            block.rawLength = (uint32_t)length;
+            block.data = compressChunk(begin, length, options, block.blocks,
+                                       makeBits ? &block.bits : nullptr,
+                                       makeStats ? &block.stats : nullptr);
+            return block;
+        };
+        writer.push(pool.submit(task));
+    };
+    unique_ptr<Deduplicator> deduplicator;
+    if (options.dedupWindowLog > 0) {
+        deduplicator.reset(new Deduplicator(options.dedupWindowLog,
+                                            options.blockSize));
+    }
+    vector<DedupPiece> pieces;
+    while (true) {
+        const char* begin = nullptr;
+        shared_ptr<void> owner;
+        size_t length;
+        {
+            STATS_TIMER(makeStats ? &readStats : nullptr, readSeconds);
+            length = nextBlock(begin, owner);
+        }
+        if (!deduplicator) {
+            if (length == 0) {
+                break;
+            }
+            submit(begin, length, owner);
+            continue;
+        }
+        pieces.clear();
+        {
+            STATS_TIMER(makeStats ? &readStats : nullptr, dedupSeconds);
+            if (length > 0) {
+                deduplicator->push(begin, length, pieces);
+            } else {
+                deduplicator->finish(pieces);
+            }
+        }
+        for (size_t i = 0; i < pieces.size(); i++) {
+            const DedupPiece &piece = pieces[i];
+            if (piece.literals) {
+                submit(piece.literals->data(), piece.rawLength,
+                       piece.literals);
+                continue;
+            }
+            STATS_ONLY(
+                if (makeStats) {
+                    inFlight += piece.rawLength;
+                }
+            )
+            vector<DedupReference> references = piece.references;
+            size_t rawLength = piece.rawLength;
+            function<CompressedBlock()> task = [=]() {
+                CompressedBlock block;
+                block.rawLength = (uint32_t)rawLength;
+                block.data = _encodeDedupBlock(references, rawLength,
+                    block.blocks, makeStats ? &block.stats : nullptr);
+                return block;
+            };
+            writer.push(pool.submit(task));
+        }
+        if (length == 0) {
+            break;
+        }
+    }
+    writer.finish();
+    ostringstream indexBytes;
+    writeBlockIndex(indexBytes, index);
+    output << indexBytes.str();
+    output.flush();
+    if (!output) {
+        throw runtime_error("CANNOT WRITE OUTPUT");
+    }
+    STATS_ONLY(
+        if (stats != nullptr) {
+            stats->merge(readStats);
+            stats->merge(writeStats);
+            stats->bytesIn += writeStats.bytesIn;
+            stats->bytesOut += offset + indexBytes.str().size();
+            stats->headerBytes +=
+                headerBytes.str().size() + indexBytes.str().size();
+        }
+    )
+}
+
+
+//
+// *This function compresses everything left in the input stream to the output
+// stream, reading it one block at a time.  Neither stream has to be seekable,
+// so this works for pipes.
+//
+void compressStream(istream &input, ostream &output,
+                    const CompressOptions &options, string* bits = nullptr) {
+    size_t blockSize = options.blockSize;
+    _compressBlocks([&input, blockSize](const char*& begin,
+                                        shared_ptr<void>& owner) {
+        shared_ptr<vector<char> > data =
+            make_shared<vector<char> >(blockSize);
+        input.read(data->data(), data->size());
+        begin = data->data();
+        owner = data;
+        return (size_t)input.gcount();
+    }, output, options, bits);
+}
+
+
+//
+// *This function compresses the file inName into outName as a sequence of
+// independent blocks (see _compressBlocks).  A regular file is mapped and its
+// blocks are compressed in place; other inputs are read through a stream.
+//
+void compressFile(const string &inName, const string &outName,
+                  const CompressOptions &options, string* bits = nullptr) {
+    if (!isRegularFile(inName)) {
+        ifstream input(inName, ios::binary);
+        if (!input.is_open()) {
+            throw runtime_error("CANNOT OPEN " + inName);
+        }
+        ofstream output(outName, ios::binary);
+        if (!output.is_open()) {
+            throw runtime_error("CANNOT CREATE " + outName);
+        }
+        compressStream(input, output, options, bits);
+        return;
+    }
+
+    shared_ptr<MappedFile> mapped = make_shared<MappedFile>(inName);
+    ofstream output(outName, ios::binary);
+    if (!output.is_open()) {
+        throw runtime_error("CANNOT CREATE " + outName);
+    }
+    size_t offset = 0;
+    size_t blockSize = options.blockSize;
+    _compressBlocks([mapped, &offset, blockSize](const char*& begin,
+                                                 shared_ptr<void>& owner) {
+        size_t length = min(blockSize, mapped->size() - offset);
+        begin = mapped->data() + offset;
+        owner = mapped;
+        offset += length;
+        return length;
+    }, output, options, bits);
+}
+
+
 //
 // *This function completes the entire compression process.  Given a file,
-// filename, this function (1) builds a frequency map; (2) builds an encoding
-// tree; (3) builds an encoding map; (4) encodes the file (don't forget to
-// include the frequency map in the header of the output file).  This function
-// should create a compressed file named (filename + ".huf") and should also
-// return a string version of the bit pattern.
-//
-string compress(string filename) {
-    ifstream input(filename);
-    ofbitstream output(filename + ".huf");
-    hashmap map;
-    int size = 0;
-    mymap <int, string> encodingMap;
-    bool isFile = false;
+// filename, this function splits it into blocks and, for each block, (1)
+// counts the bytes; (2) builds an encoding tree; (3) turns the tree's code
+// lengths into a canonical encoding map; (4) encodes the block behind a small
+// header holding its length and code lengths (see container.h).  This
+// function should create a compressed file named (filename + ".huf") and, if
+// makeString is true, also return a string version of the bit pattern.  The
+// input is streamed, so large files only need a fixed amount of memory when
+// makeString is false.  If stats is not null, the run's stats are added to
+// it.  Throws a runtime_error if the file cannot be read.
+//
+string compress(string filename, bool makeString = true,
+                CompressionStats* stats = nullptr) {
+    string bits;
+    CompressOptions options;
+    options.stats = stats;
+    compressFile(filename, filename + ".huf", options,
+                 makeString ? &bits : nullptr);
+    return bits;
+}
+
 
-    if (input.is_open()) {
-        isFile = true;
+//
+// *This function decodes the blocks that follow the file header in input and
+// writes them to output in order.  Blocks are read on this thread, decoded on
+// a pool of threads workers, and written by a writer thread, with at most two
+// blocks per worker in flight.  It only reads forward, so it also works on
+// streams that cannot seek.  The writer keeps the last
+// 2^fileHeader.dedupWindowLog bytes it wrote, if that is not 0, and fills in
+// MODEL_DEDUP blocks from them.  If stats is not null, the blocks' stats are
+// added to it; bytesIn counts up to the end marker, since the block index
+// after it is never read.
+//
+void _decompressBlocks(istream &input, ostream &output,
+                       const ContainerHeader &fileHeader, int threads,
+                       string* content, CompressionStats* stats = nullptr) {
+    struct DecodedBlock {
+        vector<char> data;
+        vector<DedupReference> references;  // what data holds, if not empty
+        CompressionStats stats;
+    };
+    // the reader and the writer each keep their own, merged at the end
+    CompressionStats readStats;
+    CompressionStats writeStats;
+    atomic<uint64_t> inFlight(0);
+    unique_ptr<DedupHistory> history;
+    if (fileHeader.dedupWindowLog > 0) {
+        history.reset(new DedupHistory(fileHeader.dedupWindowLog));
     }
 
-    buildFrequencyMap(filename, isFile, map);
-    output << map;
-    HuffmanNode* encodingTree = buildEncodingTree(map);
-    encodingMap = buildEncodingMap(encodingTree);
-    freeTree(encodingTree);
+    ThreadPool pool(threads);
+    OrderedSink<DecodedBlock> writer(2 * pool.size(),
+        [&](DecodedBlock &block) {
+            if (history) {
+                STATS_TIMER(stats != nullptr ? &writeStats : nullptr,
+                            dedupSeconds);
+                char* out = block.data.data();
+                for (size_t i = 0; i < block.references.size(); i++) {
+                    const DedupReference &reference = block.references[i];
+                    if (reference.distance > history->size()) {
+                        throw runtime_error("CORRUPT BLOCK");
+                    }
+                    history->copy(history->size() - reference.distance,
+                                  reference.length, out);
+                    history->append(out, reference.length);
+                    out += reference.length;
+                }
+                if (block.references.empty()) {
+                    history->append(block.data.data(), block.data.size());
+                }
+            }
+            {
+                STATS_TIMER(stats != nullptr ? &writeStats : nullptr,
+                            writeSeconds);
+                output.write(block.data.data(), block.data.size());
+            }
+            if (content != nullptr) {
+                content->append(block.data.data(), block.data.size());
+            }
+            STATS_ONLY(
+                if (stats != nullptr) {
+                    writeStats.merge(block.stats);
+                    writeStats.bytesOut += block.data.size();
+                    inFlight -= block.data.size();
+                }
+            )
+        });
+
+    bool makeStats = (stats != nullptr);
+    vector<int> previous;  // code lengths of the last block
+    while (true) {
+        shared_ptr<BlockHeader> header = make_shared<BlockHeader>();
+        shared_ptr<vector<char> > payload;
+        {
+            STATS_TIMER(makeStats ? &readStats : nullptr, readSeconds);
+            if (!readBlockHeader(input, *header, fileHeader, &previous)) {
+                break;
+            }
+            previous = header->codeLengths;
+            payload = make_shared<vector<char> >(header->payloadLength);
+            if (!input.read(payload->data(), payload->size())) {
+                throw runtime_error("TRUNCATED FILE");
+            }
+        }
+        STATS_ONLY(
+            if (makeStats) {
+                size_t headerSize = blockHeaderSize(*header);
+                readStats.headerBytes += headerSize;
+                readStats.bytesIn += headerSize + header->payloadLength;
+                readStats.peakBufferBytes =
+                    max(readStats.peakBufferBytes,
+                        (uint64_t)(inFlight += header->rawLength));
+            }
+        )
+        int windowLog = fileHeader.dedupWindowLog;
+        function<DecodedBlock()> task = [header, payload, makeStats,
+                                         windowLog]() {
+            DecodedBlock block;
+            block.data.resize(header->rawLength);
+            if (header->model == MODEL_DEDUP) {
+                // filled in by the writer, which has the bytes before
+                if (!readReferences(payload->data(), payload->size(),
+                                    header->rawLength, windowLog,
+                                    block.references)) {
+                    throw runtime_error("CORRUPT BLOCK");
+                }
+                STATS_ONLY(
+                    if (makeStats) {
+                        block.stats.blocks++;
+                        block.stats.dedupBytes += header->rawLength;
+                    }
+                )
+                return block;
+            }
+            decompressBlock(*header, payload->data(), block.data.data(),
+                            makeStats ? &block.stats : nullptr);
+            return block;
+        };
+        writer.push(pool.submit(task));
+    }
+    writer.finish();
+    STATS_ONLY(
+        if (stats != nullptr) {
+            // the end marker
+            readStats.headerBytes += 4;
+            readStats.bytesIn += 4;
+            stats->merge(readStats);
+            stats->merge(writeStats);
+            stats->bytesIn += readStats.bytesIn;
+            stats->bytesOut += writeStats.bytesOut;
+        }
+    )
+}
 
 
-    return encode(input, encodingMap, output, size, isFile);
+//
+// *This function decodes the blocks of a file in parallel.  The input is
+// mapped and the output is created at its final size and mapped as well; the
+// block index gives every block's position in both, so each worker parses its
+// block in place and decodes it straight into its place in the output, and no
+// block waits for the ones before it.  If the output cannot be mapped, each
+// block is written with a positional write instead.
+// MODEL_STORED blocks are copied from the input file to the output file
+// without passing through memory (see copyRange), and MODEL_DEDUP blocks are
+// filled in last, in order, by copying within the output.  If content is not
+// null, the uncompressed data is also stored in it.  If stats is not null,
+// the blocks' stats are added to it.
+//
+void _decompressIndexedBlocks(const MappedFile &input, const string &outName,
+                              const vector<BlockIndexEntry> &index,
+                              const ContainerHeader &fileHeader, int threads,
+                              string* content,
+                              CompressionStats* stats = nullptr) {
+    vector<uint64_t> outOffsets(index.size() + 1, 0);
+    for (size_t i = 0; i < index.size(); i++) {
+        if (index[i].rawLength == 0 ||
+            index[i].rawLength > fileHeader.blockSize ||
+            index[i].offset + index[i].blockLength > input.size()) {
+            throw runtime_error("BAD BLOCK INDEX");
+        }
+        outOffsets[i + 1] = outOffsets[i] + index[i].rawLength;
+    }
+
+    // a block that reuses code lengths takes them from the last block
+    // before it that has its own, which must be an order-0 block
+    vector<size_t> lengthsFrom(index.size());
+    vector<bool> isDedup(index.size());
+    bool previousOrder0 = false;
+    for (size_t i = 0; i < index.size(); i++) {
+        MemoryBuffer buffer(input.data() + index[i].offset,
+                            index[i].blockLength);
+        istream blockStream(&buffer);
+        BlockHeader header;
+        if (!readBlockHeader(blockStream, header, fileHeader)) {
+            throw runtime_error("BAD BLOCK INDEX");
+        }
+        if (header.sameLengths) {
+            if (!previousOrder0) {
+                throw runtime_error("BAD CODE LENGTHS");
+            }
+            lengthsFrom[i] = lengthsFrom[i - 1];
+        } else {
+            lengthsFrom[i] = i;
+        }
+        previousOrder0 = (header.model == MODEL_ORDER0);
+        isDedup[i] = (header.model == MODEL_DEDUP);
+    }
+
+    MappedOutput output(outName, outOffsets.back());
+
+    // one per block, so the workers never share one
+    vector<CompressionStats> blockStats(stats != nullptr ? index.size() : 0);
+    ThreadPool pool(threads);
+    vector<future<void> > done;
+    vector<size_t> dedupBlocks;
+    for (size_t i = 0; i < index.size(); i++) {
+        if (isDedup[i]) {
+            dedupBlocks.push_back(i);
+            continue;
+        }
+        function<void()> task = [&, i]() {
+            CompressionStats* thisStats =
+                blockStats.empty() ? nullptr : &blockStats[i];
+            const BlockIndexEntry& entry = index[i];
+            const char* stored = input.data() + entry.offset;
+            MemoryBuffer buffer(stored, entry.blockLength);
+            istream blockStream(&buffer);
+            BlockHeader header;
+            {
+                STATS_TIMER(thisStats, readSeconds);
+                if (!readBlockHeader(blockStream, header, fileHeader) ||
+                    header.rawLength != entry.rawLength ||
+                    buffer.position() + header.payloadLength >
+                        entry.blockLength) {
+                    throw runtime_error("BAD BLOCK INDEX");
+                }
+                if (header.sameLengths) {
+                    const BlockIndexEntry& source = index[lengthsFrom[i]];
+                    MemoryBuffer sourceBuffer(input.data() + source.offset,
+                                              source.blockLength);
+                    istream sourceStream(&sourceBuffer);
+                    BlockHeader sourceHeader;
+                    readBlockHeader(sourceStream, sourceHeader, fileHeader);
+                    header.codeLengths = sourceHeader.codeLengths;
+                }
+            }
+
+            if (header.model == MODEL_STORED) {
+                // straight from one file to the other, in the kernel
+                STATS_TIMER(thisStats, writeSeconds);
+                output.copy(input.descriptor(),
+                            entry.offset + buffer.position(),
+                            header.rawLength, outOffsets[i]);
+                STATS_ONLY(
+                    if (thisStats != nullptr) {
+                        thisStats->symbols += header.rawLength;
+                        thisStats->blocks++;
+                        thisStats->storedBytes += header.rawLength;
+                        thisStats->payloadBits +=
+                            8 * (uint64_t)header.payloadLength;
+                    }
+                )
+                return;
+            }
+            vector<char> block;
+            char* out = output.at(outOffsets[i]);
+            if (out == nullptr) {
+                block.resize(header.rawLength);
+                out = block.data();
+            }
+            decompressBlock(header, stored + buffer.position(), out,
+                            thisStats);
+            STATS_TIMER(thisStats, writeSeconds);
+            output.write(out, header.rawLength, outOffsets[i]);
+        };
+        done.push_back(pool.submit(task));
+    }
+    for (size_t i = 0; i < done.size(); i++) {
+        done[i].get();
+    }
+    vector<DedupReference> references;
+    vector<char> copied;
+    for (size_t k = 0; k < dedupBlocks.size(); k++) {
+        size_t i = dedupBlocks[k];
+        CompressionStats* thisStats =
+            blockStats.empty() ? nullptr : &blockStats[i];
+        STATS_TIMER(thisStats, dedupSeconds);
+        const BlockIndexEntry& entry = index[i];
+        const char* stored = input.data() + entry.offset;
+        MemoryBuffer buffer(stored, entry.blockLength);
+        istream blockStream(&buffer);
+        BlockHeader header;
+        if (!readBlockHeader(blockStream, header, fileHeader) ||
+            header.rawLength != entry.rawLength ||
+            buffer.position() + header.payloadLength > entry.blockLength) {
+            throw runtime_error("BAD BLOCK INDEX");
+        }
+        if (!readReferences(stored + buffer.position(), header.payloadLength,
+                            header.rawLength, fileHeader.dedupWindowLog,
+                            references)) {
+            throw runtime_error("CORRUPT BLOCK");
+        }
+        uint64_t at = outOffsets[i];
+        for (size_t r = 0; r < references.size(); r++) {
+            if (references[r].distance > at) {
+                throw runtime_error("CORRUPT BLOCK");
+            }
+            // the distance is never less than the length, so the copy
+            // does not overlap itself
+            copied.resize(references[r].length);
+            output.read(copied.data(), copied.size(),
+                        at - references[r].distance);
+            output.write(copied.data(), copied.size(), at);
+            at += references[r].length;
+        }
+        STATS_ONLY(
+            if (thisStats != nullptr) {
+                thisStats->blocks++;
+                thisStats->dedupBytes += header.rawLength;
+            }
+        )
+    }
+    STATS_ONLY(
+        if (stats != nullptr) {
+            uint64_t payloadBytes = 0;
+            for (size_t i = 0; i < blockStats.size(); i++) {
+                stats->merge(blockStats[i]);
+                payloadBytes += blockStats[i].payloadBits / 8;
+            }
+            // everything in the file that is not payload
+            stats->headerBytes += input.size() - payloadBytes;
+            stats->bytesIn += input.size();
+            stats->bytesOut += outOffsets.back();
+        }
+    )
+    if (content != nullptr && outOffsets.back() > 0) {
+        if (output.at(0) != nullptr) {
+            content->assign(output.at(0), outOffsets.back());
+        } else {
+            ifstream reread(outName, ios::binary);
+            content->resize(outOffsets.back());
+            reread.read(&(*content)[0], content->size());
+        }
+    }
+}
+
+
+//
+// *This function decompresses everything left in the input stream to the
+// output stream.  It reads container files as well as files with the older
+// textual frequency map header, and only reads forward, so it works for
+// pipes.  Blocks are decoded on threads workers (0 for one per core).  If
+// content is not null, the uncompressed data is also stored in it.  If stats
+// is not null, the run's stats are added to it (only the time and bytes out
+// for files without blocks).  Throws a runtime_error if the input is
+// damaged.
+//
+void decompressStream(istream &input, ostream &output, int threads = 1,
+                      string* content = nullptr,
+                      CompressionStats* stats = nullptr) {
+    STATS_TIMER(stats, totalSeconds);
+    string decoded;
+    if (input.peek() == '{') {
+        hashmap map;
+        input >> map;
+        map.put(PSEUDO_EOF, 1);
+        HuffmanNode* encodingTree = buildEncodingTree(map);
+        decoded = decodeTree(input, encodingTree, output);
+        freeTree(encodingTree);
+    } else {
+        ContainerHeader header;
+        readHeader(input, header);
+        STATS_ONLY(
+            if (stats != nullptr) {
+                ostringstream headerBytes;
+                writeHeader(headerBytes, header);
+                stats->headerBytes += headerBytes.str().size();
+                stats->bytesIn += headerBytes.str().size();
+            }
+        )
+        _decompressBlocks(input, output, header, threads, content, stats);
+        return;
+    }
+    STATS_ONLY(
+        if (stats != nullptr) {
+            stats->bytesOut += decoded.size();
+        }
+    )
+    if (content != nullptr) {
+        *content = decoded;
+    }
+}
+
+
+//
+// *This function decompresses the file inName into outName.  Files with a
+// block index are decoded through memory mappings on threads workers (0 for
+// one per core); anything else goes through decompressStream.  If content
+// is not null, the uncompressed data is also stored in it.  If stats is not
+// null, the run's stats are added to it.  Throws a runtime_error if the file is
+// damaged.
+//
+void decompressFile(const string &inName, const string &outName,
+                    int threads = 1, string* content = nullptr,
+                    CompressionStats* stats = nullptr) {
+    ifstream input(inName, ios::binary);
+    if (!input.is_open()) {
+        throw runtime_error("CANNOT OPEN " + inName);
+    }
+
+    if (isRegularFile(inName) && input.peek() != '{') {
+        ContainerHeader header;
+        readHeader(input, header);
+        vector<BlockIndexEntry> index;
+        try {
+            readBlockIndex(input, index);
+        } catch (const runtime_error&) {
+            index.clear();
+        }
+        if (!index.empty()) {
+            STATS_TIMER(stats, totalSeconds);
+            MappedFile mapped(inName);
+            _decompressIndexedBlocks(mapped, outName, index, header,
+                                     threads, content, stats);
+            return;
+        }
+        input.clear();
+        input.seekg(0);
+    }
+
+    ofstream output(outName, ios::binary);
+    decompressStream(input, output, threads, content, stats);
 }
 
 
 //
 // *This function completes the entire decompression process.  Given the file,
-// filename (which should end with ".huf"), (1) extract the header and build
-// the frequency map; (2) build an encoding tree from the frequency map; (3)
-// using the encoding tree to decode the file.  This function should create a
-// compressed file using the following convention.
+// filename (which should end with ".huf"), it decodes every block with a
+// canonical decoding table rebuilt from the block's code lengths.  This
+// function should create a compressed file using the following convention.
 // If filename = "example.txt.huf", then the uncompressed file should be named
 // "example_unc.txt".  The function should return a string version of the
 // uncompressed file.  Note: this function should reverse what the compress
-// function did.
+// function did.  If stats is not null, the run's stats are added to it.
+// Throws a runtime_error if the file is damaged.
 //
-string decompress(string filename) {
-
+string decompress(string filename, CompressionStats* stats = nullptr) {
     string content = "";
-    ifbitstream input(filename);
-    hashmap map;
-    mymap <int, string> encodingMap;
-    bool isFile = false;
-
-    if (input.is_open()) {
-        isFile = true;
-    }
-    size_t pos = filename.find(".txt.huf");
+    string outName = filename;
+    size_t pos = outName.find(".txt.huf");
 
     if ((int)pos >= 0) {
-        filename = filename.substr(0, pos);
+        outName = outName.substr(0, pos);
     }
-    filename += "_unc.txt";
-
-    ofstream output(filename);
-    input >> map;
-    buildFrequencyMap(filename, isFile, map);
-    HuffmanNode* encodingTree = buildEncodingTree(map);
-    content = decode(input, encodingTree, output);
-    freeTree(encodingTree);
+    outName += "_unc.txt";
 
+    decompressFile(filename, outName, 1, &content, stats);
     return content;
 }